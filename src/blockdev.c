@@ -0,0 +1,627 @@
+/*
+ * blockdev.c - Flush one block device without touching the rest
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+/* For syncfs() and fallocate() */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include <linux/blkpg.h>
+#include <linux/falloc.h>
+#include <linux/hdreg.h>
+#include <linux/netlink.h>
+
+#include <glib.h>
+#include <glib/gi18n.h>
+
+#include "blockdev.h"
+#include "mount-info.h"
+
+/* from <linux/fs.h> */
+#ifndef BLKFLSBUF
+#define BLKFLSBUF 	_IO(0x12,97) /* flush buffer cache */
+#endif
+#ifndef BLKSSZGET
+#define BLKSSZGET 	_IO(0x12,104) /* get block device sector size */
+#endif
+#ifndef BLKGETSIZE64
+#define BLKGETSIZE64 	_IOR(0x12,114,size_t) /* return device size in bytes */
+#endif
+#ifndef BLKDISCARD
+#define BLKDISCARD 	_IO(0x12,119)
+#endif
+#ifndef BLKSECDISCARD
+#define BLKSECDISCARD 	_IO(0x12,125)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT 	_IO(0x12,127)
+#endif
+
+/* The kernel is happy to discard a whole disk in one go, but then there's
+ * no progress to show and a cancel has to wait for all of it. Zeroing out
+ * may mean the kernel writing real zeroes, so that goes in smaller pieces */
+#define DISCARD_CHUNK_MAX 	(G_GUINT64_CONSTANT(1) << 30)
+#define ZEROOUT_CHUNK 		(G_GUINT64_CONSTANT(64) << 20)
+
+#define KiB 			(G_GINT64_CONSTANT(1) << 10)
+#define MiB 			(G_GINT64_CONSTANT(1) << 20)
+#define GiB 			(G_GINT64_CONSTANT(1) << 30)
+
+/* Where filesystems, RAID, LVM and LUKS keep the headers blkid goes by.
+ * Negative offsets count back from the end of the device */
+static const struct {
+	gint64 offset;
+	gint64 len;
+} signature_areas[] = {
+	/* Partition tables and the primary GPT, boot sectors, nearly every
+	 * filesystem's superblock, LVM labels, LUKS and md 1.1/1.2 headers,
+	 * and ZFS's first two labels */
+	{ 0, 			1 * MiB },
+	/* LUKS2's secondary headers past the first MiB */
+	{ 1 * MiB, 		4 * KiB },
+	{ 2 * MiB, 		4 * KiB },
+	{ 4 * MiB, 		4 * KiB },
+	/* btrfs's superblock copies */
+	{ 64 * MiB, 		4 * KiB },
+	{ 256 * GiB, 		4 * KiB },
+	/* The backup GPT, md 0.90 and 1.0 superblocks, ZFS's last two labels
+	 * and UDF's last anchor */
+	{ -1 * MiB, 		1 * MiB },
+};
+
+#define WIPE_BUFFER_SIZE 	(1 * MiB)
+
+typedef struct {
+	guint64 start, end;
+} WipeRange;
+
+/* The kernel's uevents go to group 1, and udev passes them on to group 2
+ * once it's done with them */
+#define UEVENT_GROUP_KERNEL 	1
+#define UEVENT_GROUP_UDEV 	2
+#define UEVENT_BUFFER_SIZE 	8192
+
+/* How long to nap between checks when we can't have uevents */
+#define EVENT_FALLBACK_WAIT 	100
+
+struct _BlockdevEventWatch {
+	int fd;
+};
+
+/* fsync() on a block device only covers the device's own page cache; if
+ * something is mounted from it, the filesystem's dirty data is somewhere
+ * else entirely, and has to be written out through the mount */
+static void
+sync_mounted_filesystems(dev_t dev)
+{
+	MountTable* mounts = mount_table_new();
+	const GSList* iter;
+	int fd;
+
+	for(iter = mount_table_lookup(mounts, dev); iter != NULL; iter = iter->next) {
+		const MountEntry* mount = iter->data;
+
+		if(mount->is_swap)
+			continue;
+		if( (fd = open(mount->mountpoint, O_RDONLY)) < 0 ) {
+			g_debug("Can't open %s: %s", mount->mountpoint, g_strerror(errno));
+			continue;
+		}
+
+		g_debug("Syncing %s before flushing it", mount->mountpoint);
+#ifdef HAVE_SYNCFS
+		if(syncfs(fd) != 0)
+			g_debug("syncfs on %s failed: %s", mount->mountpoint, g_strerror(errno));
+#else
+		/* Without syncfs, the global one is all there is */
+		sync();
+#endif
+		close(fd);
+	}
+
+	mount_table_free(mounts);
+}
+
+
+/*
+ * Public functions
+ */
+
+gboolean
+blockdev_flush_fd(int fd, const char* dev, GError** error)
+{
+	struct stat st;
+
+	if(fstat(fd, &st) == 0 && S_ISBLK(st.st_mode))
+		sync_mounted_filesystems(st.st_rdev);
+
+	if(fdatasync(fd) != 0) {
+		g_set_error(error, 0, 0, _("Cannot flush %s: %s"), dev, g_strerror(errno));
+		return FALSE;
+	}
+
+	/* Dropping the cache needs CAP_SYS_ADMIN, and the data is already on
+	 * the disk by now, so this failing isn't worth telling anyone about */
+	if(ioctl(fd, BLKFLSBUF, 0) != 0)
+		g_debug("BLKFLSBUF on %s failed: %s", dev, g_strerror(errno));
+
+	return TRUE;
+}
+
+/* The queue limits live with the whole disk, so a partition has to look one
+ * directory up */
+static guint64
+get_queue_limit(dev_t dev, const char* name)
+{
+	const char* formats[] = { "/sys/dev/block/%u:%u/queue/%s", "/sys/dev/block/%u:%u/../queue/%s", NULL };
+	unsigned long long value;
+	gchar* path;
+	FILE* f;
+	int i;
+
+	for(i=0; formats[i] != NULL; i++) {
+		path = g_strdup_printf(formats[i], major(dev), minor(dev), name);
+		f = fopen(path, "r");
+		g_free(path);
+		if(!f)
+			continue;
+
+		if(fscanf(f, "%llu", &value) != 1)
+			value = 0;
+		fclose(f);
+		return (guint64)value;
+	}
+
+	return 0;
+}
+
+static int
+discard_range(int fd, gboolean is_file, BlockdevDiscardMode mode, guint64 offset, guint64 len)
+{
+	guint64 range[2] = { offset, len };
+
+	if(is_file) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+		/* A hole reads back as zeroes, which covers all three */
+		return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)len);
+#else
+		errno = EOPNOTSUPP;
+		return -1;
+#endif
+	}
+
+	switch(mode) {
+	case BLOCKDEV_DISCARD_SECURE:
+		return ioctl(fd, BLKSECDISCARD, range);
+	case BLOCKDEV_DISCARD_ZEROOUT:
+		return ioctl(fd, BLKZEROOUT, range);
+	default:
+		return ioctl(fd, BLKDISCARD, range);
+	}
+}
+
+static gint
+compare_wipe_ranges(gconstpointer a, gconstpointer b)
+{
+	const WipeRange *ra = a, *rb = b;
+	return (ra->start < rb->start ? -1 : (ra->start > rb->start ? 1 : 0));
+}
+
+/* Turns signature_areas into sorted, sector-aligned ranges that don't
+ * overlap, for a device this big; returns how many there are */
+static guint
+get_wipe_ranges(guint64 size, guint sector_size, WipeRange* ranges)
+{
+	guint64 start, end;
+	guint i, count = 0, merged = 0;
+
+	for(i=0; i < G_N_ELEMENTS(signature_areas); i++) {
+		gint64 offset = signature_areas[i].offset;
+
+		if(offset < 0)
+			start = ((guint64)-offset > size ? 0 : size + offset);
+		else
+			start = (guint64)offset;
+		if(start >= size)
+			continue;
+
+		end = MIN(start + signature_areas[i].len, size);
+		start -= start % sector_size;
+		end = MIN(end + (sector_size - end % sector_size) % sector_size, size);
+
+		ranges[count].start = start; 	ranges[count].end = end;
+		count++;
+	}
+
+	if(count == 0)
+		return 0;
+
+	qsort(ranges, count, sizeof(WipeRange), compare_wipe_ranges);
+	for(i=1; i < count; i++) {
+		if(ranges[i].start <= ranges[merged].end) {
+			ranges[merged].end = MAX(ranges[merged].end, ranges[i].end);
+			continue;
+		}
+		ranges[++merged] = ranges[i];
+	}
+
+	return merged + 1;
+}
+
+static gboolean
+pwrite_all(int fd, const guchar* buf, gsize len, guint64 offset)
+{
+	gssize ret;
+
+	while(len > 0) {
+		if( (ret = pwrite(fd, buf, len, offset)) < 0 ) {
+			if(errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		/* Nothing written, and no error: there's no more room */
+		if(ret == 0) {
+			errno = ENOSPC;
+			return FALSE;
+		}
+		buf += ret; 	len -= ret; 	offset += ret;
+	}
+	return TRUE;
+}
+
+static gboolean
+blkpg_partition_op(int fd, int op, int partition, guint64 start, guint64 size)
+{
+	struct blkpg_partition part;
+	struct blkpg_ioctl_arg arg;
+
+	memset(&part, 0, sizeof(part));
+	part.pno = partition;
+	part.start = (long long)start;
+	part.length = (long long)size;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.op = op;
+	arg.datalen = sizeof(part);
+	arg.data = &part;
+
+	if(ioctl(fd, BLKPG, &arg) != 0) {
+		g_debug("BLKPG %s of partition %d failed: %s", 
+			(op == BLKPG_ADD_PARTITION ? "add" : "delete"), partition, g_strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Both kinds of message are NUL-separated KEY=value strings (udev's have a
+ * binary header in front, which won't match anything) */
+static gboolean
+is_block_uevent(const gchar* buf, gssize len)
+{
+	const gchar* p;
+
+	for(p = buf; p < buf + len; p += strlen(p) + 1) {
+		if(!strcmp(p, "SUBSYSTEM=block"))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+gboolean
+blockdev_flush(const char* dev, GError** error)
+{
+	gboolean ret;
+	int fd;
+
+	if( (fd = open(dev, O_RDONLY)) < 0 ) {
+		g_set_error(error, 0, 0, _("Cannot open %s: %s"), dev, g_strerror(errno));
+		return FALSE;
+	}
+
+	ret = blockdev_flush_fd(fd, dev, error);
+	close(fd);
+	return ret;
+}
+
+gboolean
+blockdev_get_geometry(int fd, guint64* size, guint* sector_size, guint64* start)
+{
+	struct hd_geometry geo;
+	struct stat st;
+	int ssz = 512;
+
+	if(fstat(fd, &st) != 0)
+		return FALSE;
+
+	if(S_ISREG(st.st_mode)) {
+		*size = (guint64)st.st_size;
+		*sector_size = 512;
+		*start = 0;
+		return TRUE;
+	}
+
+	if(!S_ISBLK(st.st_mode) || ioctl(fd, BLKGETSIZE64, size) != 0)
+		return FALSE;
+
+	if(ioctl(fd, BLKSSZGET, &ssz) != 0 || ssz < 512)
+		ssz = 512;
+	*sector_size = (guint)ssz;
+
+	/* Only partitions have a start; whole disks say 0 */
+	*start = (ioctl(fd, HDIO_GETGEO, &geo) == 0 ? (guint64)geo.start : 0);
+	return TRUE;
+}
+
+gboolean
+blockdev_add_partition(int fd, int partition, guint64 start, guint64 size)
+{
+	return blkpg_partition_op(fd, BLKPG_ADD_PARTITION, partition, start, size);
+}
+
+gboolean
+blockdev_del_partition(int fd, int partition)
+{
+	return blkpg_partition_op(fd, BLKPG_DEL_PARTITION, partition, 0, 0);
+}
+
+gboolean
+blockdev_discard(const char* dev, BlockdevDiscardMode mode,
+		 BlockdevProgressFunc progress_cb, gpointer user_data, GError** error)
+{
+	guint64 size, start, offset, chunk, granularity, len;
+	guint sector_size;
+	gboolean is_file, ret = FALSE;
+	struct stat st;
+	int fd;
+
+	if(mode == BLOCKDEV_DISCARD_NONE)
+		return TRUE;
+
+	if( (fd = open(dev, O_WRONLY)) < 0 ) {
+		g_set_error(error, 0, 0, _("Cannot open %s: %s"), dev, g_strerror(errno));
+		return FALSE;
+	}
+
+	if(fstat(fd, &st) != 0 || !blockdev_get_geometry(fd, &size, &sector_size, &start)) {
+		g_set_error(error, 0, 0, _("Cannot read the size of %s"), dev);
+		goto out;
+	}
+	is_file = S_ISREG(st.st_mode);
+
+	/* Discards have to come in whole units of the device's granularity,
+	 * and no bigger than it can take at once; zeroing only cares about
+	 * sectors */
+	granularity = sector_size;
+	chunk = ZEROOUT_CHUNK;
+	if(!is_file && mode != BLOCKDEV_DISCARD_ZEROOUT) {
+		chunk = get_queue_limit(st.st_rdev, "discard_max_bytes");
+		granularity = MAX(get_queue_limit(st.st_rdev, "discard_granularity"), sector_size);
+
+		if(chunk == 0) {
+			if(mode == BLOCKDEV_DISCARD_SECURE) {
+				g_set_error(error, 0, 0, _("%s doesn't support secure erase"), dev);
+				goto out;
+			}
+
+			/* It's only ever a bonus */
+			g_debug("%s can't discard, skipping it", dev);
+			ret = TRUE;
+			goto out;
+		}
+	} else if(is_file)
+		chunk = DISCARD_CHUNK_MAX;
+
+	chunk = MIN(chunk, DISCARD_CHUNK_MAX);
+	chunk = MAX(chunk - chunk % granularity, granularity);
+	g_debug("Discarding %s in %llu byte pieces, granularity %llu", dev, 
+		(unsigned long long)chunk, (unsigned long long)granularity);
+
+	for(offset = 0; offset < size; offset += len) {
+		if(progress_cb && !progress_cb((gdouble)offset / (gdouble)size, user_data)) {
+			g_set_error(error, 0, 0, _("Discarding %s was cancelled"), dev);
+			goto out;
+		}
+
+		/* A partition needn't start on a discard unit; line the first
+		 * piece up so the rest do */
+		len = chunk - ((start * 512 + offset) % granularity);
+		len = MIN(len, size - offset);
+
+		if(discard_range(fd, is_file, mode, offset, len) == 0)
+			continue;
+
+		if(mode == BLOCKDEV_DISCARD_TRIM && (errno == EOPNOTSUPP || errno == ENOTTY)) {
+			g_debug("%s can't discard, skipping it", dev);
+			ret = TRUE;
+			goto out;
+		}
+
+		g_set_error(error, 0, 0, _("Cannot discard %s: %s"), dev, g_strerror(errno));
+		goto out;
+	}
+
+	if(progress_cb)
+		progress_cb(1.0, user_data);
+	ret = TRUE;
+
+out:
+	close(fd);
+	return ret;
+}
+
+gboolean
+blockdev_zero_range(int fd, const char* dev, guint64 offset, guint64 len, GError** error)
+{
+	struct stat st;
+	guint64 piece;
+
+	if(fstat(fd, &st) != 0) {
+		g_set_error(error, 0, 0, _("Cannot zero %s: %s"), dev, g_strerror(errno));
+		return FALSE;
+	}
+
+	for(; len > 0; offset += piece, len -= piece) {
+		piece = MIN(len, ZEROOUT_CHUNK);
+		if(discard_range(fd, S_ISREG(st.st_mode), BLOCKDEV_DISCARD_ZEROOUT, offset, piece) != 0) {
+			g_set_error(error, 0, 0, _("Cannot zero %s at byte %llu: %s"), dev, 
+				    (unsigned long long)offset, g_strerror(errno));
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+gboolean
+blockdev_wipe_signatures(const char* dev, GError** error)
+{
+	WipeRange ranges[G_N_ELEMENTS(signature_areas)];
+	guint64 size, start, offset;
+	guint sector_size, count, i;
+	guchar* zeroes = NULL;
+	gboolean ret = FALSE;
+	gsize len;
+	int fd;
+
+	if( (fd = open(dev, O_WRONLY)) < 0 ) {
+		g_set_error(error, 0, 0, _("Cannot open %s: %s"), dev, g_strerror(errno));
+		return FALSE;
+	}
+
+	if(!blockdev_get_geometry(fd, &size, &sector_size, &start)) {
+		g_set_error(error, 0, 0, _("Cannot read the size of %s"), dev);
+		goto out;
+	}
+
+	/* All of it goes out of the one zeroed buffer, and only gets flushed
+	 * once at the end */
+	count = get_wipe_ranges(size, sector_size, ranges);
+	zeroes = g_malloc0(WIPE_BUFFER_SIZE);
+	for(i=0; i < count; i++) {
+		for(offset = ranges[i].start; offset < ranges[i].end; offset += len) {
+			len = (gsize)MIN(ranges[i].end - offset, WIPE_BUFFER_SIZE);
+			if(!pwrite_all(fd, zeroes, len, offset)) {
+				g_set_error(error, 0, 0, _("Cannot write to %s: %s"), dev, g_strerror(errno));
+				goto out;
+			}
+		}
+	}
+	g_debug("Wiped %u signature areas on %s", count, dev);
+
+	ret = blockdev_flush_fd(fd, dev, error);
+
+out:
+	g_free(zeroes);
+	close(fd);
+	return ret;
+}
+
+BlockdevEventWatch*
+blockdev_event_watch_new(void)
+{
+	BlockdevEventWatch* ret = g_new0(BlockdevEventWatch, 1);
+	struct sockaddr_nl addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = UEVENT_GROUP_KERNEL | UEVENT_GROUP_UDEV;
+
+	if( (ret->fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT)) < 0 ||
+	    bind(ret->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ) {
+		g_debug("Can't listen for uevents, we'll have to poll: %s", g_strerror(errno));
+		if(ret->fd >= 0)
+			close(ret->fd);
+		ret->fd = -1;
+		return ret;
+	}
+
+	fcntl(ret->fd, F_SETFD, FD_CLOEXEC);
+	return ret;
+}
+
+void
+blockdev_event_watch_free(BlockdevEventWatch* watch)
+{
+	if(watch->fd >= 0)
+		close(watch->fd);
+	g_free(watch);
+}
+
+gboolean
+blockdev_event_watch_wait(BlockdevEventWatch* watch, guint timeout_ms)
+{
+	gchar buf[UEVENT_BUFFER_SIZE];
+	struct pollfd pfd;
+	GTimeVal now, deadline;
+	glong remaining;
+	gssize len;
+	gboolean ret = FALSE;
+
+	if(watch->fd < 0) {
+		g_usleep(MIN(timeout_ms, EVENT_FALLBACK_WAIT) * 1000);
+		return FALSE;
+	}
+
+	g_get_current_time(&deadline);
+	g_time_val_add(&deadline, (glong)timeout_ms * 1000);
+
+	while(!ret) {
+		g_get_current_time(&now);
+		remaining = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_usec - now.tv_usec) / 1000;
+		if(remaining <= 0)
+			break;
+
+		pfd.fd = watch->fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if(poll(&pfd, 1, (int)remaining) <= 0)
+			continue;
+
+		/* Drain everything that's queued up; one of them being for a
+		 * block device is enough */
+		while( (len = recv(watch->fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0 ) {
+			buf[len] = '\0';
+			if(is_block_uevent(buf, len))
+				ret = TRUE;
+		}
+	}
+
+	return ret;
+}
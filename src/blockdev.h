@@ -0,0 +1,95 @@
+/*
+ * blockdev.h - Flush one block device without touching the rest
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef _BLOCKDEV_H
+#define _BLOCKDEV_H
+
+#include <glib.h>
+
+/* Writes out what the kernel has buffered for this one device, including
+ * any filesystem mounted from it, and drops it from the buffer cache so the
+ * next read comes from the disk. Unlike sync(), other devices' dirty data
+ * is left alone. This blocks; don't call it from the main loop */
+gboolean blockdev_flush(const char* dev, GError** error);
+
+/* The same for a device that's already open */
+gboolean blockdev_flush_fd(int fd, const char* dev, GError** error);
+
+/* Size in bytes, logical sector size, and where the device starts on its
+ * disk in 512-byte sectors (0 for a whole disk). Works on image files too,
+ * which are taken to have 512-byte sectors */
+gboolean blockdev_get_geometry(int fd, guint64* size, guint* sector_size, guint64* start);
+
+/* Tell the kernel about one partition at a time (BLKPG), rather than having
+ * it re-read the whole table with BLKRRPART. fd is the whole disk; offsets
+ * are in bytes. This doesn't touch what's on the disk */
+gboolean blockdev_add_partition(int fd, int partition, guint64 start, guint64 size);
+gboolean blockdev_del_partition(int fd, int partition);
+
+typedef enum {
+	BLOCKDEV_DISCARD_NONE,
+	BLOCKDEV_DISCARD_TRIM,		/* Tell flash the blocks are free; what
+					   they read back as is up to it */
+	BLOCKDEV_DISCARD_ZEROOUT,	/* Reads back as zeroes; the kernel
+					   writes them if the device can't */
+	BLOCKDEV_DISCARD_SECURE,	/* Like TRIM, but the old data has to
+					   really be gone */
+} BlockdevDiscardMode;
+
+/* Called between pieces of a long operation; return FALSE to stop it */
+typedef gboolean (*BlockdevProgressFunc) (gdouble fraction, gpointer user_data);
+
+/* Throws away everything on dev, in pieces that respect the device's
+ * discard limits. On image files all of them punch a hole. Devices that
+ * can't TRIM are skipped quietly, since it's only ever an optimization;
+ * not being able to do the others is an error. This blocks */
+gboolean blockdev_discard(const char* dev, BlockdevDiscardMode mode,
+			  BlockdevProgressFunc progress_cb, gpointer user_data, GError** error);
+
+/* Makes len bytes of an open device read back as zeroes, letting the
+ * device do it where it can (or punching a hole, in an image file); both
+ * have to be whole sectors. This blocks */
+gboolean blockdev_zero_range(int fd, const char* dev, guint64 offset, guint64 len, GError** error);
+
+/* Zeroes just the places old filesystem, RAID, LVM and LUKS headers and
+ * partition tables (including the backup GPT at the end) live, so blkid and
+ * udev don't go finding them again after we've formatted; a few MB at most,
+ * however big the device is. This blocks */
+gboolean blockdev_wipe_signatures(const char* dev, GError** error);
+
+typedef struct _BlockdevEventWatch BlockdevEventWatch;
+
+/* Listens for block device uevents: the kernel's, and udev's once it has
+ * made the device node. Create it before making the change you want to hear
+ * about, or the event might come and go first */
+BlockdevEventWatch* blockdev_event_watch_new(void);
+void blockdev_event_watch_free(BlockdevEventWatch* watch);
+
+/* Returns TRUE as soon as an event for any block device comes in, FALSE if
+ * none does within timeout_ms. Without netlink it just naps for a bit, so
+ * always go back and check for whatever it was you were waiting for */
+gboolean blockdev_event_watch_wait(BlockdevEventWatch* watch, guint timeout_ms);
+
+#endif
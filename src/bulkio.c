@@ -0,0 +1,1373 @@
+/*
+ * bulkio.c - Stream reads and writes over a whole device as fast as it takes them
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+
+/* For O_DIRECT */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include <glib.h>
+#include <glib/gi18n.h>
+
+#include "blockdev.h"
+#include "bulkio.h"
+
+/* Going through a drive end to end is only as fast as we keep it busy. The
+ * page cache just gets in the way of that (everything gets copied once
+ * more, and written back or read ahead whenever the kernel sees fit), so we
+ * go around it with O_DIRECT and keep queue_depth big requests in flight
+ * ourselves. io_uring lets one thread do that; where it isn't there (old
+ * kernels, or seccomp filters that keep it from us) every request gets a
+ * thread. */
+
+#define DEFAULT_BLOCK_SIZE 	(1 << 20)
+
+/* O_DIRECT buffers have to be aligned to the logical sector size; a page is
+ * at least that on anything we'll see */
+#define BUFFER_ALIGN 		4096
+
+/* More threads than this just fight over the disk */
+#define MAX_THREADS 		32
+
+/* Write-verify goes a region at a time; it's big enough that the drive
+ * can't hand the last one back out of its cache, and compares what it reads
+ * a piece of this size at a time, reporting sectors of this size */
+#define VERIFY_REGION_SIZE 	(G_GUINT64_CONSTANT(256) << 20)
+#define VERIFY_PIECE_SIZE 	16384
+#define VERIFY_SECTOR_SIZE 	512
+
+/* A read that takes this many times longer than half the reads so far
+ * (and at least SLOW_MIN_USEC) most likely had the drive retrying it; we
+ * only start judging once we've seen a few */
+#define SLOW_FACTOR 		8
+#define SLOW_MIN_USEC 		50000
+#define SLOW_MIN_SAMPLES 	32
+
+/* When writing zeroes, each block that turns out not to be zero already
+ * doubles how many we write before looking again, up to this many */
+#define ZERO_MAX_BACKOFF 	64
+
+/* How often we tell anyone how it's going, in seconds, and how much the
+ * newest sample counts towards the rate */
+#define PROGRESS_INTERVAL 	0.25
+#define RATE_SMOOTHING 		0.3
+
+typedef enum {
+	PASS_READ,
+	PASS_WRITE,
+} PassOp;
+
+/* One trip over the device */
+typedef struct {
+	const char* dev;
+	PassOp op;
+	int fd;
+	guint64 start;
+	guint64 size;			/* Where we stop with O_DIRECT; a
+					   ragged tail is done afterwards */
+	guint sector_size;
+	gsize block_size;
+	guint queue_depth;
+	BulkioOps ops;
+
+	BulkioStats stats;
+	GTimeVal last_sample;
+	guint64 last_sample_done;
+	gboolean stopped;		/* ops.progress said so */
+
+	int err;			/* The first request that failed, */
+	guint64 err_offset;		/* when there's no ops.bad */
+
+	guint64 latencies[BULKIO_LATENCY_BUCKETS];
+	guint64 latency_count;
+
+	guint64 next_offset;
+
+	/* Writing zeroes over what may be zero already; see next_block() */
+	gboolean skip_zeroes;
+	guint64 data_end;		/* Where the hole after next_offset
+					   starts, as far as lseek knows */
+	guint64 look_from;
+	guint zero_backoff;
+	guint64 holes;			/* Skipped without a request */
+	guint64 skipped;		/* Holes, and blocks that were zero */
+
+	/* io_uring backend, when there's a fill function: the ring is only
+	 * one thread, so filling buffers gets a pool of its own */
+	GThreadPool* fillers;
+	GAsyncQueue* filled;
+
+	/* Thread backend only */
+	GMutex* lock;
+	GCond* cond;
+	guint64 finished;
+	guint active;
+} Pass;
+
+#ifdef HAVE_LINUX_IO_URING_H
+typedef struct {
+	int fd;
+	void* sq_ptr;
+	gsize sq_len;
+	void* cq_ptr;
+	gsize cq_len;
+	struct io_uring_sqe* sqes;
+	gsize sqes_len;
+
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe* cqes;
+} Uring;
+
+typedef struct {
+	guchar* buf;
+	struct iovec iov;
+	guint64 offset;
+	gsize len;
+	gsize done;			/* In case the kernel comes up short */
+	gint64 queued;			/* In usec */
+	gboolean looking;		/* Reading to see if it's zero */
+} UringSlot;
+#endif
+
+
+/*
+ * Utility Functions
+ */
+
+static guchar*
+alloc_buffer(Pass* pass)
+{
+	void* buf;
+
+	if(posix_memalign(&buf, BUFFER_ALIGN, pass->block_size) != 0)
+		return NULL;
+
+	/* Without a fill function, this is all it ever holds */
+	memset(buf, 0, pass->block_size);
+	return buf;
+}
+
+static void
+fill_block(Pass* pass, guchar* buf, gsize len, guint64 offset)
+{
+	if(pass->op == PASS_WRITE && pass->ops.fill)
+		pass->ops.fill(buf, len, offset, pass->ops.user_data);
+}
+
+static void
+check_block(Pass* pass, const guchar* buf, gsize len, guint64 offset)
+{
+	if(pass->op == PASS_READ && pass->ops.check)
+		pass->ops.check(buf, len, offset, pass->ops.user_data);
+}
+
+typedef guint64 CompareVec __attribute__ ((vector_size (32)));
+
+/* Whether a and b hold the same len bytes. We only need to know if there
+ * are any differences, not where, so they're ORed together a vector at a
+ * time, which GCC turns into SSE2 or AVX2 as the target allows */
+static gboolean
+blocks_equal(const guchar* a, const guchar* b, gsize len)
+{
+	CompareVec va, vb, diff = { 0 };
+	gsize i;
+
+	for(i=0; i + sizeof(CompareVec) <= len; i += sizeof(CompareVec)) {
+		memcpy(&va, a + i, sizeof(CompareVec));
+		memcpy(&vb, b + i, sizeof(CompareVec));
+		diff |= va ^ vb;
+	}
+
+	if( (diff[0] | diff[1] | diff[2] | diff[3]) )
+		return FALSE;
+	return (memcmp(a + i, b + i, len - i) == 0);
+}
+
+static gboolean
+block_is_zero(const guchar* buf, gsize len)
+{
+	CompareVec v, any = { 0 };
+	gsize i;
+
+	for(i=0; i + sizeof(CompareVec) <= len; i += sizeof(CompareVec)) {
+		memcpy(&v, buf + i, sizeof(CompareVec));
+		any |= v;
+	}
+
+	if( (any[0] | any[1] | any[2] | any[3]) )
+		return FALSE;
+	for(; i < len; i++) {
+		if(buf[i])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static gint64
+now_usec(void)
+{
+	GTimeVal now;
+
+	g_get_current_time(&now);
+	return (gint64)now.tv_sec * G_USEC_PER_SEC + now.tv_usec;
+}
+
+static guint
+latency_bucket(gint64 usec)
+{
+	guint i;
+
+	for(i=0; i < BULKIO_LATENCY_BUCKETS - 1 && usec >= (G_GINT64_CONSTANT(2) << i); i++);
+	return i;
+}
+
+/* Half the requests so far took less than this */
+static gint64
+latency_median(const guint64* latencies, guint64 count)
+{
+	guint64 seen = 0;
+	guint i;
+
+	for(i=0; i < BULKIO_LATENCY_BUCKETS - 1; i++) {
+		if( (seen += latencies[i]) * 2 >= count )
+			break;
+	}
+	return (G_GINT64_CONSTANT(2) << i);
+}
+
+static guint
+count_cpus(void)
+{
+	long ret = sysconf(_SC_NPROCESSORS_ONLN);
+	return (ret > 0 ? (guint)ret : 1);
+}
+
+/* What a request that came back with nothing means */
+static int
+short_io_errno(PassOp op)
+{
+	return (op == PASS_WRITE ? ENOSPC : EIO);
+}
+
+static gboolean
+sync_io(Pass* pass, PassOp op, guchar* buf, gsize len, guint64 offset)
+{
+	ssize_t ret;
+
+	while(len > 0) {
+		if(op == PASS_WRITE)
+			ret = pwrite(pass->fd, buf, len, offset);
+		else
+			ret = pread(pass->fd, buf, len, offset);
+
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		if(ret == 0) {
+			errno = short_io_errno(op);
+			return FALSE;
+		}
+
+		buf += ret; 	len -= ret; 	offset += ret;
+	}
+
+	return TRUE;
+}
+
+static void
+set_io_error(Pass* pass, int err, guint64 offset)
+{
+	if(pass->err)
+		return;
+
+	pass->err = err;
+	pass->err_offset = offset;
+}
+
+static void
+report_bad(Pass* pass, guint64 offset, gsize len, int err)
+{
+	g_debug("%s: %s failed at byte %llu (%lu bytes): %s", pass->dev, 
+		(pass->op == PASS_WRITE ? "Write" : "Read"), (unsigned long long)offset, 
+		(unsigned long)len, g_strerror(err));
+
+	if(pass->lock)
+		g_mutex_lock(pass->lock);
+	pass->ops.bad(offset, len, err, pass->ops.user_data);
+	if(pass->lock)
+		g_mutex_unlock(pass->lock);
+}
+
+/* For every request that went through in one go; with the thread backend,
+ * only while holding the lock */
+static void
+record_latency(Pass* pass, guint64 offset, gsize len, gint64 usec)
+{
+	gint64 median;
+
+	pass->latencies[latency_bucket(usec)]++;
+	pass->latency_count++;
+
+	/* Writes mostly just land in the drive's cache */
+	if(pass->op != PASS_READ || !pass->ops.slow || pass->latency_count < SLOW_MIN_SAMPLES)
+		return;
+
+	median = latency_median(pass->latencies, pass->latency_count);
+	if(usec < SLOW_MIN_USEC || usec < median * SLOW_FACTOR)
+		return;
+
+	g_debug("%s: Reading %lu bytes at %llu took %lld ms; half of them take under %lld ms", pass->dev, 
+		(unsigned long)len, (unsigned long long)offset, (long long)(usec / 1000), (long long)(median / 1000));
+	pass->ops.slow(offset, len, (gdouble)usec / G_USEC_PER_SEC, pass->ops.user_data);
+}
+
+/* A request that failed gets split in half until each piece either works
+ * or is down to one sector; bad sectors tend to come alone, and everything
+ * around them is perfectly usable. This goes one small synchronous request
+ * at a time, but then drives take ages over bad sectors anyway */
+static void
+bisect_failed(Pass* pass, guchar* buf, gsize len, guint64 offset, int err)
+{
+	gsize half;
+
+	if(len <= pass->sector_size) {
+		report_bad(pass, offset, len, err);
+		return;
+	}
+
+	half = len / 2;
+	half = MAX(half - half % pass->sector_size, pass->sector_size);
+
+	if(sync_io(pass, pass->op, buf, half, offset))
+		check_block(pass, buf, half, offset);
+	else
+		bisect_failed(pass, buf, half, offset, errno);
+
+	if(sync_io(pass, pass->op, buf + half, len - half, offset + half))
+		check_block(pass, buf + half, len - half, offset + half);
+	else
+		bisect_failed(pass, buf + half, len - half, offset + half, errno);
+}
+
+/* Whichever backend a request went through */
+static void
+request_failed(Pass* pass, guchar* buf, gsize len, guint64 offset, int err)
+{
+	if(!pass->ops.bad) {
+		set_io_error(pass, err, offset);
+		return;
+	}
+
+	bisect_failed(pass, buf, len, offset, err);
+}
+
+/* Files can tell us where their holes are, and those read as zeroes */
+static void
+skip_holes(Pass* pass)
+{
+	off_t data, hole;
+
+	if(pass->next_offset < pass->data_end || pass->next_offset >= pass->size)
+		return;
+
+	if( (data = lseek(pass->fd, pass->next_offset, SEEK_DATA)) < 0 ) {
+		/* Either it's hole from here on, or we can't tell */
+		if(errno == ENXIO)
+			data = pass->size;
+		else {
+			pass->data_end = pass->size;
+			return;
+		}
+	}
+	data = MIN((guint64)data - (guint64)data % pass->sector_size, pass->size);
+	hole = lseek(pass->fd, data, SEEK_HOLE);
+
+	pass->holes += data - pass->next_offset;
+	pass->skipped += data - pass->next_offset;
+	pass->next_offset = data;
+	pass->data_end = (hole < 0 ? pass->size : 
+			  MIN(((guint64)hole + pass->sector_size - 1) / pass->sector_size * pass->sector_size, pass->size));
+}
+
+/* Hands out the next request; *look says whether to read it first, to
+ * see if it's zero already. Thread backend: with the lock held */
+static gboolean
+next_block(Pass* pass, guint64* offset, gsize* len, gboolean* look)
+{
+	if(pass->skip_zeroes)
+		skip_holes(pass);
+	if(pass->next_offset >= pass->size)
+		return FALSE;
+
+	*offset = pass->next_offset;
+	*len = MIN(pass->block_size, pass->size - *offset);
+	if(pass->skip_zeroes && pass->data_end > *offset)
+		*len = MIN(*len, pass->data_end - *offset);
+	pass->next_offset += *len;
+
+	*look = (pass->skip_zeroes && *offset >= pass->look_from);
+	return TRUE;
+}
+
+/* Once we've looked; returns zero. Data comes in long runs, so every block
+ * of it we find makes us go twice as far before we look again. Thread
+ * backend: with the lock held */
+static gboolean
+note_zero_check(Pass* pass, gboolean zero, guint64 offset, gsize len)
+{
+	if(zero) {
+		pass->skipped += len;
+		pass->zero_backoff = 0;
+		return TRUE;
+	}
+
+	pass->zero_backoff = CLAMP(pass->zero_backoff * 2, 1, ZERO_MAX_BACKOFF);
+	pass->look_from = offset + len + (guint64)pass->zero_backoff * pass->block_size;
+	return FALSE;
+}
+
+/* Call this every so often from the thread that started the pass; returns
+ * FALSE if we're to stop */
+static gboolean
+sample_progress(Pass* pass, guint64 done, gboolean force)
+{
+	GTimeVal now;
+	gdouble elapsed, rate;
+
+	g_get_current_time(&now);
+	elapsed = (gdouble)(now.tv_sec - pass->last_sample.tv_sec) + 
+		  (gdouble)(now.tv_usec - pass->last_sample.tv_usec) / G_USEC_PER_SEC;
+
+	if(elapsed < PROGRESS_INTERVAL && !force)
+		return TRUE;
+
+	if(elapsed > 0.0 && done > pass->last_sample_done) {
+		rate = (gdouble)(done - pass->last_sample_done) / elapsed;
+		pass->stats.rate = (pass->stats.rate > 0.0 ? RATE_SMOOTHING * rate + (1.0 - RATE_SMOOTHING) * pass->stats.rate : rate);
+	}
+	pass->stats.done = done;
+	pass->last_sample = now;
+	pass->last_sample_done = done;
+
+	if(pass->lock)
+		g_mutex_lock(pass->lock);
+	memcpy(pass->stats.latencies, pass->latencies, sizeof(pass->latencies));
+	pass->stats.skipped = pass->skipped;
+	if(pass->lock)
+		g_mutex_unlock(pass->lock);
+
+	return (pass->ops.progress ? pass->ops.progress(&pass->stats, pass->ops.user_data) : TRUE);
+}
+
+
+/*
+ * io_uring backend
+ */
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/* There's no liburing to lean on here, but the kernel side is only two
+ * system calls and three shared rings */
+static void
+uring_teardown(Uring* ring)
+{
+	if(ring->sqes)
+		munmap(ring->sqes, ring->sqes_len);
+	if(ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if(ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_len);
+	if(ring->fd >= 0)
+		close(ring->fd);
+}
+
+static gboolean
+uring_setup(Uring* ring, guint entries)
+{
+	struct io_uring_params p;
+	void* ptr;
+
+	memset(ring, 0, sizeof(Uring));
+	memset(&p, 0, sizeof(p));
+
+	if( (ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0 ) {
+		g_debug("No io_uring: %s", g_strerror(errno));
+		return FALSE;
+	}
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	/* Newer kernels put both rings in one mapping */
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_len = ring->cq_len = MAX(ring->sq_len, ring->cq_len);
+
+	ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		   ring->fd, IORING_OFF_SQ_RING);
+	if(ptr == MAP_FAILED)
+		goto error;
+	ring->sq_ptr = ptr;
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ptr = ring->sq_ptr;
+	else {
+		ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			   ring->fd, IORING_OFF_CQ_RING);
+		if(ptr == MAP_FAILED)
+			goto error;
+		ring->cq_ptr = ptr;
+	}
+
+	ptr = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		   ring->fd, IORING_OFF_SQES);
+	if(ptr == MAP_FAILED)
+		goto error;
+	ring->sqes = ptr;
+
+	ring->sq_tail = (unsigned*)((char*)ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned*)((char*)ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)((char*)ring->sq_ptr + p.sq_off.array);
+	ring->cq_head = (unsigned*)((char*)ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned*)((char*)ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned*)((char*)ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr + p.cq_off.cqes);
+	return TRUE;
+
+error:
+	g_debug("Couldn't map the io_uring rings: %s", g_strerror(errno));
+	uring_teardown(ring);
+	return FALSE;
+}
+
+/* Only we ever touch the tail of the submission ring, but the kernel has to
+ * see the entry before it sees the new tail */
+static void
+uring_queue(Uring* ring, Pass* pass, UringSlot* slot, guint tag)
+{
+	unsigned tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+
+	slot->iov.iov_base = slot->buf + slot->done;
+	slot->iov.iov_len = slot->len - slot->done;
+	if(slot->done == 0)
+		slot->queued = now_usec();
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = (pass->op == PASS_WRITE && !slot->looking ? IORING_OP_WRITEV : IORING_OP_READV);
+	sqe->fd = pass->fd;
+	sqe->addr = (unsigned long)&slot->iov;
+	sqe->len = 1;
+	sqe->off = slot->offset + slot->done;
+	sqe->user_data = tag;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void
+fill_slot_worker(gpointer data, gpointer user_data)
+{
+	Pass* pass = user_data;
+	UringSlot* slot = data;
+
+	fill_block(pass, slot->buf, slot->len, slot->offset);
+	g_async_queue_push(pass->filled, slot);
+}
+
+static void
+start_fillers(Pass* pass)
+{
+	GError* err = NULL;
+
+	if(pass->op != PASS_WRITE || !pass->ops.fill)
+		return;
+
+	pass->fillers = g_thread_pool_new(fill_slot_worker, pass, MIN(count_cpus(), pass->queue_depth), 
+					  TRUE /*exclusive*/, &err);
+	if(!pass->fillers) {
+		/* The ring thread can do it, just slower */
+		g_warning("Couldn't start filler threads: %s", err->message);
+		g_error_free(err);
+		return;
+	}
+
+	pass->filled = g_async_queue_new();
+}
+
+static void
+stop_fillers(Pass* pass)
+{
+	if(!pass->fillers)
+		return;
+
+	g_thread_pool_free(pass->fillers, FALSE /*immediate*/, TRUE /*wait*/);
+	g_async_queue_unref(pass->filled);
+}
+
+static gboolean
+pass_uring(Pass* pass)
+{
+	UringSlot* slots;
+	guint* free_slots;
+	guint i, free_count, in_flight = 0, to_submit = 0, filling = 0;
+	unsigned head, tail;
+	guint64 done = 0, offset;
+	gsize len;
+	gboolean look, broken = FALSE, stranded = FALSE;
+	Uring ring;
+	int ret;
+
+	if(!uring_setup(&ring, pass->queue_depth))
+		return FALSE;
+
+	slots = g_new0(UringSlot, pass->queue_depth);
+	free_slots = g_new(guint, pass->queue_depth);
+	for(i=0; i < pass->queue_depth; i++) {
+		if( !(slots[i].buf = alloc_buffer(pass)) ) {
+			set_io_error(pass, ENOMEM, 0);
+			goto out;
+		}
+		free_slots[i] = pass->queue_depth - 1 - i;
+	}
+	free_count = pass->queue_depth;
+
+	start_fillers(pass);
+	g_debug("Going over %s through io_uring, %u requests of %lu bytes in flight", 
+		pass->dev, pass->queue_depth, (unsigned long)pass->block_size);
+
+	for(;;) {
+		UringSlot* slot;
+
+		while(!pass->stopped && !pass->err && free_count > 0 && 
+		      next_block(pass, &offset, &len, &look)) {
+			slot = &slots[free_slots[--free_count]];
+
+			slot->offset = offset;
+			slot->len = len;
+			slot->done = 0;
+			slot->looking = look;
+
+			if(pass->fillers) {
+				g_thread_pool_push(pass->fillers, slot, NULL);
+				filling++;
+				continue;
+			}
+
+			fill_block(pass, slot->buf, slot->len, slot->offset);
+			uring_queue(&ring, pass, slot, slot - slots);
+			in_flight++; 	to_submit++;
+		}
+
+		/* Take whatever's been filled; if the disk has nothing to do,
+		 * wait for the next one */
+		while(filling > 0) {
+			if( !(slot = (in_flight == 0 ? g_async_queue_pop(pass->filled) : 
+						       g_async_queue_try_pop(pass->filled))) )
+				break;
+			filling--;
+
+			if(pass->stopped || pass->err) {
+				free_slots[free_count++] = slot - slots;
+				continue;
+			}
+
+			uring_queue(&ring, pass, slot, slot - slots);
+			in_flight++; 	to_submit++;
+		}
+
+		/* Once the ring has failed us, nothing more goes to the kernel;
+		 * what we queued and it never saw isn't coming back */
+		if(broken) {
+			in_flight -= to_submit;
+			to_submit = 0;
+		}
+
+		/* Once we've stopped, this is just waiting for the last few */
+		if(in_flight == 0)
+			break;
+
+		ret = syscall(__NR_io_uring_enter, ring.fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(ret < 0) {
+			if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+
+			/* The kernel still has buffers of ours, and it can write into
+			 * them until they complete, so we can't let go of them before.
+			 * If we can't even wait for that, they have to stay put */
+			if(broken) {
+				g_warning("Cannot wait for I/O on %s to finish: %s", pass->dev, g_strerror(errno));
+				stranded = TRUE;
+				break;
+			}
+			set_io_error(pass, errno, pass->next_offset);
+			broken = TRUE;
+			continue;
+		}
+		to_submit -= MIN((guint)ret, to_submit);
+
+		head = *ring.cq_head;
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != tail; head++) {
+			struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+			slot = &slots[cqe->user_data];
+			in_flight--;
+
+			/* If we can't tell whether it's zero, it gets written */
+			if(slot->looking && (cqe->res <= 0 || slot->done + cqe->res == slot->len)) {
+				slot->looking = FALSE;
+				if(cqe->res > 0 && note_zero_check(pass, block_is_zero(slot->buf, slot->len), 
+								    slot->offset, slot->len)) {
+					done += slot->len;
+					free_slots[free_count++] = slot - slots;
+					continue;
+				}
+
+				memset(slot->buf, 0, slot->len);
+				slot->done = 0;
+				uring_queue(&ring, pass, slot, slot - slots);
+				in_flight++; 	to_submit++;
+				continue;
+			}
+
+			if(cqe->res <= 0) {
+				request_failed(pass, slot->buf + slot->done, slot->len - slot->done, 
+					       slot->offset + slot->done, (cqe->res < 0 ? -cqe->res : short_io_errno(pass->op)));
+				done += slot->len - slot->done;
+				free_slots[free_count++] = slot - slots;
+				continue;
+			}
+
+			if(!slot->looking)
+				done += cqe->res;
+			slot->done += cqe->res;
+			if(slot->done < slot->len && !pass->err) {
+				uring_queue(&ring, pass, slot, slot - slots);
+				in_flight++; 	to_submit++;
+				continue;
+			}
+
+			record_latency(pass, slot->offset, slot->len, now_usec() - slot->queued);
+			check_block(pass, slot->buf, slot->len, slot->offset);
+			free_slots[free_count++] = slot - slots;
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+		if(!pass->stopped && !sample_progress(pass, done + pass->holes, FALSE))
+			pass->stopped = TRUE;
+	}
+
+	pass->stats.done = done + pass->holes;
+
+out:
+	stop_fillers(pass);
+	uring_teardown(&ring);
+	for(i=0; i < pass->queue_depth && !stranded; i++)
+		free(slots[i].buf);
+	g_free(slots);
+	g_free(free_slots);
+	return TRUE;
+}
+
+#endif
+
+
+/*
+ * Thread backend
+ */
+
+static gpointer
+pass_thread(gpointer data)
+{
+	Pass* pass = data;
+	guchar* buf = alloc_buffer(pass);
+	gint64 started, latency;
+	guint64 offset;
+	gsize len;
+	gboolean look, zero;
+
+	g_mutex_lock(pass->lock);
+	if(!buf)
+		set_io_error(pass, ENOMEM, 0);
+
+	while(!pass->stopped && !pass->err && next_block(pass, &offset, &len, &look)) {
+		g_mutex_unlock(pass->lock);
+
+		/* If we can't tell whether it's zero, it gets written */
+		if(look) {
+			zero = (sync_io(pass, PASS_READ, buf, len, offset) && block_is_zero(buf, len));
+
+			g_mutex_lock(pass->lock);
+			if(note_zero_check(pass, zero, offset, len)) {
+				pass->finished += len;
+				continue;
+			}
+			g_mutex_unlock(pass->lock);
+			memset(buf, 0, len);
+		}
+
+		fill_block(pass, buf, len, offset);
+		started = now_usec();
+		latency = -1;
+		if(sync_io(pass, pass->op, buf, len, offset)) {
+			latency = now_usec() - started;
+			check_block(pass, buf, len, offset);
+		} else if(pass->ops.bad)
+			bisect_failed(pass, buf, len, offset, errno);
+		else {
+			int err = errno;
+			g_mutex_lock(pass->lock);
+			set_io_error(pass, err, offset);
+			break;
+		}
+
+		g_mutex_lock(pass->lock);
+		if(latency >= 0)
+			record_latency(pass, offset, len, latency);
+		pass->finished += len;
+	}
+
+	pass->active--;
+	g_cond_signal(pass->cond);
+	g_mutex_unlock(pass->lock);
+
+	free(buf);
+	return NULL;
+}
+
+static void
+pass_threads(Pass* pass)
+{
+	GThread* threads[MAX_THREADS];
+	guint i, count = MIN(pass->queue_depth, MAX_THREADS);
+	GError* err = NULL;
+	GTimeVal deadline;
+	guint64 done;
+	gboolean go_on;
+
+	pass->lock = g_mutex_new();
+	pass->cond = g_cond_new();
+
+	g_debug("Going over %s on %u threads, %lu bytes at a time", 
+		pass->dev, count, (unsigned long)pass->block_size);
+
+	g_mutex_lock(pass->lock);
+	for(i=0; i < count; i++) {
+		if( !(threads[i] = g_thread_create(pass_thread, pass, TRUE, &err)) ) {
+			g_warning("Couldn't start an I/O thread: %s", err->message);
+			g_clear_error(&err);
+			break;
+		}
+		pass->active++;
+	}
+	count = i;
+
+	/* Better slow than not at all */
+	if(count == 0) {
+		pass->active = 1;
+		g_mutex_unlock(pass->lock);
+		pass_thread(pass);
+		g_mutex_lock(pass->lock);
+	}
+
+	while(pass->active > 0) {
+		g_get_current_time(&deadline);
+		g_time_val_add(&deadline, (glong)(PROGRESS_INTERVAL * G_USEC_PER_SEC));
+		g_cond_timed_wait(pass->cond, pass->lock, &deadline);
+
+		/* The progress callback gets to take its time without holding
+		 * anyone up */
+		done = pass->finished + pass->holes;
+		g_mutex_unlock(pass->lock);
+		go_on = sample_progress(pass, done, FALSE);
+		g_mutex_lock(pass->lock);
+
+		if(!go_on)
+			pass->stopped = TRUE;
+	}
+	pass->stats.done = pass->finished + pass->holes;
+	g_mutex_unlock(pass->lock);
+
+	for(i=0; i < count; i++)
+		g_thread_join(threads[i]);
+
+	g_cond_free(pass->cond);
+	g_mutex_free(pass->lock);
+	pass->lock = NULL;
+}
+
+
+/*
+ * Both directions
+ */
+
+static gboolean
+run_pass(const char* dev, PassOp op, const BulkioParams* params, const BulkioOps* ops, GError** error)
+{
+	int flags;
+	guint64 size, part_start, end;
+	gsize tail;
+	guchar* buf;
+	gboolean ret = FALSE;
+	Pass pass;
+
+	memset(&pass, 0, sizeof(pass));
+	pass.dev = dev;
+	pass.op = op;
+	if(ops)
+		pass.ops = *ops;
+
+	/* Someone else's zeroes are as good as ours */
+	pass.skip_zeroes = (params && params->skip_zeroes && op == PASS_WRITE && !pass.ops.fill);
+	if(op == PASS_READ)
+		flags = O_RDONLY;
+	else
+		flags = (pass.skip_zeroes ? O_RDWR : O_WRONLY);
+
+	pass.queue_depth = (params && params->queue_depth ? params->queue_depth : BULKIO_DEFAULT_QUEUE_DEPTH);
+	pass.queue_depth = CLAMP(pass.queue_depth, 1, BULKIO_MAX_QUEUE_DEPTH);
+	pass.block_size = (params && params->block_size ? params->block_size : DEFAULT_BLOCK_SIZE);
+	pass.block_size = MAX(pass.block_size - pass.block_size % BUFFER_ALIGN, BUFFER_ALIGN);
+
+	/* Not every filesystem an image file might live on does O_DIRECT */
+	if( (pass.fd = open(dev, flags | O_DIRECT)) < 0 && errno == EINVAL )
+		pass.fd = open(dev, flags);
+	if(pass.fd < 0) {
+		g_set_error(error, 0, 0, _("Cannot open %s: %s"), dev, g_strerror(errno));
+		return FALSE;
+	}
+
+	if(!blockdev_get_geometry(pass.fd, &size, &pass.sector_size, &part_start)) {
+		g_set_error(error, 0, 0, _("Cannot read the size of %s"), dev);
+		goto out;
+	}
+
+	pass.start = MIN((params ? params->start : 0), size);
+	end = (params && params->length ? MIN(pass.start + params->length, size) : size);
+	if(pass.start % pass.sector_size) {
+		g_set_error(error, 0, 0, _("Cannot start in the middle of a sector of %s"), dev);
+		goto out;
+	}
+
+	/* Devices are always whole sectors, but image files needn't be */
+	tail = (end - pass.start) % pass.sector_size;
+	pass.size = end - tail;
+	pass.next_offset = pass.start;
+	pass.stats.total = end - pass.start;
+	g_get_current_time(&pass.last_sample);
+
+#ifdef HAVE_LINUX_IO_URING_H
+	if(!pass_uring(&pass))
+#endif
+		pass_threads(&pass);
+
+	if(!pass.err && !pass.stopped && tail > 0) {
+		fcntl(pass.fd, F_SETFL, fcntl(pass.fd, F_GETFL) & ~O_DIRECT);
+
+		if( !(buf = alloc_buffer(&pass)) )
+			set_io_error(&pass, ENOMEM, pass.size);
+		else {
+			fill_block(&pass, buf, tail, pass.size);
+			if(sync_io(&pass, op, buf, tail, pass.size))
+				check_block(&pass, buf, tail, pass.size);
+			else
+				request_failed(&pass, buf, tail, pass.size, errno);
+			pass.stats.done += tail;
+			free(buf);
+		}
+	}
+
+	if(pass.err) {
+		if(op == PASS_WRITE)
+			g_set_error(error, 0, 0, _("Cannot write to %s at byte %llu: %s"), dev, 
+				    (unsigned long long)pass.err_offset, g_strerror(pass.err));
+		else
+			g_set_error(error, 0, 0, _("Cannot read from %s at byte %llu: %s"), dev, 
+				    (unsigned long long)pass.err_offset, g_strerror(pass.err));
+		goto out;
+	}
+	if(pass.stopped) {
+		if(op == PASS_WRITE)
+			g_set_error(error, 0, 0, _("Overwriting %s was cancelled"), dev);
+		else
+			g_set_error(error, 0, 0, _("Reading %s was cancelled"), dev);
+		goto out;
+	}
+
+	/* O_DIRECT gets it to the drive, not necessarily onto the platters */
+	if(op == PASS_WRITE && !blockdev_flush_fd(pass.fd, dev, error))
+		goto out;
+
+	sample_progress(&pass, pass.stats.done, TRUE);
+	if(pass.latency_count > 0)
+		g_debug("%s: Half of %llu requests took under %lld ms", dev, (unsigned long long)pass.latency_count,
+			(long long)(latency_median(pass.latencies, pass.latency_count) / 1000));
+	ret = TRUE;
+
+out:
+	close(pass.fd);
+	return ret;
+}
+
+
+/*
+ * Write-verify
+ */
+
+/* Region k gets written on a thread of its own while region k - 1, which
+ * is already on the disk, gets read back and compared on ours. Each is an
+ * ordinary pass over its region; this just keeps the caller's callbacks
+ * from seeing two of them */
+
+typedef struct _VerifyRegion VerifyRegion;
+
+typedef struct {
+	const char* dev;
+	const BulkioOps* ops;		/* The caller's */
+
+	GMutex* lock;			/* For everything below, and for
+					   ops->bad */
+	VerifyRegion* writing;
+	VerifyRegion* reading;
+	guint64 done;			/* Both ways, regions that are over */
+	guint64 total;
+	guint64 latencies[BULKIO_LATENCY_BUCKETS];	/* Reads, likewise */
+	gboolean stopped;
+	gboolean mismatch;		/* When there's no ops->bad */
+	guint64 mismatch_offset;
+} Verify;
+
+struct _VerifyRegion {
+	Verify* verify;
+	PassOp op;
+	BulkioParams params;
+	BulkioStats stats;
+	gboolean caller;		/* Running on the caller's thread */
+
+	GError* error;
+	gboolean ret;
+};
+
+static void
+verify_bad(Verify* verify, guint64 offset, gsize len, int err)
+{
+	g_mutex_lock(verify->lock);
+	if(verify->ops->bad)
+		verify->ops->bad(offset, len, err, verify->ops->user_data);
+	else if(!verify->mismatch) {
+		verify->mismatch = TRUE;
+		verify->mismatch_offset = offset;
+		verify->stopped = TRUE;
+	}
+	g_mutex_unlock(verify->lock);
+}
+
+static void
+region_fill_cb(guchar* buf, gsize len, guint64 offset, gpointer user_data)
+{
+	const BulkioOps* ops = ((VerifyRegion*)user_data)->verify->ops;
+
+	if(ops->fill)
+		ops->fill(buf, len, offset, ops->user_data);
+	else
+		memset(buf, 0, len);
+}
+
+/* Runs on as many threads as the pass likes */
+static void
+region_check_cb(const guchar* buf, gsize len, guint64 offset, gpointer user_data)
+{
+	VerifyRegion* region = user_data;
+	guchar expected[VERIFY_PIECE_SIZE] __attribute__ ((aligned (32)));
+	gsize pos, piece, i, bad_len = 0;
+	guint64 bad_start = 0;
+
+	for(pos = 0; pos < len; pos += piece) {
+		piece = MIN(VERIFY_PIECE_SIZE, len - pos);
+		region_fill_cb(expected, piece, offset + pos, region);
+
+		for(i=0; i < piece; i += VERIFY_SECTOR_SIZE) {
+			gsize n = MIN(VERIFY_SECTOR_SIZE, piece - i);
+
+			if(blocks_equal(buf + pos + i, expected + i, n))
+				continue;
+
+			/* Runs of bad sectors go out as one */
+			if(bad_len > 0 && bad_start + bad_len == offset + pos + i) {
+				bad_len += n;
+				continue;
+			}
+			if(bad_len > 0)
+				verify_bad(region->verify, bad_start, bad_len, 0);
+			bad_start = offset + pos + i;
+			bad_len = n;
+		}
+	}
+
+	if(bad_len > 0)
+		verify_bad(region->verify, bad_start, bad_len, 0);
+}
+
+static void
+region_bad_cb(guint64 offset, gsize len, int err, gpointer user_data)
+{
+	verify_bad(((VerifyRegion*)user_data)->verify, offset, len, err);
+}
+
+static void
+region_slow_cb(guint64 offset, gsize len, gdouble seconds, gpointer user_data)
+{
+	Verify* verify = ((VerifyRegion*)user_data)->verify;
+
+	g_mutex_lock(verify->lock);
+	verify->ops->slow(offset, len, seconds, verify->ops->user_data);
+	g_mutex_unlock(verify->lock);
+}
+
+static void
+add_latencies(guint64* to, const guint64* from)
+{
+	guint i;
+
+	for(i=0; i < BULKIO_LATENCY_BUCKETS; i++)
+		to[i] += from[i];
+}
+
+/* Only the region on the caller's thread passes it on */
+static gboolean
+region_progress_cb(const BulkioStats* stats, gpointer user_data)
+{
+	VerifyRegion* region = user_data;
+	Verify* verify = region->verify;
+	BulkioStats total;
+	gboolean go_on;
+
+	memset(&total, 0, sizeof(total));
+	g_mutex_lock(verify->lock);
+	region->stats = *stats;
+
+	total.done = verify->done;
+	total.total = verify->total;
+	memcpy(total.latencies, verify->latencies, sizeof(verify->latencies));
+	if(verify->writing) {
+		total.done += verify->writing->stats.done;
+		total.rate += verify->writing->stats.rate;
+	}
+	if(verify->reading) {
+		total.done += verify->reading->stats.done;
+		total.rate += verify->reading->stats.rate;
+		add_latencies(total.latencies, verify->reading->stats.latencies);
+	}
+	go_on = !verify->stopped;
+	g_mutex_unlock(verify->lock);
+
+	if(!region->caller || !go_on || !verify->ops->progress)
+		return go_on;
+
+	if( !(go_on = verify->ops->progress(&total, verify->ops->user_data)) ) {
+		g_mutex_lock(verify->lock);
+		verify->stopped = TRUE;
+		g_mutex_unlock(verify->lock);
+	}
+	return go_on;
+}
+
+static gpointer
+run_region(gpointer data)
+{
+	VerifyRegion* region = data;
+	BulkioOps ops;
+
+	memset(&ops, 0, sizeof(ops));
+	ops.fill = region_fill_cb;
+	ops.check = region_check_cb;
+	ops.bad = (region->verify->ops->bad ? region_bad_cb : NULL);
+	ops.slow = (region->verify->ops->slow ? region_slow_cb : NULL);
+	ops.progress = region_progress_cb;
+	ops.user_data = region;
+
+	region->ret = run_pass(region->verify->dev, region->op, &region->params, &ops, &region->error);
+	return NULL;
+}
+
+static void
+start_region(Verify* verify, VerifyRegion* region, PassOp op, const BulkioParams* params, guint64 start)
+{
+	memset(region, 0, sizeof(VerifyRegion));
+	region->verify = verify;
+	region->op = op;
+	if(params)
+		region->params = *params;
+	region->params.start = start;
+	region->params.length = MIN(VERIFY_REGION_SIZE, verify->total / 2 - start);
+}
+
+/* Keeps the first error we see */
+static void
+finish_region(VerifyRegion* region, GError** error)
+{
+	if(!region || !region->error)
+		return;
+
+	if(!*error)
+		*error = region->error;
+	else
+		g_error_free(region->error);
+	region->error = NULL;
+}
+
+static gboolean
+get_device_size(const char* dev, guint64* size, GError** error)
+{
+	guint64 start;
+	guint sector_size;
+	gboolean ret;
+	int fd;
+
+	if( (fd = open(dev, O_RDONLY)) < 0 ) {
+		g_set_error(error, 0, 0, _("Cannot open %s: %s"), dev, g_strerror(errno));
+		return FALSE;
+	}
+
+	if( !(ret = blockdev_get_geometry(fd, size, &sector_size, &start)) )
+		g_set_error(error, 0, 0, _("Cannot read the size of %s"), dev);
+	close(fd);
+	return ret;
+}
+
+
+/*
+ * Public functions
+ */
+
+gboolean
+bulkio_overwrite(const char* dev, const BulkioParams* params, const BulkioOps* ops, GError** error)
+{
+	return run_pass(dev, PASS_WRITE, params, ops, error);
+}
+
+gboolean
+bulkio_read(const char* dev, const BulkioParams* params, const BulkioOps* ops, GError** error)
+{
+	return run_pass(dev, PASS_READ, params, ops, error);
+}
+
+gboolean
+bulkio_write_verify(const char* dev, const BulkioParams* params, const BulkioOps* ops, GError** error)
+{
+	VerifyRegion regions[2], *writing, *reading = NULL;
+	const BulkioOps no_ops = { NULL, NULL, NULL, NULL, NULL, NULL };
+	GThread* thread;
+	GError* err = NULL;
+	guint64 size, next = 0;
+	Verify verify;
+
+	if(!get_device_size(dev, &size, error))
+		return FALSE;
+
+	memset(&verify, 0, sizeof(verify));
+	verify.dev = dev;
+	verify.ops = (ops ? ops : &no_ops);
+	verify.lock = g_mutex_new();
+	verify.total = size * 2;
+
+	while(!err && !verify.stopped && (next < size || reading)) {
+		writing = NULL;
+		if(next < size) {
+			writing = (reading == &regions[0] ? &regions[1] : &regions[0]);
+			start_region(&verify, writing, PASS_WRITE, params, next);
+			next += writing->params.length;
+		}
+		if(reading)
+			start_region(&verify, reading, PASS_READ, params, reading->params.start);
+
+		g_mutex_lock(verify.lock);
+		verify.writing = writing;
+		verify.reading = reading;
+		g_mutex_unlock(verify.lock);
+
+		/* The first and the last regions have nothing to overlap with */
+		thread = NULL;
+		if(writing && reading && !(thread = g_thread_create(run_region, writing, TRUE, NULL)) )
+			g_warning("Couldn't start a thread to write %s on; going one region at a time", dev);
+
+		if(reading) {
+			reading->caller = TRUE;
+			run_region(reading);
+		}
+		if(thread)
+			g_thread_join(thread);
+		else if(writing) {
+			writing->caller = TRUE;
+			run_region(writing);
+		}
+
+		g_mutex_lock(verify.lock);
+		verify.done += (writing ? writing->params.length : 0) + (reading ? reading->params.length : 0);
+		if(reading)
+			add_latencies(verify.latencies, reading->stats.latencies);
+		verify.writing = verify.reading = NULL;
+		g_mutex_unlock(verify.lock);
+
+		finish_region(reading, &err);
+		finish_region(writing, &err);
+		reading = writing;
+	}
+
+	/* Whatever else went wrong came from stopping because of it */
+	if(verify.mismatch) {
+		g_clear_error(&err);
+		g_set_error(&err, 0, 0, _("%s gave back something other than what was written at byte %llu"),
+			    dev, (unsigned long long)verify.mismatch_offset);
+	}
+
+	g_mutex_free(verify.lock);
+	if(err) {
+		g_propagate_error(error, err);
+		return FALSE;
+	}
+	return TRUE;
+}
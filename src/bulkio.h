@@ -0,0 +1,111 @@
+/*
+ * bulkio.h - Stream reads and writes over a whole device as fast as it takes them
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef _BULKIO_H
+#define _BULKIO_H
+
+#include <glib.h>
+
+#define BULKIO_DEFAULT_QUEUE_DEPTH 	32
+#define BULKIO_MAX_QUEUE_DEPTH 		256
+
+/* Request latencies go in powers of two of microseconds; the last bucket
+ * takes everything from 8 seconds up */
+#define BULKIO_LATENCY_BUCKETS 		24
+
+typedef struct _BulkioParams {
+	guint queue_depth;	/* Requests in flight at once; 0 for the default */
+	gsize block_size;	/* Bytes per request; 0 for the default (1 MiB) */
+	guint64 start;		/* Where to begin, on a sector boundary */
+	guint64 length;		/* How far to go; 0 for up to the end */
+	gboolean skip_zeroes;	/* Overwriting without ops->fill: read first,
+				   and leave what's zero already alone */
+} BulkioParams;
+
+typedef struct _BulkioStats {
+	guint64 done;		/* Bytes the device has gotten through so far */
+	guint64 total;
+	gdouble rate;		/* Bytes per second lately, 0 until we know */
+	guint64 latencies[BULKIO_LATENCY_BUCKETS];	/* How many requests took
+							   under 2^(i+1) usec */
+	guint64 skipped;	/* Of done, what was zero already with
+				   skip_zeroes, and wasn't written */
+} BulkioStats;
+
+/* Fills buf with what belongs at offset on the device. It's called on
+ * whatever thread is about to write there, several at once if need be, so
+ * it can't count on being called in order */
+typedef void (*BulkioFillFunc) (guchar* buf, gsize len, guint64 offset, gpointer user_data);
+
+/* Gets everything that was read back fine; the same goes for threads */
+typedef void (*BulkioCheckFunc) (const guchar* buf, gsize len, guint64 offset, gpointer user_data);
+
+/* A piece of the device that couldn't be read or written, no bigger than a
+ * sector unless the sector size isn't known; err is 0 if it read back fine,
+ * but not what was written. Only ever called from one thread at a time */
+typedef void (*BulkioBadFunc) (guint64 offset, gsize len, int err, gpointer user_data);
+
+/* A read that went through, but took far longer than most; the drive
+ * probably had to retry it, which is what sectors do before they go bad.
+ * The same goes for threads */
+typedef void (*BulkioSlowFunc) (guint64 offset, gsize len, gdouble seconds, gpointer user_data);
+
+/* Called a few times a second from the thread that called us; return
+ * FALSE to stop */
+typedef gboolean (*BulkioProgressFunc) (const BulkioStats* stats, gpointer user_data);
+
+/* Any of these may be NULL */
+typedef struct _BulkioOps {
+	BulkioFillFunc fill;		/* Writes only; NULL writes zeroes */
+	BulkioCheckFunc check;		/* Reads only */
+	BulkioBadFunc bad;		/* Without it, the first I/O error
+					   stops everything */
+	BulkioSlowFunc slow;		/* Reads only */
+	BulkioProgressFunc progress;
+	gpointer user_data;		/* For all of them */
+} BulkioOps;
+
+/* Writes over every byte of dev, bypassing the page cache, with up to
+ * queue_depth writes in flight: through io_uring where the kernel lets us,
+ * otherwise on a thread per write (32 at most). Nothing is left in the
+ * drive's cache when this returns TRUE. This blocks */
+gboolean bulkio_overwrite(const char* dev, const BulkioParams* params,
+			  const BulkioOps* ops, GError** error);
+
+/* The same, reading every byte instead. When a big read fails and there's
+ * ops->bad, it's split up until each piece either reads or is a single
+ * sector, so one bad sector doesn't cost the megabyte around it */
+gboolean bulkio_read(const char* dev, const BulkioParams* params,
+		     const BulkioOps* ops, GError** error);
+
+/* Writes what ops->fill says over all of dev and reads it back, a region
+ * at a time: while one region is being written, the one before it is
+ * being read and compared. Whatever didn't match goes to ops->bad along
+ * with what couldn't be read or written; without it, the first of those
+ * stops everything. ops->check isn't used. This blocks too */
+gboolean bulkio_write_verify(const char* dev, const BulkioParams* params,
+			     const BulkioOps* ops, GError** error);
+
+#endif
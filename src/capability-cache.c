@@ -0,0 +1,206 @@
+/*
+ * capability-cache.c - Remember which filesystems the format scripts can create
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gi18n.h>
+
+#include "capability-cache.h"
+#include "formattify.h"
+
+/* Finding out what we can format means asking every script, and the stock
+ * one has to look through all of $PATH to answer. None of that changes
+ * between runs unless a file does, so we keep the answers in a GKeyFile along
+ * with the mtimes they were based on. On a warm start this file is all we
+ * read; nothing gets spawned */
+
+#define CAPABILITY_CACHE_VERSION 	2
+
+static gchar*
+get_cache_path(void)
+{
+	return g_build_filename(g_get_user_cache_dir(), "gnome-format", "capabilities", NULL);
+}
+
+static void
+append_file_stamp(GString* stamp, const gchar* path)
+{
+	struct stat st;
+
+	if(stat(path, &st) != 0) {
+		g_string_append_printf(stamp, "%s:-\n", path);
+		return;
+	}
+
+	/* mtime only has whole seconds; the inode and size catch most of
+	 * what that would miss (editors that save by renaming, for one) */
+	g_string_append_printf(stamp, "%s:%lu:%ld:%lld\n", path, (unsigned long)st.st_ino,
+			       (long)st.st_mtime, (long long)st.st_size);
+}
+
+
+/*
+ * Public functions
+ */
+
+gchar*
+capability_cache_get_stamp(const gchar* script_dir)
+{
+	GString* ret = g_string_new("");
+	const gchar* path_env = getenv("PATH");
+	gchar **dirs, **iter;
+	const gchar* file;
+	GDir* dir;
+
+	/* The directory's own mtime catches scripts being added or removed */
+	append_file_stamp(ret, script_dir);
+	if( (dir = g_dir_open(script_dir, 0, NULL)) ) {
+		while( (file = g_dir_read_name(dir)) ) {
+			gchar* path = g_build_filename(script_dir, file, NULL);
+			append_file_stamp(ret, path);
+			g_free(path);
+		}
+		g_dir_close(dir);
+	}
+
+	/* Installing or removing a mkfs.foo touches the directory it's in */
+	g_string_append_printf(ret, "PATH=%s\n", (path_env ? path_env : ""));
+	dirs = g_strsplit((path_env ? path_env : ""), G_SEARCHPATH_SEPARATOR_S, 0);
+	for(iter = dirs; *iter != NULL; iter++) {
+		if(**iter)
+			append_file_stamp(ret, *iter);
+	}
+	g_strfreev(dirs);
+
+	return g_string_free(ret, FALSE);
+}
+
+gboolean
+capability_cache_load(const gchar* stamp, GHashTable* fs_map)
+{
+	GKeyFile* file = g_key_file_new();
+	gchar* path = get_cache_path();
+	gchar *cached_stamp = NULL, **keys = NULL;
+	gboolean ret = FALSE;
+	gsize i;
+
+	if(!g_key_file_load_from_file(file, path, G_KEY_FILE_NONE, NULL))
+		goto out;
+
+	if(g_key_file_get_integer(file, "Cache", "Version", NULL) != CAPABILITY_CACHE_VERSION) {
+		g_debug("Ignoring capability cache from a different version");
+		goto out;
+	}
+
+	cached_stamp = g_key_file_get_string(file, "Cache", "Stamp", NULL);
+	if(!cached_stamp || strcmp(cached_stamp, stamp)) {
+		g_debug("Capability cache is out of date");
+		goto out;
+	}
+
+	if( !(keys = g_key_file_get_keys(file, "Filesystems", NULL, NULL)) )
+		goto out;
+
+	/* Each one is "fs=script;parser;helper;", either of the last two
+	 * possibly empty */
+	for(i=0; keys[i] != NULL; i++) {
+		gchar** fields = g_key_file_get_string_list(file, "Filesystems", keys[i], NULL, NULL);
+		MkfsScript* script;
+
+		if(!fields || !fields[0]) {
+			g_strfreev(fields);
+			continue;
+		}
+
+		script = g_new0(MkfsScript, 1);
+		script->path = g_strdup(fields[0]);
+		if(fields[1] && *fields[1])
+			script->progress_parser = g_strdup(fields[1]);
+		if(fields[1] && fields[2] && *fields[2])
+			script->helper = g_strdup(fields[2]);
+		g_hash_table_insert(fs_map, g_strdup(keys[i]), script);
+		g_strfreev(fields);
+	}
+
+	g_debug("Loaded %d filesystems from the capability cache", g_hash_table_size(fs_map));
+	ret = TRUE;
+
+out:
+	g_strfreev(keys);
+	g_free(cached_stamp);
+	g_key_file_free(file);
+	g_free(path);
+	return ret;
+}
+
+static void
+add_fs_key(gpointer key, gpointer value, gpointer user_data)
+{
+	MkfsScript* script = value;
+	const gchar* fields[] = { script->path, 
+				  (script->progress_parser ? script->progress_parser : ""), 
+				  (script->helper ? script->helper : ""), NULL };
+
+	g_key_file_set_string_list(user_data, "Filesystems", key, fields, 3);
+}
+
+gboolean
+capability_cache_save(const gchar* stamp, GHashTable* fs_map, GError** error)
+{
+	GKeyFile* file = g_key_file_new();
+	gchar *path = get_cache_path(), *dir = NULL, *data = NULL;
+	gboolean ret = FALSE;
+	gsize len;
+
+	g_key_file_set_integer(file, "Cache", "Version", CAPABILITY_CACHE_VERSION);
+	g_key_file_set_string(file, "Cache", "Stamp", stamp);
+	g_hash_table_foreach(fs_map, add_fs_key, file);
+
+	if( !(data = g_key_file_to_data(file, &len, error)) )
+		goto out;
+
+	dir = g_path_get_dirname(path);
+	if(g_mkdir_with_parents(dir, 0700) != 0) {
+		g_set_error(error, 0, 0, _("Cannot create directory %s"), dir);
+		goto out;
+	}
+
+	ret = g_file_set_contents(path, data, len, error);
+
+out:
+	g_free(data);
+	g_free(dir);
+	g_free(path);
+	g_key_file_free(file);
+	return ret;
+}
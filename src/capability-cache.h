@@ -0,0 +1,42 @@
+/*
+ * capability-cache.h - Remember which filesystems the format scripts can create
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef _CAPABILITY_CACHE_H
+#define _CAPABILITY_CACHE_H
+
+#include <glib.h>
+
+/* A string that changes whenever anything the scripts' --capabilities
+ * output could depend on does: the scripts themselves, $PATH, and the
+ * directories in it */
+gchar* capability_cache_get_stamp(const gchar* script_dir);
+
+/* Fills fs_map (filesystem => MkfsScript) from the cache; returns FALSE
+ * without touching it if the cache is missing or was made with another stamp */
+gboolean capability_cache_load(const gchar* stamp, GHashTable* fs_map);
+
+gboolean capability_cache_save(const gchar* stamp, GHashTable* fs_map, GError** error);
+
+#endif
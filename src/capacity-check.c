@@ -0,0 +1,336 @@
+/*
+ * capacity-check.c - Catch devices that claim to hold more than they do
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+/* For O_DIRECT */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <glib.h>
+#include <glib/gi18n.h>
+
+#include "blockdev.h"
+#include "capacity-check.h"
+#include "chacha.h"
+
+/* A fake reports a big size, but the controller only has so much flash
+ * behind it, and usually folds every address onto that (modulo a power of
+ * two), or drops writes past it. Going through every byte the way f3 does
+ * takes hours; we only need to catch it at it, and a fold shows up at
+ * every power of two past the real size. So probes go at 0, at 1 MiB and
+ * each power of two after it, halfway between those, at the very end, and
+ * at a few random places so fakes can't count on where we'll look.
+ *
+ * Each probe holds a magic string and its own offset, followed by ChaCha20
+ * keystream for that offset under a key nobody has seen before. A probe
+ * that comes back as another one's tells us both where the fold is and
+ * that it isn't left over from an earlier run */
+
+#define PROBE_SIZE 		4096
+#define PROBE_MAGIC 		"GFMTPROB"
+#define PROBE_HEADER 		16	/* The magic, then the offset (LE) */
+#define FIRST_POWER 		(1024 * 1024)
+#define RANDOM_PROBES 		64
+
+/* Nothing we'd ever write sits here */
+#define NO_PROBE 		G_MAXUINT64
+
+typedef struct {
+	const char* dev;
+	int fd;
+	gsize probe_size;
+	ChachaKey key;
+	guchar* expected;		/* Scratch for telling probes apart */
+
+	BlockdevProgressFunc progress_cb;
+	gpointer user_data;
+	guint done, total;		/* Probe writes and reads, for
+					   progress */
+} Check;
+
+
+/*
+ * Utility Functions
+ */
+
+static gint
+compare_offsets(gconstpointer a, gconstpointer b)
+{
+	guint64 x = *(const guint64*)a, y = *(const guint64*)b;
+	return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+static void
+add_probe(GArray* offsets, guint64 offset, gsize probe_size)
+{
+	offset -= offset % probe_size;
+	g_array_append_val(offsets, offset);
+}
+
+/* Sorted, with no offset twice */
+static GArray*
+get_probe_offsets(guint64 size, gsize probe_size)
+{
+	GArray* offsets = g_array_new(FALSE, FALSE, sizeof(guint64));
+	guint64 power, last = size - probe_size;
+	GRand* rand = g_rand_new();
+	guint i, j;
+
+	add_probe(offsets, 0, probe_size);
+	for(power = FIRST_POWER; power <= last; power *= 2) {
+		add_probe(offsets, power, probe_size);
+		if(power + power / 2 <= last)
+			add_probe(offsets, power + power / 2, probe_size);
+	}
+	add_probe(offsets, last, probe_size);
+
+	for(i=0; i < RANDOM_PROBES; i++)
+		add_probe(offsets, (guint64)(g_rand_double(rand) * (gdouble)last), probe_size);
+	g_rand_free(rand);
+
+	g_array_sort(offsets, compare_offsets);
+	for(i=0, j=0; i < offsets->len; i++) {
+		if(j > 0 && g_array_index(offsets, guint64, i) == g_array_index(offsets, guint64, j-1))
+			continue;
+		g_array_index(offsets, guint64, j++) = g_array_index(offsets, guint64, i);
+	}
+	g_array_set_size(offsets, j);
+
+	return offsets;
+}
+
+static void
+fill_probe(Check* check, guchar* buf, guint64 offset)
+{
+	guint64 le = GUINT64_TO_LE(offset);
+
+	chacha_keystream(&check->key, offset, buf, check->probe_size);
+	memcpy(buf, PROBE_MAGIC, 8);
+	memcpy(buf + 8, &le, 8);
+}
+
+/* Which probe buf holds, or NO_PROBE if it isn't any of ours */
+static guint64
+get_probe_owner(Check* check, const guchar* buf)
+{
+	guint64 le, offset;
+
+	if(memcmp(buf, PROBE_MAGIC, 8))
+		return NO_PROBE;
+
+	memcpy(&le, buf + 8, 8);
+	offset = GUINT64_FROM_LE(le);
+	fill_probe(check, check->expected, offset);
+
+	return (memcmp(buf, check->expected, check->probe_size) ? NO_PROBE : offset);
+}
+
+static gboolean
+probe_io(Check* check, gboolean write, guchar* buf, guint64 offset)
+{
+	gsize len = check->probe_size;
+	ssize_t ret;
+
+	while(len > 0) {
+		if(write)
+			ret = pwrite(check->fd, buf, len, offset);
+		else
+			ret = pread(check->fd, buf, len, offset);
+
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return FALSE;
+
+		buf += ret; 	len -= ret; 	offset += ret;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+probe_done(Check* check)
+{
+	check->done++;
+	if(!check->progress_cb)
+		return TRUE;
+	return check->progress_cb((gdouble)check->done / (gdouble)check->total, check->user_data);
+}
+
+/* Whatever doesn't come back right is past the real end; returns the
+ * lowest of those, or NO_PROBE */
+static guint64
+write_and_read_probes(Check* check, GArray* offsets, guchar* buf, GError** error)
+{
+	guint64 offset, owner, ret = NO_PROBE;
+	guint64* first_holder;		/* By owner: the lowest probe that
+					   came back with its tag */
+	guint64* found;
+	guint i;
+
+	/* A fold sends the later writes over the earlier ones, so going up
+	 * leaves the low probe holding the high one's tag */
+	for(i=0; i < offsets->len; i++) {
+		offset = g_array_index(offsets, guint64, i);
+		fill_probe(check, buf, offset);
+		if(!probe_io(check, TRUE, buf, offset)) {
+			g_debug("%s: Writing the probe at %llu failed: %s", check->dev, 
+				(unsigned long long)offset, g_strerror(errno));
+			ret = MIN(ret, offset);
+		}
+		if(!probe_done(check))
+			goto cancelled;
+	}
+
+	/* Drives with a cache in front of the flash could still be holding
+	 * on to all of them */
+	if(!blockdev_flush_fd(check->fd, check->dev, error))
+		return 0;
+
+	/* All the probes a fold puts in one place come back as whichever was
+	 * written last. Only the lowest of them is really there; going up, that
+	 * one is seen first */
+	first_holder = g_new(guint64, offsets->len);
+	for(i=0; i < offsets->len; i++)
+		first_holder[i] = NO_PROBE;
+
+	for(i=0; i < offsets->len; i++) {
+		offset = g_array_index(offsets, guint64, i);
+		if(!probe_io(check, FALSE, buf, offset)) {
+			g_debug("%s: Reading the probe at %llu failed: %s", check->dev, 
+				(unsigned long long)offset, g_strerror(errno));
+			ret = MIN(ret, offset);
+		} else if( (owner = get_probe_owner(check, buf)) == NO_PROBE ) {
+			g_debug("%s: The probe at %llu didn't keep what was written", check->dev, 
+				(unsigned long long)offset);
+			ret = MIN(ret, offset);
+		} else {
+			found = bsearch(&owner, offsets->data, offsets->len, sizeof(guint64), compare_offsets);
+			if(owner != offset)
+				g_debug("%s: The probe at %llu holds the one from %llu", check->dev, 
+					(unsigned long long)offset, (unsigned long long)owner);
+
+			if(found && first_holder[found - (guint64*)offsets->data] == NO_PROBE)
+				first_holder[found - (guint64*)offsets->data] = offset;
+			else
+				ret = MIN(ret, offset);
+		}
+
+		if(!probe_done(check)) {
+			g_free(first_holder);
+			goto cancelled;
+		}
+	}
+
+	g_free(first_holder);
+	return ret;
+
+cancelled:
+	g_set_error(error, 0, 0, _("Checking the size of %s was cancelled"), check->dev);
+	return 0;
+}
+
+
+/*
+ * Public functions
+ */
+
+gboolean
+capacity_check(const char* dev, guint64* size, guint64* usable,
+	       BlockdevProgressFunc progress_cb, gpointer user_data, GError** error)
+{
+	guint sector_size;
+	guint64 part_start, bad;
+	guchar* buf = NULL;
+	GArray* offsets = NULL;
+	GError* err = NULL;
+	gboolean ret = FALSE;
+	Check check;
+
+	memset(&check, 0, sizeof(check));
+	check.dev = dev;
+	check.progress_cb = progress_cb;
+	check.user_data = user_data;
+
+	/* O_DIRECT so the reads come from the device, not from what we just
+	 * wrote; image files on filesystems without it get the flush instead */
+	if( (check.fd = open(dev, O_RDWR | O_DIRECT)) < 0 && errno == EINVAL )
+		check.fd = open(dev, O_RDWR);
+	if(check.fd < 0) {
+		g_set_error(error, 0, 0, _("Cannot open %s: %s"), dev, g_strerror(errno));
+		return FALSE;
+	}
+
+	if(!blockdev_get_geometry(check.fd, size, &sector_size, &part_start)) {
+		g_set_error(error, 0, 0, _("Cannot read the size of %s"), dev);
+		goto out;
+	}
+
+	check.probe_size = MAX(PROBE_SIZE, sector_size);
+	if(*size < 2 * check.probe_size) {
+		*usable = *size;
+		ret = TRUE;
+		goto out;
+	}
+
+	if(!chacha_key_random(&check.key, error))
+		goto out;
+	if(posix_memalign((void**)&buf, check.probe_size, check.probe_size) != 0 ||
+	   posix_memalign((void**)&check.expected, check.probe_size, check.probe_size) != 0) {
+		g_set_error(error, 0, 0, _("Cannot check the size of %s: %s"), dev, g_strerror(ENOMEM));
+		goto out;
+	}
+
+	offsets = get_probe_offsets(*size, check.probe_size);
+	check.total = 2 * offsets->len;
+	g_debug("Checking %s with %u probes", dev, offsets->len);
+
+	bad = write_and_read_probes(&check, offsets, buf, &err);
+	if(err) {
+		g_propagate_error(error, err);
+		goto out;
+	}
+
+	*usable = (bad == NO_PROBE ? *size : bad);
+	ret = TRUE;
+
+out:
+	chacha_key_clear(&check.key);
+	if(offsets)
+		g_array_free(offsets, TRUE);
+	free(buf);
+	free(check.expected);
+	close(check.fd);
+	return ret;
+}
@@ -0,0 +1,43 @@
+/*
+ * capacity-check.h - Catch devices that claim to hold more than they do
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef _CAPACITY_CHECK_H
+#define _CAPACITY_CHECK_H
+
+#include <glib.h>
+
+#include "blockdev.h"
+
+/* Writes a few hundred tagged blocks spread over all of dev, flushes, and
+ * reads them back. Sets *size to what dev says it holds, and *usable to how
+ * much of that at most really keeps what's written to it: the same as
+ * *size on an honest device. Counterfeit flash, which maps what it doesn't
+ * have back onto what it does, loses track of some of them or hands back
+ * one block's tag in another's place. It's over in seconds, but it writes
+ * over whatever was in those blocks. This blocks */
+gboolean capacity_check(const char* dev, guint64* size, guint64* usable,
+			BlockdevProgressFunc progress_cb, gpointer user_data, GError** error);
+
+#endif
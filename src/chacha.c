@@ -0,0 +1,183 @@
+/*
+ * chacha.c - ChaCha20 keystream for filling devices with random data
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gi18n.h>
+
+#include "chacha.h"
+
+/* ChaCha20 as djb first wrote it: a 64-bit block counter and a 64-bit
+ * nonce, which is what we want for seeking anywhere on a multi-TB device.
+ * /dev/urandom only hands out a few hundred MB/s, while this keeps up with
+ * NVMe on a couple of cores.
+ *
+ * LANES blocks are worked out side by side, one per vector lane, so each
+ * operation below does the same step for all of them. This is plain GCC
+ * vector code; the compiler turns it into SSE2, AVX2 or NEON, whatever the
+ * build targets. */
+
+#define BLOCK_SIZE 	64
+#define LANES 		8
+
+typedef guint32 ChachaVec __attribute__ ((vector_size (LANES * sizeof(guint32))));
+
+/* The same value in every lane */
+#define SPLAT(v) 	((ChachaVec){ 0 } + (guint32)(v))
+#define ROTL(v, n) 	(((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) do { 					\
+	a += b; d ^= a; d = ROTL(d, 16); 				\
+	c += d; b ^= c; b = ROTL(b, 12); 				\
+	a += b; d ^= a; d = ROTL(d, 8); 				\
+	c += d; b ^= c; b = ROTL(b, 7); 				\
+} while(0)
+
+/* "expand 32-byte k" */
+static const guint32 sigma[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+
+
+/*
+ * Utility Functions
+ */
+
+/* LANES consecutive blocks starting at block, LANES * BLOCK_SIZE bytes */
+static void
+chacha_blocks(const ChachaKey* key, guint64 block, guchar* out)
+{
+	ChachaVec in[16], x[16];
+	int i, lane;
+
+	for(i=0; i < 4; i++)
+		in[i] = SPLAT(sigma[i]);
+	for(i=0; i < 8; i++)
+		in[4 + i] = SPLAT(key->key[i]);
+	for(lane=0; lane < LANES; lane++) {
+		in[12][lane] = (guint32)(block + lane);
+		in[13][lane] = (guint32)((block + lane) >> 32);
+	}
+	in[14] = SPLAT(key->nonce[0]);
+	in[15] = SPLAT(key->nonce[1]);
+
+	memcpy(x, in, sizeof(x));
+	for(i=0; i < 10; i++) {
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+
+	/* Each lane is one block; the bytes go out little-endian */
+	for(i=0; i < 16; i++) {
+		x[i] += in[i];
+		for(lane=0; lane < LANES; lane++) {
+			guint32 word = GUINT32_TO_LE(x[i][lane]);
+			memcpy(out + lane * BLOCK_SIZE + i * 4, &word, 4);
+		}
+	}
+}
+
+
+/*
+ * Public functions
+ */
+
+gboolean
+chacha_key_random(ChachaKey* key, GError** error)
+{
+	guchar* p = (guchar*)key;
+	gsize left = sizeof(ChachaKey);
+	ssize_t ret;
+	int fd;
+
+	if( (fd = open("/dev/urandom", O_RDONLY)) < 0 ) {
+		g_set_error(error, 0, 0, _("Cannot open /dev/urandom: %s"), g_strerror(errno));
+		return FALSE;
+	}
+
+	while(left > 0) {
+		if( (ret = read(fd, p, left)) <= 0 ) {
+			if(ret < 0 && errno == EINTR)
+				continue;
+
+			g_set_error(error, 0, 0, _("Cannot read from /dev/urandom: %s"), 
+				    (ret < 0 ? g_strerror(errno) : _("Unexpected end of file")));
+			close(fd);
+			return FALSE;
+		}
+
+		p += ret; 	left -= ret;
+	}
+
+	close(fd);
+	return TRUE;
+}
+
+void
+chacha_key_clear(ChachaKey* key)
+{
+	/* volatile, so the compiler can't decide nobody will look */
+	volatile guchar* p = (volatile guchar*)key;
+	gsize i;
+
+	for(i=0; i < sizeof(ChachaKey); i++)
+		p[i] = 0;
+}
+
+void
+chacha_keystream(const ChachaKey* key, guint64 offset, guchar* buf, gsize len)
+{
+	guchar partial[LANES * BLOCK_SIZE];
+	guint64 block = offset / BLOCK_SIZE;
+	gsize skip = offset % BLOCK_SIZE, n;
+
+	/* Straight into buf whenever there's a whole batch of blocks to go */
+	while(len > 0) {
+		if(skip == 0 && len >= sizeof(partial)) {
+			chacha_blocks(key, block, buf);
+			n = sizeof(partial);
+		} else {
+			chacha_blocks(key, block, partial);
+			n = MIN(sizeof(partial) - skip, len);
+			memcpy(buf, partial + skip, n);
+			skip = 0;
+		}
+
+		buf += n; 	len -= n;
+		block += LANES;
+	}
+}
@@ -0,0 +1,47 @@
+/*
+ * chacha.h - ChaCha20 keystream for filling devices with random data
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef _CHACHA_H
+#define _CHACHA_H
+
+#include <glib.h>
+
+typedef struct _ChachaKey {
+	guint32 key[8];
+	guint32 nonce[2];
+} ChachaKey;
+
+/* A fresh key and nonce from the kernel's random pool */
+gboolean chacha_key_random(ChachaKey* key, GError** error);
+
+/* Scrubs the key once we're done with it */
+void chacha_key_clear(ChachaKey* key);
+
+/* Fills buf with len bytes of keystream, starting offset bytes into it. The
+ * same key and offset always give the same bytes, so any number of threads
+ * can each fill their own piece, in whatever order */
+void chacha_keystream(const ChachaKey* key, guint64 offset, guchar* buf, gsize len);
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * device-cache.c - Remember what devices we saw last time we ran
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+
+#include <glib.h>
+#include <glib/gi18n.h>
+
+#include "device-info.h"
+#include "device-cache.h"
+
+/* The cache is a GKeyFile with one group per device, named after its
+ * identity (serial, size and major:minor - see get_format_volume_identity).
+ * It's only there so we have something to show while the probe thread talks
+ * to HAL; nothing is ever formatted based on what's in here */
+
+#define DEVICE_CACHE_VERSION 	1
+
+static gchar*
+get_cache_path(void)
+{
+	return g_build_filename(g_get_user_cache_dir(), "gnome-format", "devices", NULL);
+}
+
+static FormatVolume*
+format_volume_from_group(GKeyFile* file, const gchar* group)
+{
+	FormatVolume* ret;
+	gchar* tmp;
+	unsigned int maj = 0, min = 0;
+
+	if( !(tmp = g_key_file_get_string(file, group, "UDI", NULL)) )
+		return NULL;
+
+	ret = g_new0(FormatVolume, 1);
+	ret->cached = TRUE;
+	ret->udi = tmp;
+	ret->type = (g_key_file_get_boolean(file, group, "IsVolume", NULL) ?
+			FORMATVOLUMETYPE_VOLUME : FORMATVOLUMETYPE_DRIVE);
+	ret->drive_udi = g_key_file_get_string(file, group, "DriveUDI", NULL);
+	ret->friendly_name = g_key_file_get_string(file, group, "Name", NULL);
+	ret->serial = g_key_file_get_string(file, group, "Serial", NULL);
+	ret->icon_path = g_key_file_get_string(file, group, "Icon", NULL);
+	ret->layout_summary = g_key_file_get_string(file, group, "Layout", NULL);
+	ret->can_format = g_key_file_get_boolean(file, group, "CanFormat", NULL);
+
+	/* GKeyFile in our version of GLib doesn't do 64-bit integers */
+	if( (tmp = g_key_file_get_string(file, group, "Size", NULL)) ) {
+		ret->size = g_ascii_strtoull(tmp, NULL, 10);
+		g_free(tmp);
+	}
+	if( (tmp = g_key_file_get_string(file, group, "Device", NULL)) ) {
+		if(sscanf(tmp, "%u:%u", &maj, &min) == 2)
+			ret->dev = makedev(maj, min);
+		g_free(tmp);
+	}
+
+	if(!ret->friendly_name)
+		ret->friendly_name = g_strdup("");
+
+	return ret;
+}
+
+static void
+add_volume_group(GKeyFile* file, const FormatVolume* vol)
+{
+	gchar *group, *tmp;
+
+	/* Group names can't have brackets or newlines in them */
+	group = get_format_volume_identity(vol);
+	g_strdelimit(group, "[]\n", '_');
+
+	g_key_file_set_string(file, group, "UDI", vol->udi);
+	g_key_file_set_boolean(file, group, "IsVolume", (vol->type == FORMATVOLUMETYPE_VOLUME));
+	if(vol->drive_udi)
+		g_key_file_set_string(file, group, "DriveUDI", vol->drive_udi);
+	if(vol->friendly_name)
+		g_key_file_set_string(file, group, "Name", vol->friendly_name);
+	if(vol->serial)
+		g_key_file_set_string(file, group, "Serial", vol->serial);
+	if(vol->icon_path)
+		g_key_file_set_string(file, group, "Icon", vol->icon_path);
+	if(vol->layout_summary)
+		g_key_file_set_string(file, group, "Layout", vol->layout_summary);
+	g_key_file_set_boolean(file, group, "CanFormat", vol->can_format);
+
+	tmp = g_strdup_printf("%" G_GUINT64_FORMAT, vol->size);
+	g_key_file_set_string(file, group, "Size", tmp);
+	g_free(tmp);
+
+	tmp = g_strdup_printf("%u:%u", major(vol->dev), minor(vol->dev));
+	g_key_file_set_string(file, group, "Device", tmp);
+	g_free(tmp);
+
+	g_free(group);
+}
+
+
+/*
+ * Public functions
+ */
+
+GSList*
+device_cache_load(void)
+{
+	GKeyFile* file = g_key_file_new();
+	GSList *drives = NULL, *volumes = NULL;
+	gchar* path = get_cache_path();
+	gchar** groups = NULL;
+	gsize i;
+
+	if(!g_key_file_load_from_file(file, path, G_KEY_FILE_NONE, NULL))
+		goto out;
+
+	if(g_key_file_get_integer(file, "Cache", "Version", NULL) != DEVICE_CACHE_VERSION) {
+		g_debug("Ignoring device cache from a different version");
+		goto out;
+	}
+
+	groups = g_key_file_get_groups(file, NULL);
+	for(i=0; groups[i] != NULL; i++) {
+		FormatVolume* current;
+
+		if(!strcmp(groups[i], "Cache"))
+			continue;
+		if( !(current = format_volume_from_group(file, groups[i])) )
+			continue;
+
+		if(current->type == FORMATVOLUMETYPE_DRIVE)
+			drives = g_slist_prepend(drives, current);
+		else
+			volumes = g_slist_prepend(volumes, current);
+	}
+
+	g_debug("Loaded %d devices from the cache", g_slist_length(drives) + g_slist_length(volumes));
+
+out:
+	g_strfreev(groups);
+	g_key_file_free(file);
+	g_free(path);
+
+	/* Drives go first so that volumes can find their parents */
+	return g_slist_concat(drives, volumes);
+}
+
+gboolean
+device_cache_save(GSList* drive_list, GSList* volume_list, GError** error)
+{
+	GKeyFile* file = g_key_file_new();
+	gchar *path = get_cache_path(), *dir = NULL, *data = NULL;
+	gboolean ret = FALSE;
+	GSList* iter;
+	gsize len;
+
+	g_key_file_set_integer(file, "Cache", "Version", DEVICE_CACHE_VERSION);
+	for(iter = drive_list; iter != NULL; iter = iter->next)
+		add_volume_group(file, iter->data);
+	for(iter = volume_list; iter != NULL; iter = iter->next)
+		add_volume_group(file, iter->data);
+
+	if( !(data = g_key_file_to_data(file, &len, error)) )
+		goto out;
+
+	dir = g_path_get_dirname(path);
+	if(g_mkdir_with_parents(dir, 0700) != 0) {
+		g_set_error(error, 0, 0, _("Cannot create directory %s"), dir);
+		goto out;
+	}
+
+	/* g_file_set_contents writes to a temporary file and renames it,
+	 * so a crash can't leave us with half a cache */
+	ret = g_file_set_contents(path, data, len, error);
+
+out:
+	g_free(data);
+	g_free(dir);
+	g_free(path);
+	g_key_file_free(file);
+	return ret;
+}
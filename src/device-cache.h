@@ -0,0 +1,38 @@
+/*
+ * device-cache.h - Remember what devices we saw last time we ran
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _DEVICE_CACHE_H
+#define _DEVICE_CACHE_H
+
+#include <glib.h>
+
+#include "device-info.h"
+
+/* Returns a list of FormatVolume's with ->cached set, drives first. Free it
+ * with format_volume_list_free() */
+GSList* device_cache_load(void);
+
+gboolean device_cache_save(GSList* drive_list, GSList* volume_list, GError** error);
+
+#endif
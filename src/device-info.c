@@ -23,10 +23,13 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include <libhal.h>
 #include <libhal-storage.h>
@@ -40,6 +43,7 @@
 #include <gdk/gdk.h>
 #include <libgnomevfs/gnome-vfs-utils.h>
 
+#include "blockdev.h"
 #include "device-info.h"
 #include "partutil.h"
 
@@ -98,6 +102,11 @@ const struct _AltTableDict AppleTable[] = {
 };
 
 
+/* libparted keeps a global list of devices it has opened, so only one thread
+ * gets to use it at a time */
+G_LOCK_DEFINE(parted);
+
+
 /*
  * Functions
  */
@@ -111,8 +120,6 @@ format_volume_free(FormatVolume* fvol)
 		libhal_volume_free(fvol->volume);
 	if(fvol->drive)
 		libhal_drive_free(fvol->drive);
-	if(fvol->icon)
-		g_object_unref(fvol->icon);
 	if(fvol->friendly_name)
 		g_free(fvol->friendly_name);
 	if(fvol->udi)
@@ -121,6 +128,9 @@ format_volume_free(FormatVolume* fvol)
 		g_free(fvol->drive_udi);
 	if(fvol->mountpoint)
 		g_free(fvol->mountpoint);
+	g_free(fvol->serial);
+	g_free(fvol->icon_path);
+	g_free(fvol->layout_summary);
 		
 	g_free(fvol);
 }
@@ -133,12 +143,10 @@ void format_volume_list_free(GSList* volume_list)
 	g_slist_free(volume_list);
 }
 
-/* FIXME: We should really change the name of this func*/
-LibHalContext* 
-libhal_context_alloc(void)
-{ 
+static LibHalContext*
+context_for_connection(DBusConnection* system_bus)
+{
 	LibHalContext *hal_ctx = NULL;
-	DBusConnection *system_bus = NULL;
 	DBusError error;
 
 	hal_ctx = libhal_ctx_new ();
@@ -148,13 +156,6 @@ libhal_context_alloc(void)
 	}
 
 	dbus_error_init (&error);
-	system_bus = dbus_bus_get (DBUS_BUS_SYSTEM, &error);
-	if (dbus_error_is_set (&error)) {
-		g_warning ("Cannot connect to system bus: %s : %s", error.name, error.message);
-		dbus_error_free (&error);
-		goto error;
-	}
-
 	libhal_ctx_set_dbus_connection (hal_ctx, system_bus);
 
 	if (!libhal_ctx_init (hal_ctx, &error)) {
@@ -172,39 +173,22 @@ error:
 
 }
 
-static GdkPixbuf* 
-load_icon_from_cache(const char* path, GHashTable* icon_cache, int width, int height)
-{
-	GdkPixbuf* ret;
-
-	if(!path) 	return NULL;
-	if (icon_cache && (ret = g_hash_table_lookup(icon_cache, path)) )
-		return ret;
+/* FIXME: We should really change the name of this func*/
+LibHalContext* 
+libhal_context_alloc(void)
+{ 
+	DBusConnection *system_bus = NULL;
+	DBusError error;
 
-	GError* err = NULL;
-	if(width && height) {
-		ret = gdk_pixbuf_new_from_file_at_size(path, width, height, &err);
-	}
-	else {
-		ret = gdk_pixbuf_new_from_file(path, &err);
-	}
-	if(err) {
-		g_warning("Couldn't load icon '%s'! message = '%s'", path, err->message);
-		g_error_free(err);
+	dbus_error_init (&error);
+	system_bus = dbus_bus_get (DBUS_BUS_SYSTEM, &error);
+	if (dbus_error_is_set (&error)) {
+		g_warning ("Cannot connect to system bus: %s : %s", error.name, error.message);
+		dbus_error_free (&error);
+		return NULL;
 	}
 
-	if(icon_cache)
-		g_hash_table_insert(icon_cache, g_strdup(path), ret);
-
-	return ret;
-}
-
-static void mem_free_cb(gpointer data)  { g_free(data); }
-static void unref_free_cb(gpointer data)  { g_object_unref( G_OBJECT(data) ); }
-
-GHashTable* create_icon_cache(void)
-{
-	return g_hash_table_new_full(g_str_hash, g_str_equal, mem_free_cb, unref_free_cb);
+	return context_for_connection (system_bus);
 }
 
 guint64 
@@ -221,7 +205,18 @@ get_format_volume_size(const FormatVolume* vol)
 	if(vol->drive)
 		return libhal_drive_get_size(vol->drive);
 
-	return 0;
+	/* Cached entries only have what we saved */
+	return vol->size;
+}
+
+gchar*
+get_format_volume_identity(const FormatVolume* vol)
+{
+	/* UDIs aren't stable across reboots (or even replugs), so we key the
+	 * device cache on things that are */
+	return g_strdup_printf("%s:%" G_GUINT64_FORMAT ":%u:%u", 
+			       (vol->serial ? vol->serial : ""), vol->size, 
+			       major(vol->dev), minor(vol->dev));
 }
 
 gchar*
@@ -353,7 +348,7 @@ int
 get_part_type_from_fs(const char* fs_name)
 {
 	const struct _PartTypeDict* iter = PartTypeDict;
-	while(iter) {
+	while(iter->fs_name) {
 		if(!strcmp(fs_name, iter->fs_name))
 			return iter->msdos_value;
 		iter++;
@@ -370,7 +365,7 @@ get_parted_type_string(int msdos_parttype, PartitionScheme scheme)
 
 	char* ret = (scheme == PART_TYPE_APPLE ? "Apple_Unix_SVR2" : "{EBD0A0A2-B9E5-4433-87C0-68B6B72699C7}");
 	const struct _AltTableDict* table_item = (scheme == PART_TYPE_APPLE ? AppleTable : GPTTable);
-	while(table_item) {
+	while(table_item->msdos) {
 		if(!strcmp(msdos, table_item->msdos))  {
 			ret = table_item->alt;
 			goto out;
@@ -387,6 +382,9 @@ out:
 /* from <linux/fs.h> */
 #define _IO(type,nr)		_IOC(_IOC_NONE,(type),(nr),0)
 #define BLKRRPART  _IO(0x12,95) /* re-read partition table */
+#ifndef BLKGETSIZE64
+#define BLKGETSIZE64 _IOR(0x12,114,size_t) /* return device size in bytes */
+#endif
 
 gboolean
 repoll_partition_table_linux(const char* dev)
@@ -394,17 +392,17 @@ repoll_partition_table_linux(const char* dev)
 	int fd = open(dev, O_RDWR);
 	int retry_count = 5;
 	if(fd < 1)	return FALSE;
-	sync();
+
+	/* The new table has to be on the disk before the kernel reads it back;
+	 * that's all we need written, not every dirty page on the machine */
+	blockdev_flush_fd(fd, dev, NULL);
 	while (ioctl (fd, BLKRRPART)) {
 		retry_count--;
-		sync();
+		blockdev_flush_fd(fd, dev, NULL);
 		if (!retry_count)
 			goto out;
 	}
 
-	/* Wait awhile for the kernel to repoll */
-	sleep(1);
-
 out:
 	close(fd);
 	return TRUE;
@@ -418,31 +416,51 @@ repoll_partition_table(const char* dev)
 	return repoll_partition_table_linux(dev);
 }
 
-gboolean
-write_partition_table_for_device(LibHalDrive* drive, PartitionScheme scheme, GError** error)
+static GSList* get_kernel_partitions(const char* disk);
+
+/* We know exactly what changed, so tell the kernel just that rather than
+ * having it re-read the whole table. BLKRRPART gives up if anything on the
+ * disk is open, while BLKPG only minds about the partitions it touches */
+static gboolean
+update_kernel_partitions(const char* dev, guint64 start, guint64 size)
 {
-	char* name;
-	const char* msg;
-	g_assert(drive);
+	GSList *partitions, *iter;
+	gboolean ret = TRUE;
+	int fd;
 
-	char* dev = libhal_drive_get_device_file(drive);
-	g_assert(dev);
-	if(!dev)	return FALSE;
+	if( (fd = open(dev, O_RDWR)) < 0 )
+		return FALSE;
 
-	/* Create a new table first */
-	if(!part_create_partition_table(dev, scheme)) {
-		msg =  _("Cannot create partition table on %s");
-		goto error_out;
+	/* The new table has to be on the disk before anything reads it back
+	 * through a partition */
+	blockdev_flush_fd(fd, dev, NULL);
+
+	partitions = get_kernel_partitions(dev);
+	for(iter = partitions; ret && iter != NULL; iter = iter->next)
+		ret = blockdev_del_partition(fd, GPOINTER_TO_INT(iter->data));
+	g_slist_free(partitions);
+
+	if(ret)
+		ret = blockdev_add_partition(fd, 1, start, size);
+	close(fd);
+
+	if(!ret) {
+		g_debug("Couldn't update the partitions on %s one at a time, re-reading the table", dev);
+		return repoll_partition_table(dev);
 	}
+	return TRUE;
+}
+
+gboolean
+write_partition_table_for_device_file(const char* dev, guint64 size, PartitionScheme scheme, GError** error)
+{
+	const char* msg;
+	gboolean ret;
+	g_assert(dev);
 
 	/* Create one partition in this table; we start the FS at sector
 	 * 63 */
 	const int start = 512*63;
-	guint64 size = (guint64)libhal_drive_get_size(drive);
-	if(size == 0) {
-		/* Try to get the media size - even for USB disks we have to do this */
-		size = (guint64)libhal_drive_get_media_size(drive);
-	}
 	if(size < start) {
 		msg = _("Cannot create partition table on %s");
 		goto error_out;
@@ -462,14 +480,22 @@ write_partition_table_for_device(LibHalDrive* drive, PartitionScheme scheme, GEr
 		type = "0x83";
 	}
 
-	guint64 dontcare;
-	if(!part_add_partition(dev, start, size - start, &dontcare, &dontcare, 
-			       (char*)type, NULL, NULL, 0, 0)) {
-		msg = _("Cannot add new partition on %s");
-		goto error_out;
+	/* Create a new table first */
+	G_LOCK(parted);
+	guint64 part_start = 0, part_size = 0;
+	if( (ret = part_create_partition_table((char*)dev, scheme)) ) {
+		if( !(ret = part_add_partition((char*)dev, start, size - start, &part_start, &part_size, 
+					       (char*)type, NULL, NULL, 0, 0)) )
+			msg = _("Cannot add new partition on %s");
+	} else {
+		msg = _("Cannot create partition table on %s");
 	}
+	G_UNLOCK(parted);
+
+	if(!ret)
+		goto error_out;
 
-	if(!repoll_partition_table(dev)) {
+	if(!update_kernel_partitions(dev, part_start, part_size)) {
 		msg = _("The kernel cannot repoll the partition table on %s. "
 			"Please reboot the computer or reinsert this disk if it "
 			"is removable and try again.");
@@ -479,93 +505,212 @@ write_partition_table_for_device(LibHalDrive* drive, PartitionScheme scheme, GEr
 	return TRUE;
 
 error_out:
-	name = get_friendly_drive_name(drive);
-	g_set_error(error, 0, 0, _("Cannot create partition table on %s"), name);
-	g_free(name);
+	g_set_error(error, 0, 0, msg, dev);
 	return FALSE;
 }
 
 gboolean
-set_partition_type(LibHalDrive* drive, int partition, int msdos_type)
+write_partition_table_for_device(LibHalDrive* drive, PartitionScheme scheme, GError** error)
 {
+	g_assert(drive);
+
 	const char* dev = libhal_drive_get_device_file(drive);
-	if(!dev) 	return FALSE;
+	g_assert(dev);
+	if(!dev)	return FALSE;
 
-	PartitionTable* table = part_table_load_from_disk(dev);
-	if(!table) 	return FALSE;
-	int entries = part_table_get_num_entries(table);
-	if(entries < partition) 	return FALSE;
-	PartitionScheme scheme = part_table_get_scheme(table);
+	guint64 size = (guint64)libhal_drive_get_size(drive);
+	if(size == 0) {
+		/* Try to get the media size - even for USB disks we have to do this */
+		size = (guint64)libhal_drive_get_media_size(drive);
+	}
 
-	gboolean ret;
+	return write_partition_table_for_device_file(dev, size, scheme, error);
+}
+
+gboolean
+set_partition_type_for_device_file(const char* dev, int partition, int msdos_type)
+{
+	gboolean ret = FALSE;
 	guint64 start, size, dontcare;
 	char* type;
+
+	G_LOCK(parted);
+
+	PartitionTable* table = part_table_load_from_disk((char*)dev);
+	if(!table) 	goto out;
+	int entries = part_table_get_num_entries(table);
+	if(entries < partition) {
+		part_table_free(table);
+		goto out;
+	}
+	PartitionScheme scheme = part_table_get_scheme(table);
+
 	start = part_table_entry_get_offset(table, partition);
 	size = part_table_entry_get_size(table, partition);
+	part_table_free(table);
 	type = get_parted_type_string(msdos_type, scheme);
 	
-	ret = part_change_partition(dev, start, start, size, &dontcare, &dontcare, 
+	ret = part_change_partition((char*)dev, start, start, size, &dontcare, &dontcare, 
 				type, NULL, NULL, 0, 0);
 	g_free(type);
+
+out:
+	G_UNLOCK(parted);
 	return ret;
 }
 
-GSList* 
-get_volumes_mounted_on_drive(LibHalContext* ctx, LibHalDrive* drive)
+gboolean
+set_partition_type(LibHalDrive* drive, int partition, int msdos_type)
+{
+	const char* dev = libhal_drive_get_device_file(drive);
+	if(!dev) 	return FALSE;
+
+	return set_partition_type_for_device_file(dev, partition, msdos_type);
+}
+
+guint64
+get_block_device_size(const char* dev)
 {
-	/* FIXME: This sucks - HAL doesn't report mounted volumes correctly */
+	guint64 ret = 0;
+	int fd;
 
-	GSList* volume_list = NULL;
-	int num_vols = 0;
+	if( (fd = open(dev, O_RDONLY)) < 0 )
+		return 0;
+	if(ioctl(fd, BLKGETSIZE64, &ret) != 0)
+		ret = 0;
 
-	char** vol_udis = libhal_drive_find_all_volumes(ctx, drive, &num_vols);
-	if(num_vols <= 0 || vol_udis == NULL)
-		goto out;
+	close(fd);
+	return ret;
+}
 
-	int i=0;
-	for(i=0; i < num_vols; i++) {
-		LibHalVolume* current;
-		if(!vol_udis[i]) 	break;
-		current = libhal_volume_from_udi(ctx, vol_udis[i]);
-		if(!current) 	continue;
+static gchar*
+get_sysfs_path_for_device_file(const char* dev)
+{
+	struct stat st;
+	gchar *path, *ret;
 
-		if(libhal_volume_is_mounted(current)) 
-			volume_list = g_slist_prepend(volume_list, g_strdup(vol_udis[i]));
-		libhal_volume_free(current);
+	if(stat(dev, &st) != 0 || !S_ISBLK(st.st_mode))
+		return NULL;
+
+	path = g_strdup_printf("/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+	ret = realpath(path, NULL);
+	g_free(path);
+	return ret;
+}
+
+gboolean
+is_partition_device_file(const char* dev)
+{
+	gchar *sysfs_path, *attr;
+	gboolean ret;
+
+	if( !(sysfs_path = get_sysfs_path_for_device_file(dev)) )
+		return FALSE;
+
+	attr = g_build_filename(sysfs_path, "partition", NULL);
+	ret = g_file_test(attr, G_FILE_TEST_EXISTS);
+	g_free(attr);
+	free(sysfs_path);
+	return ret;
+}
+
+static GSList*
+get_kernel_partitions(const char* disk)
+{
+	gchar* sysfs_path;
+	const gchar* name;
+	GSList* ret = NULL;
+	GDir* dir;
+
+	if( !(sysfs_path = get_sysfs_path_for_device_file(disk)) )
+		return NULL;
+	if( !(dir = g_dir_open(sysfs_path, 0, NULL)) ) {
+		free(sysfs_path);
+		return NULL;
 	}
-	libhal_free_string_array(vol_udis);
 
-out:
-	return volume_list;
+	while( (name = g_dir_read_name(dir)) ) {
+		gchar *attr = g_build_filename(sysfs_path, name, "partition", NULL);
+		gchar *contents = NULL;
+
+		if(g_file_get_contents(attr, &contents, NULL, NULL))
+			ret = g_slist_prepend(ret, GINT_TO_POINTER(atoi(contents)));
+
+		g_free(contents);
+		g_free(attr);
+	}
+
+	g_dir_close(dir);
+	free(sysfs_path);
+	return ret;
 }
 
-GSList* 
-build_volume_list(LibHalContext* ctx, 
-		  enum FormatVolumeType type, 
-		  GHashTable* icon_cache, 
-		  int icon_width, int icon_height)
+gchar*
+get_partition_device_file(const char* disk, int partition)
 {
-	const char* capability = "";
-	char** device_udis;
-	int i, device_udi_count = 0;
-	GSList* device_list = NULL;
-	DBusError error;
+	gchar *sysfs_path, *ret = NULL;
+	const gchar* name;
+	GDir* dir;
+
+	/* The partitions show up as subdirectories of the disk in sysfs, and
+	 * their names are what the kernel (and udev) call the device node;
+	 * that saves us knowing that sdb goes to sdb1 but mmcblk0 to mmcblk0p1 */
+	if( !(sysfs_path = get_sysfs_path_for_device_file(disk)) )
+		return NULL;
+	if( !(dir = g_dir_open(sysfs_path, 0, NULL)) ) {
+		free(sysfs_path);
+		return NULL;
+	}
 
-	switch(type) {
-	case FORMATVOLUMETYPE_VOLUME:
-		capability = "volume";
-		break;
-	case FORMATVOLUMETYPE_DRIVE:
-		capability = "storage";
-		break;
+	while(!ret && (name = g_dir_read_name(dir)) ) {
+		gchar *attr = g_build_filename(sysfs_path, name, "partition", NULL);
+		gchar *contents = NULL;
+
+		if(g_file_get_contents(attr, &contents, NULL, NULL) && atoi(contents) == partition)
+			ret = g_build_filename("/dev", name, NULL);
+
+		g_free(contents);
+		g_free(attr);
 	}
 
-	/* Pull the storage (or volume) list from HAL */
-	dbus_error_init (&error); 
-	if ( (device_udis = libhal_find_device_by_capability (ctx, capability, &device_udi_count, &error) ) == NULL) {
-		LIBHAL_FREE_DBUS_ERROR (&error);
-		goto out;
+	g_dir_close(dir);
+	free(sysfs_path);
+	return ret;
+}
+
+static gchar*
+get_partition_layout_summary(const char* device)
+{
+	PartitionTable* table;
+	const char* scheme;
+	gchar* ret;
+	int count;
+
+	/* This reads the disk, so it had better not be on the main thread */
+	if(!device)
+		return NULL;
+
+	G_LOCK(parted);
+	if( (table = part_table_load_from_disk((char*)device)) ) {
+		count = part_table_get_num_entries(table);
+		if( !(scheme = part_get_scheme_name(part_table_get_scheme(table))) )
+			scheme = _("unknown");
+		ret = g_strdup_printf(ngettext("%s, %d partition", "%s, %d partitions", count), scheme, count);
+		part_table_free(table);
+	} else {
+		ret = NULL;
 	}
+	G_UNLOCK(parted);
+
+	return ret;
+}
+
+static FormatVolume*
+format_volume_new_from_udi(LibHalContext* ctx, 
+			   enum FormatVolumeType type, 
+			   const char* udi)
+{
+	FormatVolume* current = g_new0(FormatVolume, 1);
 
 	/* if we use libhal_device_get-property() instead of 
 	 * libhal_volume_get_mount_mount_point() we have to setup DBusError and
@@ -580,56 +725,391 @@ build_volume_list(LibHalContext* ctx,
 	 */
 
 	/* Now we use libhal-storage to get the info */
-	FormatVolume* current;
-	const char* icon_path;
-	for(i=0; i < device_udi_count; i++) {
-		current = g_new0(FormatVolume, 1);
-
-		g_debug("udi: %s", device_udis[i]);
-		current->udi = g_strdup(device_udis[i]);
-		switch(type) {
-		case FORMATVOLUMETYPE_VOLUME:
-			current->volume = libhal_volume_from_udi(ctx, device_udis[i]);
-			if(!current->volume) {
-				g_free(current);
-				continue;
-			}
-
-			/* FIXME: This tastes like wrong */
-			current->icon = NULL;
-
-			current->friendly_name = get_friendly_volume_info(ctx, current->volume);
-			current->drive_udi = g_strdup(libhal_volume_get_storage_device_udi(current->volume));
-			current->mountpoint = g_strdup(libhal_volume_get_mount_point(current->volume));
-			break;
-
-		case FORMATVOLUMETYPE_DRIVE:
-			current->drive = libhal_drive_from_udi(ctx, device_udis[i]);
-			if(!current->drive) {
-				g_free(current);
-				continue;
-			}
-
-			g_debug("Icon drive: %s; Icon volume: %s",
-					libhal_drive_get_dedicated_icon_drive(current->drive),
-					libhal_drive_get_dedicated_icon_volume(current->drive));
-			icon_path = libhal_drive_get_dedicated_icon_drive(current->drive);
-			current->icon = load_icon_from_cache(icon_path, icon_cache, icon_width, icon_height);
-
-			current->friendly_name = get_friendly_drive_info(current->drive);
-
-			break;
+	g_debug("udi: %s", udi);
+	current->udi = g_strdup(udi);
+	switch(type) {
+	case FORMATVOLUMETYPE_VOLUME:
+		current->volume = libhal_volume_from_udi(ctx, udi);
+		if(!current->volume) {
+			g_free(current->udi);
+			g_free(current);
+			return NULL;
+		}
+
+		current->friendly_name = get_friendly_volume_info(ctx, current->volume);
+		current->drive_udi = g_strdup(libhal_volume_get_storage_device_udi(current->volume));
+		current->mountpoint = g_strdup(libhal_volume_get_mount_point(current->volume));
+		current->dev = makedev(libhal_volume_get_device_major(current->volume),
+				       libhal_volume_get_device_minor(current->volume));
+		current->serial = g_strdup(libhal_volume_get_uuid(current->volume));
+		current->can_format = TRUE;
+		break;
+
+	case FORMATVOLUMETYPE_DRIVE:
+		current->drive = libhal_drive_from_udi(ctx, udi);
+		if(!current->drive) {
+			g_free(current->udi);
+			g_free(current);
+			return NULL;
 		}
 
-		/* Do some last minute sanity checks */
-		if(!current->friendly_name)	current->friendly_name = "";
+		g_debug("Icon drive: %s; Icon volume: %s",
+				libhal_drive_get_dedicated_icon_drive(current->drive),
+				libhal_drive_get_dedicated_icon_volume(current->drive));
+		/* The dialog loads the icon itself, off the main thread */
+		current->icon_path = g_strdup(libhal_drive_get_dedicated_icon_drive(current->drive));
+
+		current->friendly_name = get_friendly_drive_info(current->drive);
+		current->dev = makedev(libhal_drive_get_device_major(current->drive),
+				       libhal_drive_get_device_minor(current->drive));
+		current->serial = g_strdup(libhal_drive_get_serial(current->drive));
+		current->can_format = (!libhal_drive_uses_removable_media(current->drive) ||
+				       libhal_drive_is_media_detected(current->drive));
+
+		/* The partition table is only read when someone looks at the
+		 * drive, see probe_drive_volumes_async */
+		break;
+	}
+
+	/* Do some last minute sanity checks */
+	if(!current->friendly_name)	current->friendly_name = g_strdup("");
+	current->type = type;
+	current->size = get_format_volume_size(current);
 
-		device_list = g_slist_prepend(device_list, current);
+	return current;
+}
+
+static char**
+find_device_udis(LibHalContext* ctx, enum FormatVolumeType type, int* count)
+{
+	const char* capability = "";
+	char** ret;
+	DBusError error;
+
+	switch(type) {
+	case FORMATVOLUMETYPE_VOLUME:
+		capability = "volume";
+		break;
+	case FORMATVOLUMETYPE_DRIVE:
+		capability = "storage";
+		break;
+	}
+
+	/* Pull the storage (or volume) list from HAL */
+	dbus_error_init (&error); 
+	if ( (ret = libhal_find_device_by_capability (ctx, capability, count, &error) ) == NULL)
+		LIBHAL_FREE_DBUS_ERROR (&error);
+
+	return ret;
+}
+
+GSList* 
+build_volume_list(LibHalContext* ctx, enum FormatVolumeType type)
+{
+	char** device_udis;
+	int i, device_udi_count = 0;
+	GSList* device_list = NULL;
+	FormatVolume* current;
+
+	if( !(device_udis = find_device_udis(ctx, type, &device_udi_count)) )
+		goto out;
+
+	for(i=0; i < device_udi_count; i++) {
+		current = format_volume_new_from_udi(ctx, type, device_udis[i]);
+		if(current)
+			device_list = g_slist_prepend(device_list, current);
 	}
 	
-	if(device_udis)
-		libhal_free_string_array(device_udis);
+	libhal_free_string_array(device_udis);
 
 out:
 	return device_list;
 }
+
+static GSList*
+find_drive_volumes(LibHalContext* ctx, LibHalDrive* drive)
+{
+	char** volume_udis;
+	int i, volume_udi_count = 0;
+	GSList* ret = NULL;
+	FormatVolume* current;
+
+	if( !(volume_udis = libhal_drive_find_all_volumes(ctx, drive, &volume_udi_count)) )
+		return NULL;
+
+	for(i=0; i < volume_udi_count; i++) {
+		current = format_volume_new_from_udi(ctx, FORMATVOLUMETYPE_VOLUME, volume_udis[i]);
+		if(current)
+			ret = g_slist_prepend(ret, current);
+	}
+
+	libhal_free_string_array(volume_udis);
+	return g_slist_reverse(ret);
+}
+
+GSList*
+build_drive_volume_list(LibHalContext* ctx, const char* drive_udi)
+{
+	LibHalDrive* drive;
+	GSList* ret;
+
+	if( !(drive = libhal_drive_from_udi(ctx, drive_udi)) )
+		return NULL;
+
+	ret = find_drive_volumes(ctx, drive);
+	libhal_drive_free(drive);
+	return ret;
+}
+
+gint
+get_hal_version(void)
+{
+	gint hal_version = 0;
+	gchar** split = NULL;
+	gchar *output = NULL, *err = NULL;
+	gint status;
+
+	/* FIXME: This is hardcoded. This is bad. */
+	if(!g_spawn_command_line_sync("/usr/sbin/hald --version", &output, &err, &status, NULL))
+		goto out;
+
+	if(!output)
+		goto out;
+
+	split = g_strsplit_set(output, " .", 0 /*All tokens*/);
+
+	if(!split || !split[0])
+		goto out;
+
+	/* FIXME: Make this check more thorough */
+	if(!split[1] || !split[2] || !split[3] || !split[4] || !split[5] || !split[6])
+		goto out;
+	hal_version = atoi(split[3])*1000 + atoi(split[4])*100 + atoi(split[5])*10 + atoi(split[6]);
+	
+out:
+	if(split)
+		g_strfreev(split);
+	g_free(output);
+	g_free(err);
+	return hal_version;
+}
+
+
+/*
+ * Asynchronous device probing
+ *
+ * Talking to HAL (and spawning hald to find out its version) can take a long
+ * time if a device is slow to answer, so we do all of it on a separate thread.
+ * Every device we find is handed back to the main loop through an idle
+ * callback as soon as we have it, so the device list fills in progressively.
+ * The probe's LibHalContext is handed back at the end so the caller can keep
+ * it around for HAL signals, and pass it (and the HAL version) to the next
+ * probe instead of connecting to the bus again.
+ *
+ * The full probe only looks at drives; a drive's volumes and partition table
+ * are read by a separate, per-drive probe once somebody actually looks at it.
+ */
+
+typedef struct {
+	guint serial;
+	VolumeFoundFunc found_cb;
+	ProbeFinishedFunc finished_cb;
+	DriveProbeFinishedFunc drive_finished_cb;
+	gpointer user_data;
+	gchar* drive_udi;		/* Only set for per-drive probes */
+
+	/* Filled in by the probe thread, unless the caller already had them */
+	LibHalContext* ctx;
+	gboolean owns_ctx;
+	gint hal_version;
+	gchar* layout_summary;
+	gboolean succeeded;
+} VolumeProbe;
+
+typedef struct {
+	VolumeProbe* probe;
+	FormatVolume* vol;
+	enum FormatVolumeType type;
+} VolumeProbeResult;
+
+static gint last_probe_serial = 0;
+
+static gboolean
+probe_found_idle(gpointer data)
+{
+	VolumeProbeResult* result = data;
+	VolumeProbe* probe = result->probe;
+
+	/* The callback takes ownership of the volume */
+	probe->found_cb(result->vol, result->type, probe->serial, probe->user_data);
+	g_free(result);
+	return FALSE;
+}
+
+static gboolean
+probe_finished_idle(gpointer data)
+{
+	VolumeProbe* probe = data;
+
+	/* ...and of the context, or the layout summary */
+	if(probe->drive_udi) {
+		probe->drive_finished_cb(probe->drive_udi, probe->layout_summary, 
+					 probe->succeeded, probe->serial, probe->user_data);
+		g_free(probe->drive_udi);
+	} else {
+		probe->finished_cb((probe->owns_ctx ? probe->ctx : NULL), probe->hal_version, 
+				   probe->succeeded, probe->serial, probe->user_data);
+	}
+
+	g_free(probe);
+	return FALSE;
+}
+
+static void
+post_probe_result(VolumeProbe* probe, FormatVolume* vol, enum FormatVolumeType type)
+{
+	VolumeProbeResult* result = g_new0(VolumeProbeResult, 1);
+
+	result->probe = probe; 	result->vol = vol;
+	result->type = type;
+	g_idle_add(probe_found_idle, result);
+}
+
+static gpointer
+probe_volumes_thread(gpointer data)
+{
+	VolumeProbe* probe = data;
+	char** device_udis;
+	int i, device_udi_count = 0;
+
+	/* Spawning hald and connecting to the bus only has to happen once;
+	 * after that the caller hands us what the first probe found */
+	if(!probe->hal_version)
+		probe->hal_version = get_hal_version();
+	if(!probe->ctx) {
+		if( !(probe->ctx = libhal_context_alloc()) )
+			goto out;
+		probe->owns_ctx = TRUE;
+	}
+
+	if( !(device_udis = find_device_udis(probe->ctx, FORMATVOLUMETYPE_DRIVE, &device_udi_count)) )
+		goto out;
+
+	probe->succeeded = TRUE;
+	for(i=0; i < device_udi_count; i++) {
+		FormatVolume* current;
+
+		current = format_volume_new_from_udi(probe->ctx, FORMATVOLUMETYPE_DRIVE, device_udis[i]);
+		if(current)
+			post_probe_result(probe, current, FORMATVOLUMETYPE_DRIVE);
+	}
+
+	libhal_free_string_array(device_udis);
+
+out:
+	g_idle_add(probe_finished_idle, probe);
+	return NULL;
+}
+
+static gpointer
+probe_drive_volumes_thread(gpointer data)
+{
+	VolumeProbe* probe = data;
+	DBusConnection* bus;
+	LibHalDrive* drive = NULL;
+	GSList *volumes, *iter;
+	DBusError error;
+
+	/* Each of these gets a connection of its own, since the main thread is
+	 * busy using the dialog's; it goes away with the probe */
+	dbus_error_init(&error);
+	if( !(bus = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error)) ) {
+		g_warning("Cannot connect to system bus: %s : %s", error.name, error.message);
+		dbus_error_free(&error);
+		goto out;
+	}
+	dbus_connection_set_exit_on_disconnect(bus, FALSE);
+
+	if( !(probe->ctx = context_for_connection(bus)) )
+		goto out;
+	if( !(drive = libhal_drive_from_udi(probe->ctx, probe->drive_udi)) )
+		goto out;
+
+	probe->layout_summary = get_partition_layout_summary(libhal_drive_get_device_file(drive));
+
+	volumes = find_drive_volumes(probe->ctx, drive);
+	for(iter = volumes; iter != NULL; iter = iter->next)
+		post_probe_result(probe, iter->data, FORMATVOLUMETYPE_VOLUME);
+	g_slist_free(volumes);
+
+	probe->succeeded = TRUE;
+
+out:
+	if(drive)
+		libhal_drive_free(drive);
+	if(probe->ctx) {
+		libhal_ctx_shutdown(probe->ctx, NULL);
+		libhal_ctx_free(probe->ctx);
+		probe->ctx = NULL;
+	}
+	if(bus) {
+		dbus_connection_close(bus);
+		dbus_connection_unref(bus);
+	}
+
+	g_idle_add(probe_finished_idle, probe);
+	return NULL;
+}
+
+static guint
+start_probe(VolumeProbe* probe, GThreadFunc func)
+{
+	GError* err = NULL;
+	guint serial;
+
+	serial = (guint)g_atomic_int_exchange_and_add(&last_probe_serial, 1) + 1;
+	probe->serial = serial;
+
+	if(!g_thread_create(func, probe, FALSE /*joinable*/, &err)) {
+		g_warning("Couldn't create device probe thread: %s", err->message);
+		g_error_free(err);
+
+		/* Report the failure the same way a failed probe would */
+		g_idle_add(probe_finished_idle, probe);
+	}
+
+	return serial;
+}
+
+guint
+probe_volumes_async(LibHalContext* ctx, 
+		    gint hal_version, 
+		    VolumeFoundFunc found_cb, 
+		    ProbeFinishedFunc finished_cb, 
+		    gpointer user_data)
+{
+	VolumeProbe* probe = g_new0(VolumeProbe, 1);
+
+	g_assert(found_cb != NULL && finished_cb != NULL);
+
+	probe->ctx = ctx; 			probe->hal_version = hal_version;
+	probe->found_cb = found_cb; 		probe->finished_cb = finished_cb;
+	probe->user_data = user_data;
+	return start_probe(probe, probe_volumes_thread);
+}
+
+guint
+probe_drive_volumes_async(const char* drive_udi, 
+			  VolumeFoundFunc found_cb, 
+			  DriveProbeFinishedFunc finished_cb, 
+			  gpointer user_data)
+{
+	VolumeProbe* probe = g_new0(VolumeProbe, 1);
+
+	g_assert(drive_udi != NULL && found_cb != NULL && finished_cb != NULL);
+
+	probe->drive_udi = g_strdup(drive_udi);
+	probe->found_cb = found_cb; 		probe->drive_finished_cb = finished_cb;
+	probe->user_data = user_data;
+	return start_probe(probe, probe_drive_volumes_thread);
+}
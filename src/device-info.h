@@ -25,6 +25,8 @@
 #ifndef _DEVICE_INFO_H
 #define _DEVICE_INFO_H
 
+#include <sys/types.h>
+
 #include <glib.h>
 #include <glib/gi18n.h>
 #include <gdk/gdk.h>
@@ -36,11 +38,19 @@
 
 typedef struct FormatVolume FormatVolume;
 
+enum FormatVolumeType {
+	FORMATVOLUMETYPE_DRIVE,		/* Includes drives with no disks */
+	FORMATVOLUMETYPE_VOLUME,	/* Includes partitions */
+};
+
 /* Some explanation is in order: Since it's plausible that one would want to
  * format either a "drive" as a whole or an individual partition, we include
  * the field for both of them, but only one should be non-null. Volume trumps 
  * drive; if volume is non-NULL, the structure represents a volume. Otherwise
- * it represents a drive which may or may not have a disk in it */
+ * it represents a drive which may or may not have a disk in it.
+ *
+ * Entries loaded from the device cache have neither; they only carry the
+ * metadata below until live discovery replaces them */
 struct FormatVolume {
 	LibHalVolume *volume;		
 	gchar* drive_udi;		/* The udi of the drive containing
@@ -49,37 +59,84 @@ struct FormatVolume {
 	LibHalDrive *drive;
 	gchar* udi;
 	gchar* mountpoint;
+	dev_t dev;			/* major:minor of the block device */
 
-	GdkPixbuf* icon;
 	gchar* friendly_name;
-};
 
-enum FormatVolumeType {
-	FORMATVOLUMETYPE_DRIVE,		/* Includes drives with no disks */
-	FORMATVOLUMETYPE_VOLUME,	/* Includes partitions */
+	/* Everything the dialog needs without asking HAL again */
+	enum FormatVolumeType type;
+	gchar* serial;			/* Drive serial, or volume UUID */
+	guint64 size;
+	gchar* icon_path;
+	gchar* layout_summary;		/* e.g. "MBR, 2 partitions" */
+	gboolean can_format;
+	gboolean cached;		/* Came from the device cache */
 };
 
 void format_volume_free(FormatVolume* volume);
 void format_volume_list_free(GSList* volume_list);
 
 guint64 get_format_volume_size(const FormatVolume* vol);
+gchar* get_format_volume_identity(const FormatVolume* vol);
 gchar* get_friendly_drive_name(LibHalDrive* drive);
 gchar* get_friendly_drive_info(LibHalDrive* drive);
 gchar* get_friendly_volume_name(LibHalContext* ctx, LibHalVolume* volume);
 gchar* get_friendly_volume_info(LibHalContext* ctx, LibHalVolume* volume);
 
-GHashTable* create_icon_cache(void);
+
+/* Hold this around anything that calls into libparted */
+G_LOCK_EXTERN(parted);
 
 int get_part_type_from_fs(const char* fs_name);
 char* get_parted_type_string(int msdos_parttype, PartitionScheme scheme);
 gboolean write_partition_table_for_device(LibHalDrive* drive, PartitionScheme scheme, GError** error);
 gboolean set_partition_type(LibHalDrive* drive, int partition, int msdos_type);
 
-GSList* get_volumes_mounted_on_drive(LibHalContext* ctx, LibHalDrive* drive);
-GSList* build_volume_list(LibHalContext* ctx, 
-		  enum FormatVolumeType type, 
-		  GHashTable* icon_cache, 
-		  int icon_width, int icon_height);
+/* The same, for callers that only have a device file; these can be called
+ * from any thread */
+gboolean write_partition_table_for_device_file(const char* dev, guint64 size, PartitionScheme scheme, GError** error);
+gboolean set_partition_type_for_device_file(const char* dev, int partition, int msdos_type);
+guint64 get_block_device_size(const char* dev);
+gboolean is_partition_device_file(const char* dev);
+gchar* get_partition_device_file(const char* disk, int partition);
+
+/* Asynchronous probing; both callbacks run in the main loop. found_cb takes
+ * ownership of the volume, finished_cb takes ownership of the context (which
+ * is NULL if we couldn't talk to HAL). Pass the context and HAL version from
+ * an earlier probe if there was one (NULL and 0 otherwise); finished_cb gets
+ * NULL for a context that was passed in */
+typedef void (*VolumeFoundFunc) (FormatVolume* vol, 
+				 enum FormatVolumeType type, 
+				 guint serial, 
+				 gpointer user_data);
+typedef void (*ProbeFinishedFunc) (LibHalContext* ctx, 
+				   gint hal_version, 
+				   gboolean succeeded, 
+				   guint serial, 
+				   gpointer user_data);
+
+guint probe_volumes_async(LibHalContext* ctx, 
+			  gint hal_version, 
+			  VolumeFoundFunc found_cb, 
+			  ProbeFinishedFunc finished_cb, 
+			  gpointer user_data);
+
+/* The full probe only finds drives; this fills in one drive's volumes and
+ * partition table summary. finished_cb takes ownership of layout_summary */
+typedef void (*DriveProbeFinishedFunc) (const char* drive_udi, 
+					gchar* layout_summary, 
+					gboolean succeeded, 
+					guint serial, 
+					gpointer user_data);
+
+guint probe_drive_volumes_async(const char* drive_udi, 
+				VolumeFoundFunc found_cb, 
+				DriveProbeFinishedFunc finished_cb, 
+				gpointer user_data);
+gint get_hal_version(void);
+
+GSList* build_volume_list(LibHalContext* ctx, enum FormatVolumeType type);
+GSList* build_drive_volume_list(LibHalContext* ctx, const char* drive_udi);
 LibHalContext* libhal_context_alloc(void);
 
 #endif
@@ -0,0 +1,142 @@
+/*
+ * extent-list.c - Sorted lists of byte ranges on a device
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <glib.h>
+
+#include "extent-list.h"
+
+#define EXTENT(list, i) 	(&g_array_index((list)->extents, Extent, (i)))
+
+
+/*
+ * Utility Functions
+ */
+
+/* The first extent that ends at or after offset; the list's length if
+ * there's none */
+static guint
+find_first_ending_after(const ExtentList* list, guint64 offset)
+{
+	guint lo = 0, hi = list->extents->len, mid;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(EXTENT(list, mid)->start + EXTENT(list, mid)->len < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+/*
+ * Public functions
+ */
+
+ExtentList*
+extent_list_new(void)
+{
+	ExtentList* ret = g_new0(ExtentList, 1);
+
+	ret->extents = g_array_new(FALSE, FALSE, sizeof(Extent));
+	return ret;
+}
+
+void
+extent_list_free(ExtentList* list)
+{
+	if(!list)
+		return;
+
+	g_array_free(list->extents, TRUE);
+	g_free(list);
+}
+
+void
+extent_list_add(ExtentList* list, guint64 start, guint64 len)
+{
+	guint64 end = start + len;
+	Extent extent, *last;
+	guint first, i;
+
+	if(len == 0)
+		return;
+
+	/* Scans go front to back, so this is nearly always the one */
+	if(list->extents->len > 0) {
+		last = EXTENT(list, list->extents->len - 1);
+		if(start >= last->start && start <= last->start + last->len) {
+			last->len = MAX(last->start + last->len, end) - last->start;
+			return;
+		}
+	}
+
+	/* Swallow everything from the first one that reaches start up to
+	 * the last one that starts before end */
+	first = find_first_ending_after(list, start);
+	for(i = first; i < list->extents->len && EXTENT(list, i)->start <= end; i++) {
+		start = MIN(start, EXTENT(list, i)->start);
+		end = MAX(end, EXTENT(list, i)->start + EXTENT(list, i)->len);
+	}
+
+	extent.start = start;
+	extent.len = end - start;
+	if(i > first) {
+		*EXTENT(list, first) = extent;
+		g_array_remove_range(list->extents, first + 1, i - first - 1);
+	} else
+		g_array_insert_val(list->extents, first, extent);
+}
+
+guint64
+extent_list_get_total(const ExtentList* list)
+{
+	guint64 ret = 0;
+	guint i;
+
+	for(i=0; i < list->extents->len; i++)
+		ret += EXTENT(list, i)->len;
+	return ret;
+}
+
+gboolean
+extent_list_overlaps(const ExtentList* list, guint64 start, guint64 len)
+{
+	guint i = find_first_ending_after(list, start);
+
+	/* That one may only touch start */
+	for(; i < list->extents->len && EXTENT(list, i)->start < start + len; i++) {
+		if(EXTENT(list, i)->start + EXTENT(list, i)->len > start)
+			return TRUE;
+	}
+
+	return FALSE;
+}
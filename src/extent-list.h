@@ -0,0 +1,54 @@
+/*
+ * extent-list.h - Sorted lists of byte ranges on a device
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef _EXTENT_LIST_H
+#define _EXTENT_LIST_H
+
+#include <glib.h>
+
+typedef struct _Extent {
+	guint64 start;
+	guint64 len;
+} Extent;
+
+/* A handful of bad sectors on a multi-TB disk shouldn't cost a bit for
+ * every sector, so we keep ranges instead */
+typedef struct _ExtentList {
+	GArray* extents;		/* Of Extent, sorted; none of them
+					   overlap or touch */
+} ExtentList;
+
+ExtentList* extent_list_new(void);
+void extent_list_free(ExtentList* list);
+
+/* Merges with whatever it overlaps or touches. Cheapest in order */
+void extent_list_add(ExtentList* list, guint64 start, guint64 len);
+
+guint64 extent_list_get_total(const ExtentList* list);
+
+/* Whether any of [start, start + len) is in the list */
+gboolean extent_list_overlaps(const ExtentList* list, guint64 start, guint64 len);
+
+#endif
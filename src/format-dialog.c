@@ -31,9 +31,12 @@
 #include <stdlib.h>
 #include <fcntl.h>
 
+#include "device-cache.h"
 #include "device-info.h"
-#include "formattify.h"
+#include "formatterbase.h"
 #include "format-dialog.h"
+#include "icon-cache.h"
+#include "mount-info.h"
 
 enum {
 	DEV_COLUMN_UDI = 0,
@@ -54,22 +57,25 @@ enum {
 /* Hacky forward declarations section */
 
 static void update_dialog(FormatDialog* dialog);
+static void refresh_device_lists(FormatDialog* dialog);
+static void register_hal_callbacks(FormatDialog* dialog);
+static void on_icon_loaded(IconCache* cache, const gchar* path, GdkPixbuf* icon, gpointer user_data);
 
 /*
  * Utility Functions
  */
 
 static void
-show_error_dialog (GtkWidget *parent, gchar *main, gchar *secondary)
+show_message_dialog (GtkWidget *parent, GtkMessageType type, gchar *main, gchar *secondary)
 {
 	GtkWidget *dialog;
-	GtkDialogFlags flags;
+	GtkDialogFlags flags = 0;
 	
 	if (parent != NULL)
 		flags = GTK_DIALOG_MODAL;
 	
 	dialog = gtk_message_dialog_new_with_markup (GTK_WINDOW(parent), flags, 
-						     GTK_MESSAGE_ERROR, GTK_BUTTONS_OK,
+						     type, GTK_BUTTONS_OK,
 						     "<span weight=\"bold\" size=\"larger\">%s</span>\n\n%s",
 						     main, secondary);
 	gtk_window_set_title (GTK_WINDOW (dialog), "");
@@ -77,6 +83,12 @@ show_error_dialog (GtkWidget *parent, gchar *main, gchar *secondary)
 	gtk_widget_destroy (dialog);
 }
 
+static void
+show_error_dialog (GtkWidget *parent, gchar *main, gchar *secondary)
+{
+	show_message_dialog (parent, GTK_MESSAGE_ERROR, main, secondary);
+}
+
 static const gchar*
 get_fs_from_menuitem_name(const gchar* menuitem_name)
 {
@@ -127,37 +139,6 @@ get_udi_from_iter(FormatDialog* dialog, GtkTreeIter* iter)
 	return get_string_from_model(GTK_TREE_MODEL(dialog->volume_model), iter, DEV_COLUMN_UDI);
 }
 
-void
-get_hal_version(FormatDialog* dialog)
-{
-	gint hal_version = 0;
-	gchar** split = NULL;
-	gchar *output, *err;
-	gint status;
-
-	/* FIXME: This is hardcoded. This is bad. */
-	if(!g_spawn_command_line_sync("/usr/sbin/hald --version", &output, &err, &status, NULL))
-		goto out;
-
-	if(!output)
-		goto out;
-
-	split = g_strsplit_set(output, " .", 0 /*All tokens*/);
-
-	if(!split || !split[0])
-		goto out;
-
-	/* FIXME: Make this check more thorough */
-	if(!split[3] || !split[4] || !split[5] || !split[6])
-		goto out;
-	hal_version = atoi(split[3])*1000 + atoi(split[4])*100 + atoi(split[5])*10 + atoi(split[6]);
-	
-out:
-	if(split)
-		g_strfreev(split);
-	dialog->hal_version = hal_version;
-}
-
 static gboolean
 luks_valid_for_device (const FormatVolume* dev)
 {
@@ -205,6 +186,26 @@ get_cached_device_from_udi(FormatDialog* dialog, const char* udi)
 	return NULL;
 }
 
+static const FormatVolume*
+get_cached_device_from_dev(FormatDialog* dialog, dev_t dev)
+{
+	GSList* iter;
+
+	/* Partitions are the common case, so look there first */
+	for(iter = dialog->hal_volume_list; iter != NULL; iter = iter->next) {
+		FormatVolume* current = iter->data;
+		if(current->dev == dev)
+			return current;
+	}
+	for(iter = dialog->hal_drive_list; iter != NULL; iter = iter->next) {
+		FormatVolume* current = iter->data;
+		if(current->dev == dev)
+			return current;
+	}
+
+	return NULL;
+}
+
 const FormatVolume*
 get_cached_device_from_treeiter(FormatDialog* dialog, GtkTreeIter* iter)
 {
@@ -222,22 +223,25 @@ get_cached_device_from_treeiter(FormatDialog* dialog, GtkTreeIter* iter)
 gboolean
 warn_user_of_impending_doom(FormatDialog* dialog, FormatVolume* target)
 {
-	GSList* mounted_list = NULL;
-
-	/* Figure out if we're about to run over any live partitions first */
-	if(target->volume) {
-		if(libhal_volume_is_mounted(target->volume)) {
-			mounted_list = g_slist_prepend(mounted_list, 
-						       get_friendly_volume_name(dialog->hal_context, target->volume));
-		}
-	}
-	else {
-		mounted_list = get_volumes_mounted_on_drive(dialog->hal_context, target->drive);
-	}
+	const GSList* mounted_list;
+
+	/* Figure out if we're about to run over any live partitions first.
+	 * Swap can be turned on without the kernel telling us, so this one
+	 * goes back to /proc no matter what */
+	mount_table_invalidate(dialog->mounts);
+	if(target->volume)
+		mounted_list = mount_table_lookup(dialog->mounts, target->dev);
+	else
+		mounted_list = mount_table_lookup_disk(dialog->mounts, target->dev);
 
 	gchar* message;
 	gchar* name = (target->volume ? get_friendly_volume_name(dialog->hal_context, target->volume) : 
 					get_friendly_drive_name(target->drive));
+	if(target->layout_summary) {
+		gchar* tmp = name;
+		name = g_strdup_printf("%s (%s)", tmp, target->layout_summary);
+		g_free(tmp);
+	}
 	/* Come up with the error message */
 	if(!mounted_list) {
 		message = g_strdup_printf(_("Formatting will irreversibly destroy all data on %s. "
@@ -245,17 +249,18 @@ warn_user_of_impending_doom(FormatDialog* dialog, FormatVolume* target)
 	}
 	else {
 		/* FIXME: There are a ton of malloc's here */
-		int i; 	GSList* iter;
+		int i; 	const GSList* iter;
 		gchar* tmp_list[65];
 
 		/* TODO: It'd be cool if these were hyperlinks that opened nautilus at the mountpoint! */
 		for(iter = mounted_list, i=0; iter != NULL && i < 64; iter = iter->next, i++) {
-			FormatVolume* current = get_cached_device_from_udi(dialog, (char*)iter->data);
-			g_debug("Mounted: %s", iter->data);
-			if(!current) 	continue;
+			const MountEntry* mount = iter->data;
+			const FormatVolume* current = get_cached_device_from_dev(dialog, mount->dev);
+			g_debug("Mounted: %s on %s", mount->source, mount->mountpoint);
 
-			gchar* mountpoint = libhal_volume_get_mount_point(current->volume);
-			tmp_list[i] = g_strdup_printf( _("%s mounted at %s"), current->friendly_name, mountpoint);
+			tmp_list[i] = g_strdup_printf( _("%s mounted at %s"), 
+						       (current ? current->friendly_name : mount->source), 
+						       mount->mountpoint);
 		}
 		tmp_list[i] = NULL;
 
@@ -289,55 +294,6 @@ warn_user_of_impending_doom(FormatDialog* dialog, FormatVolume* target)
 	return (id == GTK_RESPONSE_OK);
 }
 
-void 
-handle_format_error(FormatDialog* dialog)
-{
-	show_error_dialog(dialog->toplevel, _("Error formatting device"), dialog->format_error->message);
-	finish_operation(dialog);
-}
-
-void
-start_operation(FormatDialog* dialog, int steps)
-{
-	dialog->total_ops = steps;
-	dialog->ops_left = steps;
-	if(dialog->format_error) {
-		g_error_free(dialog->format_error);
-		dialog->format_error = NULL;
-	}
-
-	update_dialog(dialog);
-}
-
-void
-finish_operation(FormatDialog* dialog)
-{
-	dialog->ops_left = 0;
-	gtk_progress_set_value(GTK_PROGRESS(dialog->progress_bar), 0.0);
-	gtk_progress_bar_set_text(dialog->progress_bar, "");
-
-	update_dialog(dialog);
-}
-
-void
-do_next_operation(FormatDialog* dialog, const gchar* progress_text)
-{
-	if(dialog->format_error) {
-		handle_format_error(dialog);
-		return;
-	}
-
-	if(dialog->ops_left <= 0) {
-		finish_operation(dialog);
-		return;
-	}
-
-	gdouble percent = (gdouble)(dialog->total_ops - dialog->ops_left) / (gdouble)dialog->total_ops;
-	dialog->ops_left--;
-	gtk_progress_set_value(GTK_PROGRESS(dialog->progress_bar), percent);
-}
-
-
 /*
  * High-level functions (aka 'big' functions)
  */
@@ -363,7 +319,11 @@ setup_volume_treeview (FormatDialog* dialog)
 	gtk_cell_layout_add_attribute( GTK_CELL_LAYOUT(combo), text_renderer, "sensitive", DEV_COLUMN_SENSITIVE );
 
 	/* Do some miscellaneous things */
-	dialog->icon_cache = create_icon_cache();
+	dialog->icon_cache = icon_cache_new(22, 22, on_icon_loaded, dialog);
+	dialog->volume_rows = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, 
+						    (GDestroyNotify)gtk_tree_row_reference_free);
+	dialog->drive_probes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	dialog->populated_drives = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 	dialog->volume_model = model;
 }
 
@@ -373,9 +333,9 @@ struct _setup_fs_duple {
 };
 
 static void
-setup_fs_cb(gpointer key, gpointer value, gpointer user_data)
+setup_fs_cb(gpointer data, gpointer user_data)
 {
-	gchar* current_fs = key;
+	const gchar* current_fs = data;
 	struct _setup_fs_duple* s = user_data;
 
 	g_debug("Adding fs: %s", current_fs);
@@ -424,159 +384,550 @@ setup_filesystem_menu(FormatDialog* dialog)
 
 	/* Populate the specific fs list */
 	struct _setup_fs_duple s;
+	GSList* fs_list = formatters_list_fs();
 	s.model = model; 	s.parent = &parent;
-	dialog->fs_map = build_supported_fs_list();
-	g_hash_table_foreach(dialog->fs_map, setup_fs_cb, &s);
+	g_slist_foreach(fs_list, setup_fs_cb, &s);
+	g_slist_free(fs_list);
 }
 
-static gboolean 
-update_device_lists(FormatDialog* dialog)
+static void
+set_volume_combo_status(FormatDialog* dialog, const gchar* markup)
 {
-	if(dialog->hal_drive_list) {
-		format_volume_list_free(dialog->hal_drive_list);
-		dialog->hal_drive_list = NULL;
+	GtkTreeIter iter;
+
+	/* Drop the old status row */
+	if(dialog->status_row) {
+		GtkTreePath* path = gtk_tree_row_reference_get_path(dialog->status_row);
+		if(path && gtk_tree_model_get_iter(GTK_TREE_MODEL(dialog->volume_model), &iter, path))
+			gtk_tree_store_remove(dialog->volume_model, &iter);
+		if(path)
+			gtk_tree_path_free(path);
+		gtk_tree_row_reference_free(dialog->status_row);
+		dialog->status_row = NULL;
 	}
 
-	dialog->hal_drive_list = build_volume_list(dialog->hal_context, FORMATVOLUMETYPE_DRIVE,
-			dialog->icon_cache, 22, 22);
+	if(!markup)
+		return;
 
-	if(!dialog->hal_drive_list) {
-		show_error_dialog(dialog->toplevel, 
-				_("Cannot get list of disks"), 
-				_("Make sure the HAL daemon is running and configured correctly"));
-		return FALSE;
-	}
+	gtk_tree_store_insert_with_values(dialog->volume_model, &iter, NULL, 0, 
+			DEV_COLUMN_NAME_MARKUP, markup, 
+			DEV_COLUMN_SENSITIVE, FALSE, -1);
 
-	if(dialog->hal_volume_list) {
-		format_volume_list_free(dialog->hal_volume_list);
-		dialog->hal_volume_list = NULL;
-	}
+	GtkTreePath* path = gtk_tree_model_get_path(GTK_TREE_MODEL(dialog->volume_model), &iter);
+	dialog->status_row = gtk_tree_row_reference_new(GTK_TREE_MODEL(dialog->volume_model), path);
+	gtk_tree_path_free(path);
+}
 
-	dialog->hal_volume_list = build_volume_list(dialog->hal_context, FORMATVOLUMETYPE_VOLUME,
-			dialog->icon_cache, 22, 22);
+static gboolean
+get_volume_row(FormatDialog* dialog, const char* udi, GtkTreeIter* iter)
+{
+	GtkTreeRowReference* row;
+	GtkTreePath* path;
+	gboolean ret;
 
-	if(!dialog->hal_volume_list) {
-		show_error_dialog(dialog->toplevel, 
-				_("Cannot get list of partitions"), 
-				_("Make sure the HAL daemon is running and configured correctly"));
+	if( !udi || !(row = g_hash_table_lookup(dialog->volume_rows, udi)) )
+		return FALSE;
+	if( !(path = gtk_tree_row_reference_get_path(row)) )
 		return FALSE;
-	}
 
-	return TRUE;
+	ret = gtk_tree_model_get_iter(GTK_TREE_MODEL(dialog->volume_model), iter, path);
+	gtk_tree_path_free(path);
+	return ret;
 }
 
-static FormatVolume*
-write_partition_table(FormatDialog* dialog, FormatVolume* vol, const char* fs)
+static void
+update_drive_placeholder(FormatDialog* dialog, const char* drive_udi, gboolean can_format)
 {
-	FormatVolume* ret = NULL;
-	char* drive_udi = g_strdup(libhal_drive_get_udi(vol->drive));
+	GtkTreeModel* model = GTK_TREE_MODEL(dialog->volume_model);
+	GtkTreeIter parent, child, placeholder;
+	gboolean has_children = FALSE, has_placeholder = FALSE;
+	const gchar* markup = NULL;
 
-	/* Write out a new table */
-	GError* err = NULL;
+	if(!get_volume_row(dialog, drive_udi, &parent))
+		return;
 
-	/* FIXME: Somehow, we need to decide what kind of table to write */
-	if(!write_partition_table_for_device(vol->drive, PART_TYPE_MSDOS, &err)) {
-		show_error_dialog(dialog->toplevel, _("Error formatting disk"), err->message);
-		g_error_free(err);
-		goto out;
+	if(gtk_tree_model_iter_children(model, &child, &parent)) {
+		do {
+			gchar* udi = get_udi_from_iter(dialog, &child);
+			if(udi) {
+				has_children = TRUE;
+			} else {
+				placeholder = child;
+				has_placeholder = TRUE;
+			}
+			g_free(udi);
+		} while(gtk_tree_model_iter_next(model, &child));
 	}
 
-	/* Set the partition type */
-	int msdos_type = get_part_type_from_fs(fs);
-	if( !set_partition_type(vol->drive, 0 /* Always first partition */, msdos_type) ) {
-		show_error_dialog(dialog->toplevel, _("Error formatting disk"), _("Couldn't set partition type on drive"));
-		goto out;
+	/* Drives whose partitions we haven't read yet get a dummy child, so
+	 * they still look like they have something inside */
+	if(!has_children && can_format && gtk_toggle_button_get_active(dialog->show_partitions) &&
+	   !g_hash_table_lookup(dialog->populated_drives, drive_udi)) {
+		markup = (g_hash_table_lookup_extended(dialog->drive_probes, drive_udi, NULL, NULL) ?
+			  _("<i>Loading partitions...</i>") :
+			  _("<i>Select the drive to list its partitions</i>"));
 	}
 
-	/* Find the partition attached to our drive */
-	if(!update_device_lists(dialog))	goto out;
-	GSList* iter; 
-	for(iter = dialog->hal_volume_list; iter != NULL; iter = g_slist_next(iter)) {
-		FormatVolume* vol = iter->data;
-		if(!strcmp(vol->drive_udi, drive_udi))	break;
+	if(markup && has_placeholder) {
+		gtk_tree_store_set(dialog->volume_model, &placeholder, DEV_COLUMN_NAME_MARKUP, markup, -1);
+	} else if(markup) {
+		gtk_tree_store_insert_with_values(dialog->volume_model, NULL, &parent, 0, 
+				DEV_COLUMN_NAME_MARKUP, markup, 
+				DEV_COLUMN_SENSITIVE, FALSE, -1);
+	} else if(has_placeholder) {
+		gtk_tree_store_remove(dialog->volume_model, &placeholder);
 	}
-	if(iter == NULL) {
-		show_error_dialog(dialog->toplevel, _("Error formatting disk"), 
-				_("Can't find new partition after formatting. Try again"));
-		goto out;
+}
+
+static GdkPixbuf*
+get_volume_icon(FormatDialog* dialog, const FormatVolume* vol)
+{
+	/* Only drives get icons */
+	if(vol->type != FORMATVOLUMETYPE_DRIVE)
+		return NULL;
+
+	return icon_cache_lookup(dialog->icon_cache, vol->icon_path);
+}
+
+static void
+update_icon_rows(FormatDialog* dialog, GSList* list, const gchar* path, GdkPixbuf* icon)
+{
+	GtkTreeIter iter;
+	GSList* l;
+
+	for(l = list; l != NULL; l = l->next) {
+		FormatVolume* current = l->data;
+
+		if(!current->icon_path || strcmp(current->icon_path, path))
+			continue;
+		if(get_volume_row(dialog, current->udi, &iter))
+			gtk_tree_store_set(dialog->volume_model, &iter, DEV_COLUMN_ICON, icon, -1);
 	}
+}
 
-	ret = iter->data;
+static void
+on_icon_loaded(IconCache* cache, const gchar* path, GdkPixbuf* icon, gpointer user_data)
+{
+	FormatDialog* dialog = user_data;
 
-out:
-	return ret;
+	/* Swap the placeholder out on every row using this icon */
+	update_icon_rows(dialog, dialog->hal_drive_list, path, icon);
+	update_icon_rows(dialog, dialog->stale_list, path, icon);
+}
+
+static void
+add_volume_row(FormatDialog* dialog, FormatVolume* current)
+{
+	GtkTreeIter iter, parent_iter, *parent = NULL;
+	GtkTreePath* path;
+
+	if(current->type == FORMATVOLUMETYPE_VOLUME && !gtk_toggle_button_get_active(dialog->show_partitions))
+		return;
+	if(!current->friendly_name || strlen(current->friendly_name) == 0)
+		return;
+
+	/* Look up the correct parent in the table */
+	if(get_volume_row(dialog, current->drive_udi, &parent_iter))
+		parent = &parent_iter;
+
+	/* The first real device replaces the "Searching..." row */
+	set_volume_combo_status(dialog, NULL);
+
+	gtk_tree_store_insert_with_values(dialog->volume_model, &iter, parent, 1000,
+		DEV_COLUMN_UDI, current->udi, 
+		DEV_COLUMN_NAME_MARKUP, current->friendly_name, 
+		DEV_COLUMN_ICON, get_volume_icon(dialog, current), 
+		DEV_COLUMN_SENSITIVE, current->can_format, -1);
+
+	path = gtk_tree_model_get_path(GTK_TREE_MODEL(dialog->volume_model), &iter);
+	g_hash_table_insert(dialog->volume_rows, g_strdup(current->udi), 
+			    gtk_tree_row_reference_new(GTK_TREE_MODEL(dialog->volume_model), path));
+	gtk_tree_path_free(path);
+
+	/* A real partition replaces its drive's placeholder */
+	if(current->type == FORMATVOLUMETYPE_DRIVE)
+		update_drive_placeholder(dialog, current->udi, current->can_format);
+	else if(parent)
+		update_drive_placeholder(dialog, current->drive_udi, FALSE);
 }
 
 static void
 rebuild_volume_combo(FormatDialog* dialog)
 {
 	g_assert(dialog && dialog->volume_model);
-	gboolean show_partitions = gtk_toggle_button_get_active(dialog->show_partitions);
-	if( !update_device_lists(dialog) )
+	GSList* iter;
+
+	/* This doesn't go back to HAL; it only rebuilds the model from the
+	 * device lists we already have (e.g. when "Show Partitions" is
+	 * toggled). Drives go in first so partitions can find their parent.
+	 * Only drives somebody has selected have their partitions listed */
+	set_volume_combo_status(dialog, NULL);
+	g_hash_table_remove_all(dialog->volume_rows);
+	gtk_tree_store_clear(dialog->volume_model);
+
+	for(iter = dialog->hal_drive_list; iter != NULL; iter = iter->next)
+		add_volume_row(dialog, iter->data);
+	for(iter = dialog->stale_list; iter != NULL; iter = iter->next) {
+		if(((FormatVolume*)iter->data)->type == FORMATVOLUMETYPE_DRIVE)
+			add_volume_row(dialog, iter->data);
+	}
+	for(iter = dialog->hal_volume_list; iter != NULL; iter = iter->next)
+		add_volume_row(dialog, iter->data);
+	for(iter = dialog->stale_list; iter != NULL; iter = iter->next) {
+		if(((FormatVolume*)iter->data)->type == FORMATVOLUMETYPE_VOLUME)
+			add_volume_row(dialog, iter->data);
+	}
+
+	if(g_hash_table_size(dialog->volume_rows) == 0) {
+		set_volume_combo_status(dialog, (dialog->probe_serial ? 
+						 _("<i>Searching for devices...</i>") :
+						 _("<i>No devices found</i>")) );
+	}
+}
+
+static void
+rekey_udi(GHashTable* table, const char* old_udi, const char* new_udi)
+{
+	gpointer key, value;
+
+	if(!g_hash_table_lookup_extended(table, old_udi, &key, &value))
 		return;
 
-	/* Iterate through the volume list and build the tree model. If we're
-	 * listing partitions, it's a bit trickier: first we add all the drives,
-	 * and make a udi=>GtkTreeIter table. Then we use that table to add
-	 * the partitions to the correct drives */
-	GSList* treeiter_list = NULL, *device_list = dialog->hal_drive_list;
-	GSList* iter;	gboolean not_empty = FALSE, can_format, listed_drives = FALSE;
-	GHashTable* udi_table = g_hash_table_new(g_str_hash, g_str_equal);
-	FormatVolume* current;
-	GtkTreeIter* parent_treeiter, *current_treeiter;
+	g_hash_table_steal(table, old_udi);
+	g_free(key);
+	g_hash_table_replace(table, g_strdup(new_udi), value);
+}
 
-	gtk_tree_store_clear(dialog->volume_model);
-	while(device_list != NULL) {
-		for(iter = device_list; iter != NULL; iter=iter->next) {
-			current = iter->data;
-			can_format = (current->volume || 
-					!libhal_drive_uses_removable_media(current->drive) ||
-					libhal_drive_is_media_detected(current->drive));
-
-			if(!current->friendly_name || strlen(current->friendly_name) == 0)
+static void
+move_volume_row(FormatDialog* dialog, const char* old_udi, const char* new_udi)
+{
+	GtkTreeIter iter;
+	GSList* l;
+
+	/* The row (and whatever we know about the drive's partitions) now
+	 * belongs to the UDI HAL gave the device this time */
+	if(get_volume_row(dialog, old_udi, &iter))
+		gtk_tree_store_set(dialog->volume_model, &iter, DEV_COLUMN_UDI, new_udi, -1);
+
+	rekey_udi(dialog->volume_rows, old_udi, new_udi);
+	rekey_udi(dialog->drive_probes, old_udi, new_udi);
+	rekey_udi(dialog->populated_drives, old_udi, new_udi);
+
+	for(l = dialog->stale_list; l != NULL; l = l->next) {
+		FormatVolume* current = l->data;
+
+		if(current->drive_udi && !strcmp(current->drive_udi, old_udi)) {
+			g_free(current->drive_udi);
+			current->drive_udi = g_strdup(new_udi);
+		}
+	}
+}
+
+static void
+add_live_volume(FormatDialog* dialog, FormatVolume* vol)
+{
+	GSList *stale, *next;
+	GtkTreeIter iter;
+	gchar* identity;
+
+	if(vol->type == FORMATVOLUMETYPE_DRIVE)
+		dialog->hal_drive_list = g_slist_prepend(dialog->hal_drive_list, vol);
+	else
+		dialog->hal_volume_list = g_slist_prepend(dialog->hal_volume_list, vol);
+
+	/* If we were already showing this device (from the cache or the last
+	 * probe), update the row in place so the selection doesn't jump. UDIs
+	 * change across replugs, so also go by the identity the cache uses */
+	identity = get_format_volume_identity(vol);
+	for(stale = dialog->stale_list; stale != NULL; stale = next) {
+		FormatVolume* current = stale->data;
+		gchar* current_identity;
+		gboolean same;
+
+		next = stale->next;
+		if(current->type != vol->type)
+			continue;
+
+		/* A new filesystem gets a new UUID, so a volume we just
+		 * formatted only keeps its UDI */
+		if(strcmp(current->udi, vol->udi)) {
+			current_identity = get_format_volume_identity(current);
+			same = !strcmp(current_identity, identity);
+			g_free(current_identity);
+			if(!same)
 				continue;
 
-			/* Look up the correct parent in the table */
-			parent_treeiter = NULL;
-			if(current->drive_udi)
-				parent_treeiter = g_hash_table_lookup(udi_table, current->drive_udi);
-			
-			/*
-			if(parent_treeiter && !gtk_tree_store_iter_is_valid(dialog->volume_model, parent_treeiter)) {
-				g_warning("Iter wasn't valid! 0x%p", parent_treeiter);
-				parent_treeiter = NULL;
-			} */
+			move_volume_row(dialog, current->udi, vol->udi);
+		}
 
-			treeiter_list = g_slist_prepend(treeiter_list, (current_treeiter = g_new0(GtkTreeIter, 1)) );
+		format_volume_free(current);
+		dialog->stale_list = g_slist_delete_link(dialog->stale_list, stale);
+	}
+	g_free(identity);
+
+	if(get_volume_row(dialog, vol->udi, &iter)) {
+		gtk_tree_store_set(dialog->volume_model, &iter, 
+			DEV_COLUMN_NAME_MARKUP, vol->friendly_name, 
+			DEV_COLUMN_ICON, get_volume_icon(dialog, vol), 
+			DEV_COLUMN_SENSITIVE, vol->can_format, -1);
+		if(vol->type == FORMATVOLUMETYPE_DRIVE)
+			update_drive_placeholder(dialog, vol->udi, vol->can_format);
+	} else {
+		add_volume_row(dialog, vol);
+	}
+}
 
-			gtk_tree_store_insert_with_values(dialog->volume_model, current_treeiter, parent_treeiter, 1000,
-				DEV_COLUMN_UDI, current->udi, 
-				DEV_COLUMN_NAME_MARKUP, current->friendly_name, 
-				DEV_COLUMN_ICON, current->icon, 
-				DEV_COLUMN_SENSITIVE, can_format, -1);
+static void
+remove_stale_rows(FormatDialog* dialog, const char* drive_udi)
+{
+	GSList *iter, *next;
 
-			g_hash_table_insert(udi_table, current->udi, current_treeiter);
+	/* Whatever the probe didn't find again is gone. With a drive_udi,
+	 * that's only the partitions of that drive; otherwise it's everything
+	 * except partitions on drives we're about to read again */
+	for(iter = dialog->stale_list; iter != NULL; iter = next) {
+		FormatVolume* current = iter->data;
+		GtkTreeIter treeiter;
 
-			not_empty = TRUE;
+		next = iter->next;
+		if(drive_udi) {
+			if(current->type != FORMATVOLUMETYPE_VOLUME || !current->drive_udi || 
+			   strcmp(current->drive_udi, drive_udi))
+				continue;
+		} else if(current->type == FORMATVOLUMETYPE_VOLUME && current->drive_udi &&
+			  g_hash_table_lookup_extended(dialog->drive_probes, current->drive_udi, NULL, NULL)) {
+			continue;
 		}
 
-		device_list = NULL;
-		if(!listed_drives && show_partitions) {
-			listed_drives = TRUE;
-			device_list = dialog->hal_volume_list;
+		if(get_volume_row(dialog, current->udi, &treeiter))
+			gtk_tree_store_remove(dialog->volume_model, &treeiter);
+
+		g_hash_table_remove(dialog->volume_rows, current->udi);
+		format_volume_free(current);
+		dialog->stale_list = g_slist_delete_link(dialog->stale_list, iter);
+	}
+}
+
+static void
+on_volume_found(FormatVolume* vol, enum FormatVolumeType type, guint serial, gpointer user_data)
+{
+	FormatDialog* dialog = user_data;
+
+	/* Results from a probe that has since been superseded */
+	if(serial != dialog->probe_serial) {
+		format_volume_free(vol);
+		return;
+	}
+
+	add_live_volume(dialog, vol);
+}
+
+static void
+on_drive_volume_found(FormatVolume* vol, enum FormatVolumeType type, guint serial, gpointer user_data)
+{
+	FormatDialog* dialog = user_data;
+
+	if(!vol->drive_udi || serial != GPOINTER_TO_UINT(g_hash_table_lookup(dialog->drive_probes, vol->drive_udi))) {
+		format_volume_free(vol);
+		return;
+	}
+
+	add_live_volume(dialog, vol);
+}
+
+static void
+save_device_cache(FormatDialog* dialog)
+{
+	GError* err = NULL;
+
+	if(!device_cache_save(dialog->hal_drive_list, dialog->hal_volume_list, &err)) {
+		g_warning("Couldn't save device cache: %s", err->message);
+		g_error_free(err);
+	}
+}
+
+static void
+on_drive_probe_finished(const char* drive_udi, gchar* layout_summary, gboolean succeeded, guint serial, gpointer user_data)
+{
+	FormatDialog* dialog = user_data;
+	FormatVolume* drive;
+
+	if(serial != GPOINTER_TO_UINT(g_hash_table_lookup(dialog->drive_probes, drive_udi))) {
+		g_free(layout_summary);
+		return;
+	}
+
+	g_hash_table_remove(dialog->drive_probes, drive_udi);
+	g_hash_table_insert(dialog->populated_drives, g_strdup(drive_udi), GINT_TO_POINTER(TRUE));
+	if(!succeeded)
+		g_warning("Couldn't read the partitions on %s", drive_udi);
+
+	remove_stale_rows(dialog, drive_udi);
+
+	drive = (FormatVolume*)get_cached_device_from_udi(dialog, drive_udi);
+	if(drive && drive->type == FORMATVOLUMETYPE_DRIVE) {
+		g_free(drive->layout_summary);
+		drive->layout_summary = layout_summary;
+		update_drive_placeholder(dialog, drive->udi, drive->can_format);
+	} else {
+		g_free(layout_summary);
+	}
+
+	/* Now the cache has the partitions too */
+	if(!dialog->probe_serial && g_hash_table_size(dialog->drive_probes) == 0)
+		save_device_cache(dialog);
+
+	update_dialog(dialog);
+}
+
+static void
+request_drive_volumes(FormatDialog* dialog, const FormatVolume* drive)
+{
+	guint serial = 0;
+
+	if(drive->type != FORMATVOLUMETYPE_DRIVE || !drive->can_format)
+		return;
+	if(!gtk_toggle_button_get_active(dialog->show_partitions))
+		return;
+	if(g_hash_table_lookup(dialog->populated_drives, drive->udi) ||
+	   g_hash_table_lookup_extended(dialog->drive_probes, drive->udi, NULL, NULL))
+		return;
+
+	/* While the device probe is running, wait for it to confirm the drive
+	 * is still there; on_probe_finished starts this one then */
+	if(!dialog->probe_serial)
+		serial = probe_drive_volumes_async(drive->udi, on_drive_volume_found, on_drive_probe_finished, dialog);
+	g_hash_table_insert(dialog->drive_probes, g_strdup(drive->udi), GUINT_TO_POINTER(serial));
+	update_drive_placeholder(dialog, drive->udi, drive->can_format);
+}
+
+static void
+populate_active_drive(FormatDialog* dialog)
+{
+	const FormatVolume* vol;
+	GtkTreeIter iter;
+
+	/* GtkComboBox doesn't tell us when a submenu gets opened, so selecting
+	 * a drive is what reads its partitions */
+	if(!gtk_combo_box_get_active_iter(dialog->volume_combo, &iter))
+		return;
+	if( (vol = get_cached_device_from_treeiter(dialog, &iter)) )
+		request_drive_volumes(dialog, vol);
+}
+
+static void
+collect_keys_cb(gpointer key, gpointer value, gpointer user_data)
+{
+	GSList** list = user_data;
+	*list = g_slist_prepend(*list, key);
+}
+
+static void
+start_drive_probes(FormatDialog* dialog)
+{
+	GSList *keys = NULL, *iter;
+
+	/* Go back for the partitions on the drives that are still around */
+	g_hash_table_foreach(dialog->drive_probes, collect_keys_cb, &keys);
+	for(iter = keys; iter != NULL; iter = iter->next) {
+		gchar* udi = g_strdup(iter->data);
+		const FormatVolume* drive = get_cached_device_from_udi(dialog, udi);
+
+		if(drive && drive->type == FORMATVOLUMETYPE_DRIVE && drive->can_format) {
+			guint serial = probe_drive_volumes_async(udi, on_drive_volume_found, on_drive_probe_finished, dialog);
+			g_hash_table_insert(dialog->drive_probes, udi, GUINT_TO_POINTER(serial));
+		} else {
+			g_hash_table_remove(dialog->drive_probes, udi);
+			g_free(udi);
 		}
 	}
 
-	for(iter = treeiter_list; iter != NULL; iter = iter->next)
-		g_free((GtkTreeIter*)iter->data);
-	g_slist_free(treeiter_list);
-	g_hash_table_destroy(udi_table);
+	g_slist_free(keys);
+}
 
-	if(!not_empty) {
-		gtk_tree_store_insert_with_values(dialog->volume_model, NULL, NULL, 0, 
-				DEV_COLUMN_NAME_MARKUP, _("<i>No devices found</i>"), 
-				DEV_COLUMN_SENSITIVE, FALSE, -1);
+static void
+on_probe_finished(LibHalContext* ctx, gint hal_version, gboolean succeeded, guint serial, gpointer user_data)
+{
+	FormatDialog* dialog = user_data;
+	GSList* iter;
+
+	/* The first context we get becomes the one we listen to HAL on */
+	if(ctx && !dialog->hal_context) {
+		dialog->hal_context = ctx;
+		register_hal_callbacks(dialog);
+	} else if(ctx) {
+		libhal_ctx_shutdown(ctx, NULL);
+		libhal_ctx_free(ctx);
 	}
+
+	if(hal_version)
+		dialog->hal_version = hal_version;
+
+	if(serial != dialog->probe_serial)
+		return;
+	dialog->probe_serial = 0;
+
+	if(!succeeded) {
+		show_error_dialog(dialog->toplevel, 
+				_("Cannot get list of disks"), 
+				_("Make sure the HAL daemon is running and configured correctly"));
+	}
+
+	start_drive_probes(dialog);
+	remove_stale_rows(dialog, NULL);
+
+	/* Drives that lost their cached partitions get a placeholder back */
+	for(iter = dialog->hal_drive_list; iter != NULL; iter = iter->next) {
+		FormatVolume* current = iter->data;
+		update_drive_placeholder(dialog, current->udi, current->can_format);
+	}
+
+	/* Remember what we found so the next startup has something to show
+	 * right away; the partitions get added once their drives are read */
+	if(succeeded)
+		save_device_cache(dialog);
+
+	if(g_hash_table_size(dialog->volume_rows) == 0)
+		set_volume_combo_status(dialog, _("<i>No devices found</i>"));
+
+	populate_active_drive(dialog);
+	update_dialog(dialog);
+}
+
+static void
+requeue_drive_cb(gpointer key, gpointer value, gpointer user_data)
+{
+	GHashTable* drive_probes = user_data;
+	g_hash_table_replace(drive_probes, g_strdup(key), GUINT_TO_POINTER(0));
+}
+
+static void
+refresh_device_lists(FormatDialog* dialog)
+{
+	/* What we have now goes on the stale list; it stays on screen (but
+	 * can't be formatted) until the probe thread either finds it again or
+	 * finishes without it. Any probe that's still running gets ignored
+	 * from here on */
+	dialog->stale_list = g_slist_concat(dialog->stale_list, 
+			g_slist_concat(dialog->hal_drive_list, dialog->hal_volume_list));
+	dialog->hal_drive_list = NULL;
+	dialog->hal_volume_list = NULL;
+
+	/* Drives whose partitions we were showing get them read again once
+	 * the probe has confirmed the drive is still there */
+	GSList *keys = NULL, *iter;
+	g_hash_table_foreach(dialog->drive_probes, collect_keys_cb, &keys);
+	for(iter = keys; iter != NULL; iter = iter->next)
+		g_hash_table_insert(dialog->drive_probes, g_strdup(iter->data), GUINT_TO_POINTER(0));
+	g_slist_free(keys);
+
+	g_hash_table_foreach(dialog->populated_drives, requeue_drive_cb, dialog->drive_probes);
+	g_hash_table_remove_all(dialog->populated_drives);
+
+	dialog->probe_serial = probe_volumes_async(dialog->hal_context, dialog->hal_version, 
+						   on_volume_found, on_probe_finished, dialog);
+	if(g_hash_table_size(dialog->volume_rows) == 0)
+		rebuild_volume_combo(dialog);
 }
 
 static void
@@ -602,24 +953,21 @@ update_extra_info(FormatDialog* dialog)
 			break;
 
 		const FormatVolume* vol = get_cached_device_from_treeiter(dialog, &iter);
-		if(!vol || !vol->volume)
+		if(!vol)
 			break;
 
-		const char* mountpoint = libhal_volume_get_mount_point(vol->volume);
-		char* vol_name = get_friendly_volume_name(dialog->hal_context, vol->volume);
-                
-                if ( mountpoint == NULL ) {
-                        const char *tmp;
-                        tmp = libhal_volume_get_fstype(vol->volume);
-                        
-                        if ( tmp != NULL && strcmp (tmp, "swap") == 0 )
-                                mountpoint = g_strdup(tmp);
-                }
+		/* This gets called on every selection change, so it has to be
+		 * cheap: the mount table only goes back to /proc when the
+		 * kernel says something changed */
+		const GSList* mounts = mount_table_lookup(dialog->mounts, vol->dev);
+		if(!mounts)
+			break;
+		const MountEntry* mount = mounts->data;
 		
-                /* FIXME: The \n is a hack to get the dialog box to not resize 
+		/* FIXME: The \n is a hack to get the dialog box to not resize 
 		 * horizontally so much */
-		g_snprintf(buf, 512, _("<i>%s\n is currently mounted on/as '%s'</i>"), vol_name, mountpoint);
-		g_free(vol_name);
+		g_snprintf(buf, 512, _("<i>%s\n is currently mounted on/as '%s'</i>"), 
+			   vol->friendly_name, mount->mountpoint);
 		gtk_label_set_markup(info, buf);
 		show_info |= TRUE;
 	} while(0);
@@ -662,7 +1010,7 @@ static void
 update_sensitivity(FormatDialog* dialog)
 {
 	/* FIXME: We should probably disable other stuff while formatting too */
-	if(dialog->ops_left == 0) {
+	if(format_job_queue_is_idle(dialog->jobs)) {
 		gtk_widget_show(dialog->format_button);
 		gtk_widget_hide(dialog->cancel_button);
 	} else {
@@ -670,15 +1018,17 @@ update_sensitivity(FormatDialog* dialog)
 		gtk_widget_show(dialog->cancel_button);
 	}
 
+	/* Rows that came from the device cache can't be formatted until the
+	 * probe thread has found them again */
 	GtkTreeIter iter;
-	gboolean format_enabled = (gtk_combo_box_get_active_iter(dialog->volume_combo, &iter));
+	gboolean format_enabled = (gtk_combo_box_get_active_iter(dialog->volume_combo, &iter) &&
+				   get_cached_device_from_treeiter(dialog, &iter) != NULL);
 	gtk_widget_set_sensitive(dialog->format_button, format_enabled);
 }
 
 static void
 update_dialog(FormatDialog* dialog)
 {
-	rebuild_volume_combo(dialog);
 	update_extra_info(dialog);
 	update_options_visibility(dialog);
 	update_sensitivity(dialog);
@@ -706,6 +1056,7 @@ void
 on_volume_combo_changed(GtkWidget* w, gpointer user_data)
 {
 	FormatDialog* dialog = g_object_get_data( G_OBJECT(gtk_widget_get_toplevel(w)), "userdata" );
+	populate_active_drive(dialog);
 	update_extra_info(dialog);
 	update_options_visibility(dialog);
 	update_sensitivity(dialog);
@@ -727,6 +1078,8 @@ void
 on_show_partitions_toggled(GtkWidget* w, gpointer user_data) 
 {
 	FormatDialog* dialog = g_object_get_data( G_OBJECT(gtk_widget_get_toplevel(w)), "userdata" );
+	rebuild_volume_combo(dialog);
+	populate_active_drive(dialog);
 	update_dialog(dialog);
 }
 	
@@ -738,6 +1091,7 @@ void on_libhal_device_added_removed(LibHalContext *ctx, const char *udi)
 		return;
 
 	FormatDialog* dialog = libhal_ctx_get_user_data(ctx);
+	refresh_device_lists(dialog);
 	update_dialog(dialog);
 }
 
@@ -753,6 +1107,152 @@ void on_libhal_prop_modified (LibHalContext *ctx,
 		return;
 
 	FormatDialog* dialog = libhal_ctx_get_user_data(ctx);
+	refresh_device_lists(dialog);
+	update_dialog(dialog);
+}
+
+static void
+on_mount_table_changed(MountTable* table, gpointer user_data)
+{
+	FormatDialog* dialog = user_data;
+	update_extra_info(dialog);
+}
+
+static void
+update_progress_bar(FormatDialog* dialog)
+{
+	const GSList *jobs = format_job_queue_get_jobs(dialog->jobs), *iter;
+	const FormatJob* slowest = NULL;
+	gdouble total = 0.0;
+	int count = 0, finished = 0;
+	gchar *text, *eta, *throughput;
+
+	if(!jobs) {
+		gtk_progress_bar_set_fraction(dialog->progress_bar, 0.0);
+		gtk_progress_bar_set_text(dialog->progress_bar, "");
+		return;
+	}
+
+	for(iter = jobs; iter != NULL; iter = iter->next) {
+		const FormatJob* job = iter->data;
+
+		total += job->progress;
+		count++;
+		if(job->state == FORMATJOB_DONE || job->state == FORMATJOB_FAILED ||
+		   job->state == FORMATJOB_CANCELLED)
+			finished++;
+
+		/* We're done when the last one is */
+		if(job->eta >= 0.0 && (!slowest || job->eta > slowest->eta))
+			slowest = job;
+	}
+
+	if(count == 1)
+		text = g_strdup(format_job_get_state_text(jobs->data));
+	else
+		text = g_strdup_printf(ngettext("%d of %d device done", "%d of %d devices done", count), 
+				       finished, count);
+
+	if(slowest && (eta = format_job_get_eta_text(slowest))) {
+		gchar* tmp;
+
+		if( (throughput = format_job_get_throughput_text(slowest)) )
+			tmp = g_strdup_printf("%s (%s, %s)", text, throughput, eta);
+		else
+			tmp = g_strdup_printf("%s (%s)", text, eta);
+		g_free(text); 	g_free(eta); 	g_free(throughput);
+		text = tmp;
+	}
+
+	gtk_progress_bar_set_fraction(dialog->progress_bar, total / count);
+	gtk_progress_bar_set_text(dialog->progress_bar, text);
+	g_free(text);
+}
+
+static void
+on_job_progress(FormatJob* job, gpointer user_data)
+{
+	FormatDialog* dialog = user_data;
+	update_progress_bar(dialog);
+}
+
+static GString*
+start_line(GString* str)
+{
+	if(!str)
+		return g_string_new("");
+	return g_string_append_c(str, '\n');
+}
+
+static void
+on_job_done(FormatJob* job, gpointer user_data)
+{
+	FormatDialog* dialog = user_data;
+	const GSList* iter;
+	GString *errors = NULL, *notes = NULL;
+	gboolean unreliable = FALSE;
+
+	if(job->error)
+		g_warning("Formatting %s failed: %s", job->device, job->error->message);
+
+	if(!format_job_queue_is_idle(dialog->jobs)) {
+		update_progress_bar(dialog);
+		return;
+	}
+
+	/* Everything's finished; tell the user about whatever went wrong, all
+	 * in one go */
+	for(iter = format_job_queue_get_jobs(dialog->jobs); iter != NULL; iter = iter->next) {
+		const FormatJob* current = iter->data;
+
+		/* The same things the batch mode prints; slow sectors are
+		 * worth knowing about even if the job failed later on */
+		if(!current->error && current->bad_extents && extent_list_get_total(current->bad_extents) > 0) {
+			notes = start_line(notes);
+			g_string_append_printf(notes, _("%s: %llu KiB of bad sectors were kept out of the filesystem"), 
+					       current->target, 
+					       (unsigned long long)((extent_list_get_total(current->bad_extents) + 1023) / 1024));
+			unreliable = TRUE;
+		}
+		if(current->skipped > 0) {
+			notes = start_line(notes);
+			g_string_append_printf(notes, _("%s: %llu MiB were zero already, and weren't written again"), 
+					       current->device, (unsigned long long)(current->skipped / (1024 * 1024)));
+		}
+		if(current->slow_extents && extent_list_get_total(current->slow_extents) > 0) {
+			notes = start_line(notes);
+			unreliable = TRUE;
+			g_string_append_printf(notes, _("%s: %llu KiB were unusually slow to read; the device may be wearing out"), 
+					       current->target, 
+					       (unsigned long long)((extent_list_get_total(current->slow_extents) + 1023) / 1024));
+		}
+
+		if(!current->error)
+			continue;
+
+		if(!errors)
+			errors = g_string_new("");
+		else
+			g_string_append_c(errors, '\n');
+		g_string_append(errors, current->error->message);
+	}
+
+	if(errors) {
+		show_error_dialog(dialog->toplevel, _("Error formatting device"), errors->str);
+		g_string_free(errors, TRUE);
+	}
+
+	if(notes) {
+		show_message_dialog(dialog->toplevel, (unreliable ? GTK_MESSAGE_WARNING : GTK_MESSAGE_INFO), 
+				    _("Formatting finished"), notes->str);
+		g_string_free(notes, TRUE);
+	}
+
+	format_job_queue_clear_finished(dialog->jobs);
+	update_progress_bar(dialog);
+
+	/* The partitions on the device have changed under us */
+	refresh_device_lists(dialog);
 	update_dialog(dialog);
 }
 
@@ -761,50 +1261,49 @@ on_format_button_clicked(GtkWidget* w, gpointer user_data)
 {
 	FormatDialog* dialog = g_object_get_data( G_OBJECT(gtk_widget_get_toplevel(w)), "userdata" );
 	FormatVolume* vol;
+	FormatJobOptions options;
+	const gchar* device;
 	gchar* fs = NULL;
-	gboolean do_encrypt = FALSE;
 
 	/* Figure out the device params */
 	GtkTreeIter iter;
 	if(!gtk_combo_box_get_active_iter(dialog->volume_combo, &iter))
 		return;
-	if( !(vol = get_cached_device_from_treeiter(dialog, &iter)) )
+	if( !(vol = (FormatVolume*)get_cached_device_from_treeiter(dialog, &iter)) )
 		return;
 	fs = get_fs_from_menu(dialog);
 	
 	if(!fs) 	goto error_out;
 
+	if(!formatters_find(fs)) {
+		g_warning("Nothing can create filesystem %s", fs);
+		goto error_out;
+	}
+
 	if(!warn_user_of_impending_doom(dialog, vol)) {
 		g_debug("User cancelled format!");
 		goto error_out;
 	}
 
 	/* TODO: Here's where we'll add the floppy support */
+	/* TODO: Set up encryption here */
 
 	gboolean create_table = !(vol->volume || libhal_drive_no_partitions_hint(vol->drive));
-	start_operation(dialog, 2 + (create_table ? 1 : 0) + (do_encrypt ? 1 : 0));
-	if(create_table) {
-		do_next_operation(dialog, _("Creating partition table..."));
-
-		/* TODO: Figure out what to do if any other partition is mounted on this drive */
-		if(!(vol = write_partition_table(dialog, vol, fs)))
-			goto error_out;
-		if(!vol->volume)
-			goto error_out;
-
-	}
-
-	if(do_encrypt) {
-		/* TODO: Set up encryption here */
-	}
-
-	g_debug("Creating filesystem on %s...\n", vol->friendly_name);
-	
-	do_next_operation(dialog, _("Creating filesystem..."));
-	do_mkfs(dialog, libhal_volume_get_device_file(vol->volume));
-
-	do_next_operation(dialog, _("Syncing changes..."));
-	g_spawn_command_line_sync("sync", NULL, NULL, NULL, NULL);
+	device = (vol->volume ? libhal_volume_get_device_file(vol->volume) : 
+				libhal_drive_get_device_file(vol->drive));
+
+	memset(&options, 0, sizeof(options));
+	options.check_capacity = gtk_toggle_button_get_active(dialog->capacity_check);
+	if(gtk_toggle_button_get_active(dialog->discard_check))
+		options.discard = BLOCKDEV_DISCARD_TRIM;
+	if(gtk_toggle_button_get_active(dialog->overwrite_check))
+		options.overwrite = FORMATJOB_OVERWRITE_RANDOM;
+	if(gtk_toggle_button_get_active(dialog->scan_check))
+		options.scan = FORMATJOB_SCAN_READ;
+
+	g_debug("Formatting %s...", vol->friendly_name);
+	format_job_queue_add(dialog->jobs, device, fs, create_table, &options);
+	update_dialog(dialog);
 
 error_out:
 	if(fs)
@@ -813,6 +1312,16 @@ error_out:
 	return;
 }
 
+void
+on_cancel_button_clicked(GtkWidget* w, gpointer user_data)
+{
+	FormatDialog* dialog = g_object_get_data( G_OBJECT(gtk_widget_get_toplevel(w)), "userdata" );
+
+	/* on_job_done puts the dialog back once the last one has stopped */
+	g_debug("Cancelling all jobs");
+	format_job_queue_cancel_all(dialog->jobs);
+}
+
 
 /*
  * Public functions
@@ -858,31 +1367,39 @@ format_dialog_new(void)
 	dialog->cancel_button = GTK_BUTTON(glade_xml_get_widget(dialog->xml, "cancel_button"));
 	dialog->luks_subwindow = GTK_BOX(glade_xml_get_widget (dialog->xml, "luks_subwindow"));
 	dialog->floppy_subwindow = GTK_BOX(glade_xml_get_widget (dialog->xml, "floppy_subwindow"));
+	dialog->capacity_check = GTK_TOGGLE_BUTTON(glade_xml_get_widget (dialog->xml, "capacity_check"));
+	dialog->discard_check = GTK_TOGGLE_BUTTON(glade_xml_get_widget (dialog->xml, "discard_check"));
+	dialog->overwrite_check = GTK_TOGGLE_BUTTON(glade_xml_get_widget (dialog->xml, "overwrite_check"));
+	dialog->scan_check = GTK_TOGGLE_BUTTON(glade_xml_get_widget (dialog->xml, "scan_check"));
 	g_assert(dialog->toplevel != NULL);
 
-	/* Get a HAL context; if we can't, bail */
-	dialog->hal_context = libhal_context_alloc();
-
 	glade_xml_signal_autoconnect(dialog->xml);
 	g_object_set_data(G_OBJECT(dialog->toplevel), "userdata", dialog);
 
 	/* Set stuff in the dialog up */
 	setup_volume_treeview(dialog);	
 	setup_filesystem_menu(dialog);
+	dialog->jobs = format_job_queue_new(FORMAT_JOB_DEFAULT_PARALLEL, on_job_progress, on_job_done, dialog);
 
+	dialog->mounts = mount_table_new();
+	mount_table_add_watch(dialog->mounts, on_mount_table_changed, dialog);
+
+	/* Show the window right away with whatever we saw last time; HAL
+	 * gets queried on the probe thread and the list is reconciled as
+	 * results come back */
+	dialog->stale_list = device_cache_load();
+	rebuild_volume_combo(dialog);
 	gtk_widget_show_all (dialog->toplevel);
+	refresh_device_lists(dialog);
 	update_dialog(dialog);
 
-	/* We do this here so they at least see the window before we die */
-	if( !dialog->hal_context ) {
-		show_error_dialog(dialog->toplevel, 
-				_("Cannot get list of disks"), 
-				_("Make sure the HAL daemon is running and configured correctly"));
-		return NULL;
-	}
+	return dialog;
+}
 
-	/* Get the HAL version and register the HAL device callbacks */
-	get_hal_version(dialog);
+static void
+register_hal_callbacks(FormatDialog* dialog)
+{
+	/* Register the HAL device callbacks */
 	g_debug("Registering callback!");
 	libhal_ctx_set_user_data(dialog->hal_context, dialog);
 	if (libhal_ctx_set_device_added(dialog->hal_context, on_libhal_device_added_removed) == TRUE)
@@ -892,11 +1409,8 @@ format_dialog_new(void)
 	libhal_ctx_set_device_new_capability(dialog->hal_context, NULL);
 	libhal_ctx_set_device_lost_capability(dialog->hal_context, NULL);
 	libhal_ctx_set_device_condition(dialog->hal_context, NULL);
-
-	return dialog;
 }
 
-
 void format_dialog_free(FormatDialog* obj)
 {
 	/* Free our toplevel first, so we don't end up jumping into event
@@ -904,12 +1418,24 @@ void format_dialog_free(FormatDialog* obj)
 	g_object_unref(obj->toplevel);
 	g_object_unref(obj->xml);
 
-	if(obj->hal_context)
-		libhal_ctx_free(obj->hal_context);
-	
 	/* We have destroy notify hooks, so we don't worry about what's inside */
 	if(obj->icon_cache)
-		g_hash_table_destroy(obj->icon_cache);
+		icon_cache_free(obj->icon_cache);
+
+	if(obj->jobs)
+		format_job_queue_free(obj->jobs);
+
+	if(obj->volume_rows)
+		g_hash_table_destroy(obj->volume_rows);
+
+	if(obj->drive_probes)
+		g_hash_table_destroy(obj->drive_probes);
+
+	if(obj->populated_drives)
+		g_hash_table_destroy(obj->populated_drives);
+
+	if(obj->mounts)
+		mount_table_free(obj->mounts);
 
 	if(obj->hal_drive_list)
 		format_volume_list_free(obj->hal_drive_list);
@@ -917,6 +1443,9 @@ void format_dialog_free(FormatDialog* obj)
 	if(obj->hal_volume_list)
 		format_volume_list_free(obj->hal_volume_list);
 
+	if(obj->stale_list)
+		format_volume_list_free(obj->stale_list);
+
 	if(obj->hal_context)
 		libhal_ctx_free(obj->hal_context);
 
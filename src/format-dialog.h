@@ -34,6 +34,9 @@
 #include <libhal-storage.h>
 
 #include "device-info.h"
+#include "format-job.h"
+#include "icon-cache.h"
+#include "mount-info.h"
 
 typedef struct _FormatDialog {
 	GladeXML* xml;
@@ -42,12 +45,18 @@ typedef struct _FormatDialog {
 	/* Subwindows */
 	GtkBox* luks_subwindow;
 	GtkBox* floppy_subwindow;
+	GtkToggleButton* capacity_check;
+	GtkToggleButton* discard_check;
+	GtkToggleButton* overwrite_check;
+	GtkToggleButton* scan_check;
 
 	/* Stuff for device list */
 	GtkTreeStore* volume_model;
 	GtkComboBox* volume_combo;
 	GtkToggleButton* show_partitions;
-	GHashTable* icon_cache;
+	IconCache* icon_cache;
+	GHashTable* volume_rows;	/* udi => GtkTreeRowReference */
+	GtkTreeRowReference* status_row; /* "Searching..." / "No devices" */
 	GtkLabel* extra_volume_info;
 	GtkHBox* extra_volume_hbox;
 	GtkButton* format_button;
@@ -57,30 +66,26 @@ typedef struct _FormatDialog {
 	/* Stuff for filesystem list */
 	GtkComboBox* fs_combo;
 	GtkTreeStore* fs_model;
-	GHashTable* fs_map; 		/* This maps fs names ("ext3") to its script */
 
 	/* HAL info */
         gint hal_version; 		/* "1.3.4.5" => 1345 */
 	LibHalContext* hal_context;
 	GSList* hal_drive_list;		/* List of FormatVolume ptrs */
 	GSList* hal_volume_list; 	/* this too */
+	GSList* stale_list;		/* Shown, but not confirmed by HAL yet */
+	guint probe_serial;		/* Probe we're waiting on, 0 if none */
+	GHashTable* drive_probes;	/* drive udi => serial of its partition
+					   probe, 0 until the drive is confirmed */
+	GHashTable* populated_drives;	/* drive udis whose partitions we have */
+	MountTable* mounts;
 
-	/* Progress bar stuff */
-	gint total_ops;
-	gint ops_left; 			/* (ops_left == 0) => not formatting */
-	GError* format_error;
-	char* mkfs_target;
+	/* Formatting */
+	FormatJobQueue* jobs;
 } FormatDialog;
 
 FormatDialog* format_dialog_new(void);
 void format_dialog_free(FormatDialog* obj);
 
-/* Progress bar functions */
-void handle_format_error(FormatDialog* dialog);
-void start_operation(FormatDialog* dialog, int steps);
-void finish_operation(FormatDialog* dialog);
-void do_next_operation(FormatDialog* dialog, const gchar* progress_text);
-
 /* Functions to help out format tasks */
 gchar* get_fs_from_menu(FormatDialog* dialog);
 
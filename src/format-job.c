@@ -0,0 +1,902 @@
+/*
+ * format-job.c - Format several devices at once
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gi18n.h>
+
+#include "blockdev.h"
+#include "bulkio.h"
+#include "capacity-check.h"
+#include "chacha.h"
+#include "device-info.h"
+#include "format-job.h"
+
+/* Every job walks through its steps on its own: the blocking ones
+ * (partitioning and flushing) run on a thread pool, and creating the
+ * filesystem is up to the job's formatter, which tells us how it's going
+ * through the main loop. The queue only decides how many jobs get to be in
+ * flight at once. */
+
+/* How much of a job's progress bar each step gets, next to the other steps
+ * that job goes through. The ones that touch every byte of the device are
+ * the slow ones, but so is creating the filesystem for the formatters that
+ * write out their inode tables */
+static const gdouble step_weights[] = {
+	[FORMATJOB_CHECKING_CAPACITY] = 0.5,
+	[FORMATJOB_DISCARDING] = 	1.0,
+	[FORMATJOB_OVERWRITING] = 	8.0,
+	[FORMATJOB_SCANNING] = 		8.0,
+	[FORMATJOB_CREATING_FS] = 	8.0,
+	[FORMATJOB_FLUSHING] = 		1.0,
+};
+
+/* The ETA goes by a moving average of how fast the bar has been moving;
+ * this is how much the newest sample counts, and how far apart samples have
+ * to be so that a burst of output doesn't look like a burst of speed */
+#define ETA_SMOOTHING 		0.3
+#define ETA_MIN_INTERVAL 	0.5
+
+/* What a write scan puts down and reads back, one pass each; they're
+ * badblocks -w's, and the last one leaves the device zeroed */
+static const guchar scan_patterns[] = { 0xAA, 0x55, 0xFF, 0x00 };
+
+/* udev creates the partition's device node some time after the kernel sees
+ * it; this is how long we give it, in ms */
+#define PARTITION_NODE_TIMEOUT 	5000
+
+struct _FormatJobQueue {
+	gint max_parallel;
+	gint running;
+
+	GThreadPool* pool;		/* Runs the blocking steps */
+	GQueue* pending;		/* Jobs waiting for a free slot */
+	GSList* jobs;			/* All jobs, we own these */
+
+	FormatJobProgressFunc progress_cb;
+	FormatJobDoneFunc done_cb;
+	gpointer user_data;
+};
+
+static void job_advance(FormatJob* job);
+
+
+/*
+ * Utility Functions
+ */
+
+static void
+format_job_free(FormatJob* job)
+{
+	g_free(job->device);
+	g_free(job->target);
+	g_free(job->fs);
+	if(job->bad_extents)
+		extent_list_free(job->bad_extents);
+	if(job->slow_extents)
+		extent_list_free(job->slow_extents);
+	if(job->error)
+		g_error_free(job->error);
+	g_free(job);
+}
+
+static void
+job_set_state(FormatJob* job, enum FormatJobState state, gdouble progress)
+{
+	FormatJobQueue* queue = job->queue;
+
+	job->state = state;
+	job->progress = progress;
+	if(queue->progress_cb)
+		queue->progress_cb(job, queue->user_data);
+}
+
+/* For steps that tell us how they're doing; fractions they hand
+ * job_step_progress() end up between where the bar is now and end */
+static void
+job_start_step(FormatJob* job, gdouble end)
+{
+	job->step_start = job->progress;
+	job->step_end = end;
+
+	g_get_current_time(&job->last_sample);
+	job->last_sample_progress = job->progress;
+	job->rate = 0.0;
+	job->eta = -1.0;
+}
+
+static void
+job_set_progress(FormatJob* job, gdouble progress)
+{
+	FormatJobQueue* queue = job->queue;
+	GTimeVal now;
+	gdouble elapsed, rate;
+
+	job->progress = progress;
+
+	g_get_current_time(&now);
+	elapsed = (gdouble)(now.tv_sec - job->last_sample.tv_sec) + 
+		  (gdouble)(now.tv_usec - job->last_sample.tv_usec) / G_USEC_PER_SEC;
+
+	if(elapsed >= ETA_MIN_INTERVAL && progress > job->last_sample_progress) {
+		rate = (progress - job->last_sample_progress) / elapsed;
+		job->rate = (job->rate > 0.0 ? ETA_SMOOTHING * rate + (1.0 - ETA_SMOOTHING) * job->rate : rate);
+		job->eta = MAX(job->step_end - progress, 0.0) / job->rate;
+
+		job->last_sample = now;
+		job->last_sample_progress = progress;
+	}
+
+	if(queue->progress_cb)
+		queue->progress_cb(job, queue->user_data);
+}
+
+static gdouble
+job_step_progress(FormatJob* job, gdouble fraction)
+{
+	return job->step_start + (job->step_end - job->step_start) * CLAMP(fraction, 0.0, 1.0);
+}
+
+static gboolean
+job_has_step(FormatJob* job, enum FormatJobState state)
+{
+	switch(state) {
+	case FORMATJOB_CHECKING_CAPACITY:
+		return job->options.check_capacity;
+	case FORMATJOB_DISCARDING:
+		return (job->options.discard != BLOCKDEV_DISCARD_NONE);
+	case FORMATJOB_OVERWRITING:
+		return (job->options.overwrite != FORMATJOB_OVERWRITE_NONE);
+	case FORMATJOB_PARTITIONING:
+		return job->create_table;
+	case FORMATJOB_SCANNING:
+		return (job->options.scan != FORMATJOB_SCAN_NONE);
+	case FORMATJOB_WIPING:
+	case FORMATJOB_CREATING_FS:
+	case FORMATJOB_FLUSHING:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/* Where on the bar the job is once it's through state */
+static gdouble
+job_step_end(FormatJob* job, enum FormatJobState state)
+{
+	gdouble done = 0.0, total = 0.0;
+	guint i;
+
+	for(i=0; i < G_N_ELEMENTS(step_weights); i++) {
+		if(!job_has_step(job, i))
+			continue;
+
+		total += step_weights[i];
+		if(i <= state)
+			done += step_weights[i];
+	}
+
+	return done / total;
+}
+
+static void
+job_enter_step(FormatJob* job, enum FormatJobState state)
+{
+	job->progress = job_step_end(job, state - 1);
+	job->throughput = 0.0;
+	job_start_step(job, job_step_end(job, state));
+	job_set_state(job, state, job->progress);
+}
+
+
+/*
+ * Blocking steps; these run on the pool and touch nothing but the job
+ */
+
+struct _progress_update {
+	FormatJob* job;
+	gdouble progress;
+	gdouble throughput;
+};
+
+static gboolean
+progress_update_idle(gpointer data)
+{
+	struct _progress_update* update = data;
+
+	update->job->throughput = update->throughput;
+	job_set_progress(update->job, update->progress);
+	g_free(update);
+	return FALSE;
+}
+
+/* Hands progress to the main loop; it gets there ahead of the step's
+ * job_step_done_idle */
+static void
+job_post_update(FormatJob* job, gdouble progress, gdouble throughput)
+{
+	struct _progress_update* update = g_new0(struct _progress_update, 1);
+
+	job->posted_progress = progress;
+	update->job = job;
+	update->progress = progress;
+	update->throughput = throughput;
+	g_idle_add(progress_update_idle, update);
+}
+
+/* The same, but not more often than the bar can show it */
+static void
+job_post_progress(FormatJob* job, gdouble progress)
+{
+	if(progress - job->posted_progress >= 0.01)
+		job_post_update(job, progress, 0.0);
+}
+
+/* For the steps that only know what fraction they're through */
+static gboolean
+fraction_progress_cb(gdouble fraction, gpointer user_data)
+{
+	FormatJob* job = user_data;
+
+	job_post_progress(job, job_step_progress(job, fraction));
+	return !g_atomic_int_get(&job->cancelled);
+}
+
+/* Fakes are sold as whatever size they claim, so this goes by MB rather
+ * than MiB too */
+static void
+check_capacity(FormatJob* job)
+{
+	guint64 size, usable;
+
+	job->posted_progress = job->step_start;
+	if(!capacity_check(job->device, &size, &usable, fraction_progress_cb, job, &job->error))
+		return;
+	if(usable >= size)
+		return;
+
+	g_set_error(&job->error, 0, 0, _("%s says it holds %llu MB, but no more than the first %llu MB of it "
+					 "keep what's written to them; it's probably counterfeit"), job->device, 
+		    (unsigned long long)(size / 1000000), (unsigned long long)(usable / 1000000));
+}
+
+static void
+discard_device(FormatJob* job)
+{
+	job->posted_progress = job->step_start;
+	blockdev_discard(job->device, job->options.discard, fraction_progress_cb, job, &job->error);
+}
+
+/* What the bulkio callbacks get to see */
+struct _pass_data {
+	FormatJob* job;
+	ChachaKey key;
+	guchar pattern;
+	guint pass, passes;		/* When a step takes more than one */
+	guint64 skipped;		/* As of the last update */
+};
+
+/* bulkio only calls this a few times a second, and the speed is worth
+ * showing even when the bar hardly moves */
+static gboolean
+bulkio_progress_cb(const BulkioStats* stats, gpointer user_data)
+{
+	struct _pass_data* data = user_data;
+	gdouble fraction = (gdouble)stats->done / (gdouble)MAX(stats->total, 1);
+
+	data->skipped = stats->skipped;
+	job_post_update(data->job, job_step_progress(data->job, (data->pass + fraction) / MAX(data->passes, 1)), 
+			stats->rate);
+	return !g_atomic_int_get(&data->job->cancelled);
+}
+
+static void
+random_fill(guchar* buf, gsize len, guint64 offset, gpointer user_data)
+{
+	chacha_keystream(&((struct _pass_data*)user_data)->key, offset, buf, len);
+}
+
+static void
+pattern_fill(guchar* buf, gsize len, guint64 offset, gpointer user_data)
+{
+	memset(buf, ((struct _pass_data*)user_data)->pattern, len);
+}
+
+static void
+bad_extent_cb(guint64 offset, gsize len, int err, gpointer user_data)
+{
+	FormatJob* job = ((struct _pass_data*)user_data)->job;
+
+	g_debug("%s: %lu bytes at %llu are bad: %s", job->target, (gulong)len, 
+		(unsigned long long)offset, (err ? g_strerror(err) : "read back wrong"));
+	extent_list_add(job->bad_extents, offset, len);
+}
+
+/* These aren't bad yet, so the filesystem can have them; we just tell
+ * whoever's formatting */
+static void
+slow_extent_cb(guint64 offset, gsize len, gdouble seconds, gpointer user_data)
+{
+	FormatJob* job = ((struct _pass_data*)user_data)->job;
+	extent_list_add(job->slow_extents, offset, len);
+}
+
+static void
+job_get_bulkio_params(FormatJob* job, BulkioParams* params)
+{
+	memset(params, 0, sizeof(BulkioParams));
+	params->queue_depth = job->options.queue_depth;
+}
+
+static void
+overwrite_device(FormatJob* job)
+{
+	struct _pass_data data;
+	BulkioParams params;
+	BulkioOps ops;
+
+	job_get_bulkio_params(job, &params);
+	memset(&ops, 0, sizeof(ops));
+	ops.progress = bulkio_progress_cb;
+	ops.user_data = &data;
+	memset(&data, 0, sizeof(data));
+	data.job = job;
+
+	/* Fresh drives, and ones that were zeroed before, hardly get written */
+	if(job->options.overwrite == FORMATJOB_OVERWRITE_ZEROES) {
+		params.skip_zeroes = TRUE;
+		if(bulkio_overwrite(job->device, &params, &ops, &job->error))
+			job->skipped = data.skipped;
+		return;
+	}
+
+	/* Nobody needs to read it back, so the key never leaves this stack */
+	if(!chacha_key_random(&data.key, &job->error))
+		return;
+	ops.fill = random_fill;
+	bulkio_overwrite(job->device, &params, &ops, &job->error);
+	chacha_key_clear(&data.key);
+}
+
+static void
+scan_device(FormatJob* job)
+{
+	struct _pass_data data;
+	BulkioParams params;
+	BulkioOps ops;
+
+	job_get_bulkio_params(job, &params);
+	memset(&ops, 0, sizeof(ops));
+	ops.bad = bad_extent_cb;
+	ops.slow = slow_extent_cb;
+	ops.progress = bulkio_progress_cb;
+	ops.user_data = &data;
+	memset(&data, 0, sizeof(data));
+	data.job = job;
+
+	/* Nothing in the main loop looks at these until the step is over */
+	job->bad_extents = extent_list_new();
+	job->slow_extents = extent_list_new();
+	if(job->options.scan == FORMATJOB_SCAN_READ) {
+		bulkio_read(job->target, &params, &ops, &job->error);
+		return;
+	}
+
+	ops.fill = pattern_fill;
+	data.passes = G_N_ELEMENTS(scan_patterns);
+	for(data.pass = 0; data.pass < data.passes && !job->error; data.pass++) {
+		data.pattern = scan_patterns[data.pass];
+		bulkio_write_verify(job->target, &params, &ops, &job->error);
+	}
+}
+
+/* Whether an earlier step has already left nothing behind to find */
+static gboolean
+job_device_is_blank(FormatJob* job)
+{
+	return (job->options.discard == BLOCKDEV_DISCARD_ZEROOUT || 
+		job->options.overwrite != FORMATJOB_OVERWRITE_NONE);
+}
+
+static gboolean
+find_new_partition(FormatJob* job)
+{
+	if( (job->target = get_partition_device_file(job->device, 1)) &&
+	    g_file_test(job->target, G_FILE_TEST_EXISTS) )
+		return TRUE;
+
+	g_free(job->target);
+	job->target = NULL;
+	return FALSE;
+}
+
+static void
+partition_device(FormatJob* job)
+{
+	BlockdevEventWatch* watch;
+	GTimeVal now, deadline;
+	glong remaining;
+	guint64 size;
+
+	if( !(size = get_block_device_size(job->device)) ) {
+		g_set_error(&job->error, 0, 0, _("Cannot read the size of %s"), job->device);
+		return;
+	}
+
+	/* The old table's leftovers (the backup GPT, RAID and LVM headers on
+	 * the whole disk) would outlive the new one */
+	if(!job_device_is_blank(job) && !blockdev_wipe_signatures(job->device, &job->error))
+		return;
+
+	/* This has to be listening before the kernel hears about the new
+	 * partition, or we could miss it */
+	watch = blockdev_event_watch_new();
+
+	if(!write_partition_table_for_device_file(job->device, size, job->scheme, &job->error))
+		goto out;
+
+	if(!set_partition_type_for_device_file(job->device, 0 /* Always first partition */,
+					       get_part_type_from_fs(job->fs))) {
+		g_set_error(&job->error, 0, 0, _("Couldn't set partition type on %s"), job->device);
+		goto out;
+	}
+
+	/* Any block device event might be the one; check after each */
+	g_get_current_time(&deadline);
+	g_time_val_add(&deadline, PARTITION_NODE_TIMEOUT * 1000);
+	while(!find_new_partition(job)) {
+		g_get_current_time(&now);
+		remaining = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_usec - now.tv_usec) / 1000;
+		if(remaining <= 0) {
+			g_set_error(&job->error, 0, 0,
+				    _("Can't find new partition on %s after formatting. Try again"), job->device);
+			break;
+		}
+
+		blockdev_event_watch_wait(watch, (guint)remaining);
+	}
+
+out:
+	blockdev_event_watch_free(watch);
+}
+
+static void
+wipe_signatures(FormatJob* job)
+{
+	/* Zeroing out or overwriting already took care of it */
+	if(job_device_is_blank(job))
+		return;
+
+	blockdev_wipe_signatures(job->target, &job->error);
+}
+
+static void
+flush_device(FormatJob* job)
+{
+	/* Only this device's dirty buffers; a global sync() would make every
+	 * other job wait on ours */
+	blockdev_flush(job->target, &job->error);
+}
+
+static gboolean
+job_step_done_idle(gpointer data)
+{
+	job_advance(data);
+	return FALSE;
+}
+
+static void
+job_worker(gpointer data, gpointer user_data)
+{
+	FormatJob* job = data;
+
+	switch(job->state) {
+	case FORMATJOB_CHECKING_CAPACITY:
+		check_capacity(job);
+		break;
+	case FORMATJOB_DISCARDING:
+		discard_device(job);
+		break;
+	case FORMATJOB_OVERWRITING:
+		overwrite_device(job);
+		break;
+	case FORMATJOB_PARTITIONING:
+		partition_device(job);
+		break;
+	case FORMATJOB_WIPING:
+		wipe_signatures(job);
+		break;
+	case FORMATJOB_SCANNING:
+		scan_device(job);
+		break;
+	case FORMATJOB_FLUSHING:
+		flush_device(job);
+		break;
+	default:
+		g_assert_not_reached();
+	}
+
+	g_idle_add(job_step_done_idle, job);
+}
+
+static void
+run_blocking_step(FormatJob* job)
+{
+	GError* err = NULL;
+
+	if(job->queue->pool) {
+		g_thread_pool_push(job->queue->pool, job, &err);
+		if(!err)
+			return;
+
+		g_warning("Couldn't start a worker thread: %s", err->message);
+		g_error_free(err);
+	}
+
+	/* Better slow than not at all */
+	job_worker(job, job->queue);
+}
+
+
+/*
+ * Main loop side
+ */
+
+static void queue_start_pending(FormatJobQueue* queue);
+
+static void
+job_finish(FormatJob* job, enum FormatJobState state)
+{
+	FormatJobQueue* queue = job->queue;
+
+	job_set_state(job, state, (state == FORMATJOB_DONE ? 1.0 : job->progress));
+	queue->running--;
+
+	if(queue->done_cb)
+		queue->done_cb(job, queue->user_data);
+
+	queue_start_pending(queue);
+}
+
+static void
+request_progress_cb(FormatterRequest* req, gdouble fraction, gpointer user_data)
+{
+	FormatJob* job = user_data;
+	job_set_progress(job, job_step_progress(job, fraction));
+}
+
+static void
+request_done_cb(FormatterRequest* req, gpointer user_data)
+{
+	FormatJob* job = user_data;
+
+	/* Whatever went wrong after a cancel is only because of it */
+	if(req->error && !formatter_request_is_cancelled(req)) {
+		job->error = req->error;
+		req->error = NULL;
+	}
+
+	formatter_request_free(req);
+	job->request = NULL;
+	job->eta = -1.0;
+
+	job_advance(job);
+}
+
+static void
+start_formatter(FormatJob* job)
+{
+	Formatter* formatter = job->formatter;
+	guint64 bad = (job->bad_extents ? extent_list_get_total(job->bad_extents) : 0);
+
+	if(!formatter) {
+		g_set_error(&job->error, 0, 0, _("Don't know how to create a %s filesystem"), job->fs);
+		job_finish(job, FORMATJOB_FAILED);
+		return;
+	}
+
+	/* Only some formatters can keep the filesystem off bad sectors; the
+	 * others would put it right on top of them */
+	if(bad > 0 && !(formatter->flags & FORMATTER_AVOIDS_BAD_EXTENTS) &&
+	   !(formatter = formatters_find_with_flags(job->fs, FORMATTER_AVOIDS_BAD_EXTENTS)) ) {
+		g_set_error(&job->error, 0, 0, _("%s has %llu KiB of bad sectors, and a %s filesystem can't be made to avoid them"),
+			    job->target, (unsigned long long)((bad + 1023) / 1024), job->fs);
+		job_finish(job, FORMATJOB_FAILED);
+		return;
+	}
+
+	job->request = formatter_request_new(formatter, job->target, job->fs, 
+					     FORMATTER_DONT_SET_PARTITION, NULL,
+					     request_progress_cb, request_done_cb, job);
+	job->request->bad_extents = job->bad_extents;
+
+	if(!formatter_request_start(job->request, &job->error)) {
+		formatter_request_free(job->request);
+		job->request = NULL;
+		job_finish(job, FORMATJOB_FAILED);
+	}
+}
+
+static void
+job_advance(FormatJob* job)
+{
+	enum FormatJobState next;
+
+	if(g_atomic_int_get(&job->cancelled)) {
+		job_finish(job, FORMATJOB_CANCELLED);
+		return;
+	}
+
+	if(job->error) {
+		job_finish(job, FORMATJOB_FAILED);
+		return;
+	}
+
+	if(job->state == FORMATJOB_FLUSHING) {
+		job_finish(job, FORMATJOB_DONE);
+		return;
+	}
+
+	/* Flushing is always there, so this stops */
+	for(next = job->state + 1; !job_has_step(job, next); next++);
+
+	/* Without a new partition, the filesystem goes on the device itself */
+	if(next > FORMATJOB_PARTITIONING && !job->target)
+		job->target = g_strdup(job->device);
+
+	job_enter_step(job, next);
+	if(next == FORMATJOB_CREATING_FS)
+		start_formatter(job);
+	else
+		run_blocking_step(job);
+}
+
+static void
+queue_start_pending(FormatJobQueue* queue)
+{
+	FormatJob* job;
+
+	while(queue->running < queue->max_parallel &&
+	      (job = g_queue_pop_head(queue->pending)) ) {
+		queue->running++;
+		job_advance(job);
+	}
+}
+
+
+/*
+ * Public functions
+ */
+
+FormatJobQueue*
+format_job_queue_new(gint max_parallel,
+		     FormatJobProgressFunc progress_cb,
+		     FormatJobDoneFunc done_cb,
+		     gpointer user_data)
+{
+	FormatJobQueue* queue = g_new0(FormatJobQueue, 1);
+	GError* err = NULL;
+
+	queue->max_parallel = MAX(max_parallel, 1);
+	queue->progress_cb = progress_cb; 	queue->done_cb = done_cb;
+	queue->user_data = user_data;
+	queue->pending = g_queue_new();
+
+	if( !(queue->pool = g_thread_pool_new(job_worker, queue, queue->max_parallel,
+					      FALSE /*exclusive*/, &err)) ) {
+		g_warning("Couldn't create format thread pool: %s", err->message);
+		g_error_free(err);
+	}
+
+	return queue;
+}
+
+void
+format_job_queue_free(FormatJobQueue* queue)
+{
+	g_assert(queue != NULL);
+
+	/* Wait for whatever's on the pool right now, but don't start anything
+	 * new; any idles they leave behind never get to run */
+	if(queue->pool)
+		g_thread_pool_free(queue->pool, TRUE /*immediate*/, TRUE /*wait*/);
+
+	g_slist_foreach(queue->jobs, (GFunc)format_job_free, NULL);
+	g_slist_free(queue->jobs);
+	g_queue_free(queue->pending);
+	g_free(queue);
+}
+
+FormatJob*
+format_job_queue_add(FormatJobQueue* queue,
+		     const char* device,
+		     const char* fs,
+		     gboolean create_table,
+		     const FormatJobOptions* options)
+{
+	FormatJob* job = g_new0(FormatJob, 1);
+
+	g_assert(device != NULL && fs != NULL);
+
+	job->queue = queue;
+	job->device = g_strdup(device);
+	job->fs = g_strdup(fs);
+	job->formatter = formatters_find(fs);
+	job->create_table = create_table;
+	if(options)
+		job->options = *options;
+	job->eta = -1.0;
+
+	/* FIXME: Somehow, we need to decide what kind of table to write */
+	job->scheme = PART_TYPE_MSDOS;
+	job->state = FORMATJOB_QUEUED;
+
+	queue->jobs = g_slist_append(queue->jobs, job);
+	g_queue_push_tail(queue->pending, job);
+	queue_start_pending(queue);
+
+	return job;
+}
+
+void
+format_job_cancel(FormatJob* job)
+{
+	FormatJobQueue* queue = job->queue;
+
+	if(job->cancelled || job->state == FORMATJOB_DONE || 
+	   job->state == FORMATJOB_FAILED || job->state == FORMATJOB_CANCELLED)
+		return;
+	g_atomic_int_inc(&job->cancelled);
+
+	if(job->state == FORMATJOB_QUEUED) {
+		/* It never took a slot, so there's nothing to hand on */
+		g_queue_remove(queue->pending, job);
+		job_set_state(job, FORMATJOB_CANCELLED, job->progress);
+		if(queue->done_cb)
+			queue->done_cb(job, queue->user_data);
+		return;
+	}
+
+	/* Discarding, overwriting and scanning stop at the next piece; partitioning and
+	 * flushing can't be stopped halfway, so those just stop the job once they're done */
+	if(job->request)
+		formatter_request_cancel(job->request);
+}
+
+void
+format_job_queue_cancel_all(FormatJobQueue* queue)
+{
+	FormatJob* job;
+	GSList* iter;
+
+	/* The running ones first: cancelling those doesn't call back into
+	 * anybody right away, while the pending ones' done_cb may well free
+	 * every finished job, once the queue goes idle */
+	for(iter = queue->jobs; iter != NULL; iter = iter->next) {
+		job = iter->data;
+		if(job->state != FORMATJOB_QUEUED)
+			format_job_cancel(job);
+	}
+
+	while( (job = g_queue_peek_head(queue->pending)) )
+		format_job_cancel(job);
+}
+
+const GSList*
+format_job_queue_get_jobs(FormatJobQueue* queue)
+{
+	return queue->jobs;
+}
+
+gboolean
+format_job_queue_is_idle(FormatJobQueue* queue)
+{
+	return (queue->running == 0 && g_queue_is_empty(queue->pending));
+}
+
+void
+format_job_queue_clear_finished(FormatJobQueue* queue)
+{
+	GSList *iter, *next;
+
+	for(iter = queue->jobs; iter != NULL; iter = next) {
+		FormatJob* job = iter->data;
+
+		next = iter->next;
+		if(job->state != FORMATJOB_DONE && job->state != FORMATJOB_FAILED &&
+		   job->state != FORMATJOB_CANCELLED)
+			continue;
+
+		format_job_free(job);
+		queue->jobs = g_slist_delete_link(queue->jobs, iter);
+	}
+}
+
+const gchar*
+format_job_get_state_text(const FormatJob* job)
+{
+	switch(job->state) {
+	case FORMATJOB_QUEUED:
+		return _("Waiting...");
+	case FORMATJOB_CHECKING_CAPACITY:
+		return _("Checking the real size...");
+	case FORMATJOB_DISCARDING:
+		return _("Discarding old contents...");
+	case FORMATJOB_OVERWRITING:
+		return _("Overwriting old contents...");
+	case FORMATJOB_PARTITIONING:
+		return _("Creating partition table...");
+	case FORMATJOB_WIPING:
+		return _("Clearing old signatures...");
+	case FORMATJOB_SCANNING:
+		return _("Checking for bad sectors...");
+	case FORMATJOB_CREATING_FS:
+		return _("Creating filesystem...");
+	case FORMATJOB_FLUSHING:
+		return _("Syncing changes...");
+	case FORMATJOB_DONE:
+		return _("Done");
+	case FORMATJOB_FAILED:
+		return _("Failed");
+	case FORMATJOB_CANCELLED:
+		return _("Cancelled");
+	}
+
+	return "";
+}
+
+gchar*
+format_job_get_eta_text(const FormatJob* job)
+{
+	int secs, mins, hours;
+
+	if(job->eta < 0.0 || (job->state != FORMATJOB_CREATING_FS && job->state != FORMATJOB_DISCARDING &&
+			      job->state != FORMATJOB_OVERWRITING && job->state != FORMATJOB_SCANNING))
+		return NULL;
+
+	secs = (int)(job->eta + 0.5);
+	if(secs < 60)
+		return g_strdup_printf(ngettext("about %d second left", "about %d seconds left", secs), secs);
+
+	mins = (secs + 30) / 60;
+	if(mins < 60)
+		return g_strdup_printf(ngettext("about %d minute left", "about %d minutes left", mins), mins);
+
+	hours = (mins + 30) / 60;
+	return g_strdup_printf(ngettext("about %d hour left", "about %d hours left", hours), hours);
+}
+
+gchar*
+format_job_get_throughput_text(const FormatJob* job)
+{
+	if((job->state != FORMATJOB_OVERWRITING && job->state != FORMATJOB_SCANNING) || job->throughput <= 0.0)
+		return NULL;
+
+	return g_strdup_printf(_("%.1f MB/s"), job->throughput / 1000000.0);
+}
@@ -0,0 +1,155 @@
+/*
+ * format-job.h - Format several devices at once
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _FORMAT_JOB_H
+#define _FORMAT_JOB_H
+
+#include <glib.h>
+
+#include "blockdev.h"
+#include "bulkio.h"
+#include "extent-list.h"
+#include "formatterbase.h"
+#include "partutil.h"
+
+#define FORMAT_JOB_DEFAULT_PARALLEL 	4
+
+typedef struct _FormatJob FormatJob;
+typedef struct _FormatJobQueue FormatJobQueue;
+
+enum FormatJobState {
+	FORMATJOB_QUEUED,
+	FORMATJOB_CHECKING_CAPACITY,
+	FORMATJOB_DISCARDING,
+	FORMATJOB_OVERWRITING,
+	FORMATJOB_PARTITIONING,
+	FORMATJOB_WIPING,
+	FORMATJOB_SCANNING,
+	FORMATJOB_CREATING_FS,
+	FORMATJOB_FLUSHING,
+	FORMATJOB_DONE,
+	FORMATJOB_FAILED,
+	FORMATJOB_CANCELLED,
+};
+
+typedef enum {
+	FORMATJOB_OVERWRITE_NONE,
+	FORMATJOB_OVERWRITE_ZEROES,
+	FORMATJOB_OVERWRITE_RANDOM,	/* ChaCha20 with a throwaway key */
+} FormatJobOverwrite;
+
+typedef enum {
+	FORMATJOB_SCAN_NONE,
+	FORMATJOB_SCAN_READ,		/* Read every sector back */
+	FORMATJOB_SCAN_WRITE,		/* Write every sector with four
+					   patterns in turn, and check each */
+} FormatJobScan;
+
+/* What a job does besides creating the filesystem; all zeroes means
+ * nothing extra */
+typedef struct _FormatJobOptions {
+	gboolean check_capacity;	/* Before anything else: does the
+					   device really hold what it says? */
+	BlockdevDiscardMode discard;	/* Then, over the whole device */
+	FormatJobOverwrite overwrite;	/* Then every byte of it gets written */
+	FormatJobScan scan;		/* Of the target, for bad sectors the
+					   filesystem has to stay off */
+	guint queue_depth;		/* For overwriting and scanning; 0 for
+					   the default */
+} FormatJobOptions;
+
+/* Each job takes one device through capacity check => discard =>
+ * overwrite => partition => wipe old signatures => scan => create fs =>
+ * flush.
+ * Everything here belongs to the queue; only look at it from the main loop */
+struct _FormatJob {
+	FormatJobQueue* queue;
+
+	gchar* device;			/* What we were asked to format */
+	gchar* target;			/* What the filesystem goes on; the
+					   new partition if we made one */
+	gchar* fs;
+	Formatter* formatter;		/* NULL if nobody can make fs */
+	gboolean create_table;
+	FormatJobOptions options;
+	PartitionScheme scheme;
+
+	enum FormatJobState state;
+	gdouble progress;		/* 0.0 - 1.0 for the whole job */
+	gdouble eta;			/* Seconds left in this step, < 0 if
+					   we can't tell */
+	gdouble throughput;		/* Bytes per second while overwriting
+					   or scanning */
+	ExtentList* bad_extents;	/* What the scan found, in bytes from
+					   the start of target; NULL if it
+					   didn't run */
+	ExtentList* slow_extents;	/* Likewise, what read fine but only
+					   after the drive took its time */
+	guint64 skipped;		/* Bytes that were zero already when
+					   overwriting with zeroes */
+	GError* error;			/* Set if state == FORMATJOB_FAILED */
+
+	/* Private */
+	FormatterRequest* request;	/* While we're creating the fs */
+	volatile gint cancelled;	/* Workers look at this too */
+	gdouble posted_progress;	/* Last update a worker sent us */
+	gdouble step_start, step_end;	/* The slice of progress this step gets */
+	GTimeVal last_sample;
+	gdouble last_sample_progress;
+	gdouble rate;			/* Smoothed progress per second */
+};
+
+/* Both of these run in the main loop */
+typedef void (*FormatJobProgressFunc) (FormatJob* job, gpointer user_data);
+typedef void (*FormatJobDoneFunc) (FormatJob* job, gpointer user_data);
+
+FormatJobQueue* format_job_queue_new(gint max_parallel,
+				     FormatJobProgressFunc progress_cb,
+				     FormatJobDoneFunc done_cb,
+				     gpointer user_data);
+void format_job_queue_free(FormatJobQueue* queue);
+
+/* Starts right away if fewer than max_parallel jobs are running. Whoever
+ * formatters_find() picks for fs does the work. options may be NULL */
+FormatJob* format_job_queue_add(FormatJobQueue* queue,
+				const char* device,
+				const char* fs,
+				gboolean create_table,
+				const FormatJobOptions* options);
+
+/* Jobs that haven't started are done with right away; running ones stop as
+ * soon as their current step lets them, and end up FORMATJOB_CANCELLED
+ * through done_cb like any other */
+void format_job_cancel(FormatJob* job);
+void format_job_queue_cancel_all(FormatJobQueue* queue);
+
+const GSList* format_job_queue_get_jobs(FormatJobQueue* queue);
+gboolean format_job_queue_is_idle(FormatJobQueue* queue);
+void format_job_queue_clear_finished(FormatJobQueue* queue);
+
+const gchar* format_job_get_state_text(const FormatJob* job);
+gchar* format_job_get_eta_text(const FormatJob* job);
+gchar* format_job_get_throughput_text(const FormatJob* job);
+
+#endif
@@ -0,0 +1,327 @@
+/*
+ * formatterbase.c - What every way of creating a filesystem looks like
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gi18n.h>
+
+#include "formatterbase.h"
+#include "formattify.h"
+#include "fs-ext2.h"
+#include "fs-parted.h"
+#include "fs-vfat.h"
+
+/* Formatters come in two kinds: the ones that start something and get told
+ * when it's done (the scripts), and the ones that just block until they're
+ * finished (everything we do in-process). The second kind get a thread from
+ * the pool here. Either way, progress and the final answer reach whoever
+ * asked through the main loop, in the order they were sent */
+
+/* Moving the bar by less than this isn't worth waking the main loop for */
+#define PROGRESS_MIN_STEP 	0.01
+
+struct _progress_update {
+	FormatterRequest* req;
+	gdouble fraction;
+};
+
+static GSList* formatters = NULL;	/* In the order we prefer them */
+static GThreadPool* blocking_pool = NULL;
+
+
+/*
+ * Utility Functions
+ */
+
+static void
+register_formatter(Formatter* formatter)
+{
+	if(!formatter)
+		return;
+
+	g_debug("Registering the %s formatter", formatter->name);
+	formatters = g_slist_append(formatters, formatter);
+}
+
+static gboolean
+progress_idle(gpointer data)
+{
+	struct _progress_update* update = data;
+	FormatterRequest* req = update->req;
+
+	if(req->progress_cb)
+		req->progress_cb(req, update->fraction, req->user_data);
+	g_free(update);
+	return FALSE;
+}
+
+static gboolean
+done_idle(gpointer data)
+{
+	FormatterRequest* req = data;
+
+	if(req->done_cb)
+		req->done_cb(req, req->user_data);
+	return FALSE;
+}
+
+static void
+blocking_worker(gpointer data, gpointer user_data)
+{
+	FormatterRequest* req = data;
+
+	if(!formatter_request_is_cancelled(req))
+		req->blocking_func(req, &req->error);
+	formatter_request_done(req);
+}
+
+static gint
+compare_fs(gconstpointer a, gconstpointer b)
+{
+	return strcmp(a, b);
+}
+
+
+/*
+ * Public functions
+ */
+
+void
+formatters_init(void)
+{
+	GError* err = NULL;
+
+	g_assert(formatters == NULL);
+
+	if( !(blocking_pool = g_thread_pool_new(blocking_worker, NULL, -1 /*unlimited*/,
+						FALSE /*exclusive*/, &err)) ) {
+		g_warning("Couldn't create formatter thread pool: %s", err->message);
+		g_error_free(err);
+	}
+
+	/* Ours first, since they don't have to start anything; libparted
+	 * last, since it does the least */
+	register_formatter(vfat_formatter_new());
+	register_formatter(extfs_formatter_new());
+	register_formatter(script_formatter_new());
+	register_formatter(parted_formatter_init());
+}
+
+void
+formatters_shutdown(void)
+{
+	GSList* iter;
+
+	/* Let whatever's running finish; there's no telling what a formatter
+	 * leaves behind if it's stopped halfway */
+	if(blocking_pool)
+		g_thread_pool_free(blocking_pool, FALSE /*immediate*/, TRUE /*wait*/);
+	blocking_pool = NULL;
+
+	for(iter = formatters; iter != NULL; iter = iter->next) {
+		Formatter* formatter = iter->data;
+		if(formatter->fops.unref)
+			formatter->fops.unref(formatter);
+		g_free(formatter);
+	}
+	g_slist_free(formatters);
+	formatters = NULL;
+}
+
+Formatter*
+formatters_find(const char* fs)
+{
+	return formatters_find_with_flags(fs, 0);
+}
+
+Formatter*
+formatters_find_with_flags(const char* fs, FormatterFlags flags)
+{
+	GSList* iter;
+
+	for(iter = formatters; iter != NULL; iter = iter->next) {
+		Formatter* formatter = iter->data;
+
+		if((formatter->flags & flags) == flags && formatter_can_format(formatter, fs))
+			return formatter;
+	}
+
+	return NULL;
+}
+
+GSList*
+formatters_list_fs(void)
+{
+	GSList *iter, *ret = NULL;
+	const char** fs;
+
+	for(iter = formatters; iter != NULL; iter = iter->next) {
+		Formatter* formatter = iter->data;
+
+		for(fs = formatter->available_fs_list; fs && *fs; fs++) {
+			if(!g_slist_find_custom(ret, *fs, compare_fs))
+				ret = g_slist_insert_sorted(ret, (gpointer)*fs, compare_fs);
+		}
+	}
+
+	return ret;
+}
+
+gboolean
+formatter_can_format(Formatter* this, const char* fs)
+{
+	const char** iter;
+
+	if(!fs)
+		return FALSE;
+	if(this->fops.canformat)
+		return this->fops.canformat(this, fs);
+
+	for(iter = this->available_fs_list; iter && *iter; iter++) {
+		if(!strcmp(*iter, fs))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+FormatterRequest*
+formatter_request_new(Formatter* formatter,
+		      const char* blockdev,
+		      const char* fs,
+		      int partition_number,
+		      GHashTable* options,
+		      FormatterProgressFunc progress_cb,
+		      FormatterDoneFunc done_cb,
+		      gpointer user_data)
+{
+	FormatterRequest* req = g_new0(FormatterRequest, 1);
+
+	g_assert(formatter != NULL && blockdev != NULL && fs != NULL);
+
+	req->formatter = formatter;
+	req->blockdev = g_strdup(blockdev);
+	req->fs = g_strdup(fs);
+	req->partition_number = partition_number;
+	req->options = options;
+	req->progress_cb = progress_cb; 	req->done_cb = done_cb;
+	req->user_data = user_data;
+
+	return req;
+}
+
+void
+formatter_request_free(FormatterRequest* req)
+{
+	g_free(req->blockdev);
+	g_free(req->fs);
+	if(req->error)
+		g_error_free(req->error);
+	g_free(req);
+}
+
+gboolean
+formatter_request_start(FormatterRequest* req, GError** error)
+{
+	Formatter* formatter = req->formatter;
+
+	g_debug("Creating %s on %s with the %s formatter", req->fs, req->blockdev, formatter->name);
+	return formatter->fops.doformat(formatter, req, error);
+}
+
+void
+formatter_request_cancel(FormatterRequest* req)
+{
+	Formatter* formatter = req->formatter;
+
+	if(!g_atomic_int_compare_and_exchange(&req->cancelled, FALSE, TRUE))
+		return;
+
+	g_debug("Cancelling %s on %s", req->fs, req->blockdev);
+	if(formatter->fops.cancel)
+		formatter->fops.cancel(formatter, req);
+}
+
+gboolean
+formatter_request_is_cancelled(FormatterRequest* req)
+{
+	return g_atomic_int_get(&req->cancelled);
+}
+
+const char*
+formatter_request_get_option(FormatterRequest* req, const char* key)
+{
+	return (req->options ? g_hash_table_lookup(req->options, key) : NULL);
+}
+
+void
+formatter_request_set_progress(FormatterRequest* req, gdouble fraction)
+{
+	struct _progress_update* update;
+
+	/* Only one thread at a time works on a request, so this is safe */
+	fraction = CLAMP(fraction, 0.0, 1.0);
+	if(fraction < 1.0 && fraction - req->posted_progress < PROGRESS_MIN_STEP)
+		return;
+	req->posted_progress = fraction;
+
+	update = g_new0(struct _progress_update, 1);
+	update->req = req;
+	update->fraction = fraction;
+	g_idle_add(progress_idle, update);
+}
+
+void
+formatter_request_done(FormatterRequest* req)
+{
+	/* Even from the main loop, this goes through an idle so that it
+	 * can't overtake progress updates that are still queued */
+	g_idle_add(done_idle, req);
+}
+
+gboolean
+formatter_request_run_blocking(FormatterRequest* req, FormatterBlockingFunc func, GError** error)
+{
+	GError* err = NULL;
+
+	req->blocking_func = func;
+
+	if(blocking_pool) {
+		g_thread_pool_push(blocking_pool, req, &err);
+		if(!err)
+			return TRUE;
+
+		g_warning("Couldn't start a formatter thread: %s", err->message);
+		g_error_free(err);
+	}
+
+	/* Better slow than not at all */
+	blocking_worker(req, NULL);
+	return TRUE;
+}
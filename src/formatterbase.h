@@ -0,0 +1,164 @@
+/*
+ * formatterbase.h - What every way of creating a filesystem looks like
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef _FORMATTERBASE_H
+#define _FORMATTERBASE_H
+
+#include <glib.h>
+
+#include "extent-list.h"
+
+#define FORMATTER_DONT_SET_PARTITION 	-1
+
+/* What a formatter can do besides creating the filesystem */
+typedef enum {
+	FORMATTER_AVOIDS_BAD_EXTENTS = 1 << 0,	/* Honors req->bad_extents */
+} FormatterFlags;
+
+typedef struct _Formatter Formatter;
+typedef struct _FormatterOps FormatterOps;
+typedef struct _FormatterRequest FormatterRequest;
+
+/* Both of these run in the main loop */
+typedef void (*FormatterProgressFunc) (FormatterRequest* req, gdouble fraction, gpointer user_data);
+typedef void (*FormatterDoneFunc) (FormatterRequest* req, gpointer user_data);
+
+/* For formatters that just block until they're done; see
+ * formatter_request_run_blocking() */
+typedef gboolean (*FormatterBlockingFunc) (FormatterRequest* req, GError** error);
+
+struct _FormatterOps {
+	/* Optional; if it's NULL we look in available_fs_list */
+	gboolean (*canformat) (Formatter* this, const char* fs);
+
+	/* Starts creating req->fs on req->blockdev and returns right away.
+	 * The formatter calls formatter_request_done() exactly once when
+	 * it's finished, from any thread. Returns FALSE and sets error if
+	 * it couldn't even start, in which case it doesn't */
+	gboolean (*doformat) (Formatter* this, FormatterRequest* req, GError** error);
+
+	/* Optional; called in the main loop right after req is cancelled,
+	 * for formatters that can stop faster than the next time they check
+	 * formatter_request_is_cancelled() */
+	void (*cancel) (Formatter* this, FormatterRequest* req);
+
+	/* Optional; frees whatever the formatter hung off itself. The
+	 * Formatter itself belongs to the registry */
+	void (*unref) (Formatter* this);
+};
+
+struct _Formatter {
+	const char* name;
+	const char** available_fs_list; /* NULL-terminated; the strings don't
+					   belong to the list */
+	FormatterOps fops;
+	FormatterFlags flags;
+	gpointer priv;
+};
+
+struct _FormatterRequest {
+	Formatter* formatter;
+	gchar* blockdev;
+	gchar* fs;
+	int partition_number;		/* Or FORMATTER_DONT_SET_PARTITION */
+	GHashTable* options;		/* "label" etc, may be NULL; it's the
+					   caller's, and has to last as long
+					   as the request */
+	const ExtentList* bad_extents;	/* Byte ranges of blockdev to keep out
+					   of the filesystem, may be NULL; the
+					   caller's too */
+
+	GError* error;			/* Set by the formatter if it failed */
+	gpointer formatter_data;	/* Belongs to the formatter */
+
+	/* Private */
+	FormatterProgressFunc progress_cb;
+	FormatterDoneFunc done_cb;
+	gpointer user_data;
+	FormatterBlockingFunc blocking_func;
+	volatile gint cancelled;
+	gdouble posted_progress;
+};
+
+
+/*
+ * The registry of formatters
+ */
+
+/* Sets up every formatter we were built with, scripts included; call this
+ * once, from the main loop, before any of the others */
+void formatters_init(void);
+void formatters_shutdown(void);
+
+/* Returns the formatter that creates fs best, or NULL if nobody can */
+Formatter* formatters_find(const char* fs);
+
+/* The same, but only among those that can do everything in flags */
+Formatter* formatters_find_with_flags(const char* fs, FormatterFlags flags);
+
+/* Every filesystem some formatter can create, sorted; free the list, not
+ * the strings */
+GSList* formatters_list_fs(void);
+
+gboolean formatter_can_format(Formatter* this, const char* fs);
+
+
+/*
+ * Running them
+ */
+
+/* Nothing happens until formatter_request_start() */
+FormatterRequest* formatter_request_new(Formatter* formatter,
+					const char* blockdev,
+					const char* fs,
+					int partition_number,
+					GHashTable* options,
+					FormatterProgressFunc progress_cb,
+					FormatterDoneFunc done_cb,
+					gpointer user_data);
+
+/* Only once done_cb has run, or if it never started */
+void formatter_request_free(FormatterRequest* req);
+
+/* Returns FALSE and sets error if the formatter couldn't start; done_cb
+ * won't be called then */
+gboolean formatter_request_start(FormatterRequest* req, GError** error);
+
+/* The request still finishes through done_cb, with
+ * formatter_request_is_cancelled() returning TRUE. Formatters decide
+ * what state they leave the device in */
+void formatter_request_cancel(FormatterRequest* req);
+gboolean formatter_request_is_cancelled(FormatterRequest* req);
+
+/* These are for the formatters, and are safe to call from any thread */
+const char* formatter_request_get_option(FormatterRequest* req, const char* key);
+void formatter_request_set_progress(FormatterRequest* req, gdouble fraction);
+void formatter_request_done(FormatterRequest* req);
+
+/* Runs func on a worker thread and calls formatter_request_done() when it
+ * returns; doformat can just return this */
+gboolean formatter_request_run_blocking(FormatterRequest* req, FormatterBlockingFunc func, GError** error);
+
+#endif
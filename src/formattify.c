@@ -28,17 +28,26 @@
 #  include "config.h"
 #endif
 
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <glib.h>
 #include <glib/gi18n.h>
 
 #include <parted/parted.h>
 
+#include "capability-cache.h"
 #include "device-info.h"
-#include "format-dialog.h"
 #include "formattify.h"
+#include "mkfs-progress.h"
+
+extern char** environ;
 
 /* TODO: Put this into configure.in */
 #ifndef FORMAT_SCRIPT_DIR
@@ -48,62 +57,275 @@
 
 /*
  * Process-spawning functions
+ *
+ * Both pipes are read as the child writes to them, so a chatty child can't
+ * fill one up and block, and the caller can watch its output live. Only the
+ * last PROCESS_OUTPUT_MAX bytes of each stream are kept for the ProcessOutput.
  */
 
+#define PROCESS_OUTPUT_MAX 	(64 * 1024)
+#define PROCESS_LINE_MAX 	4096
+
+struct _spawn_cb_pack;
+
+typedef struct {
+	struct _spawn_cb_pack* pack;
+	GIOChannel* channel;
+	GString* line;			/* What we have of the current line */
+	GString* output;		/* The tail of everything */
+	gboolean is_stderr;
+	gboolean eof;
+} OutputStream;
+
 struct _spawn_cb_pack {
-	GFunc real_cb;
+	GSourceFunc real_cb;
+	ProcessLineFunc line_cb;
 	gpointer real_userdata;
-	gint out_fd;
-	gint error_fd;
+	OutputStream out;
+	OutputStream err;
+	gboolean exited;
+	gint status;
 };
 
+static void
+output_stream_emit_line(OutputStream* stream)
+{
+	struct _spawn_cb_pack* s = stream->pack;
+
+	if(stream->line->len == 0)
+		return;
+	if(s->line_cb)
+		s->line_cb(stream->line->str, stream->is_stderr, s->real_userdata);
+	g_string_truncate(stream->line, 0);
+}
+
+static void
+output_stream_append(OutputStream* stream, const gchar* buf, gsize len)
+{
+	gsize i;
+
+	g_string_append_len(stream->output, buf, len);
+	if(stream->output->len > PROCESS_OUTPUT_MAX)
+		g_string_erase(stream->output, 0, stream->output->len - PROCESS_OUTPUT_MAX);
+
+	/* Progress meters redraw themselves with \r or a row of \b's, so
+	 * those end a line too */
+	for(i=0; i < len; i++) {
+		if(buf[i] == '\n' || buf[i] == '\r' || buf[i] == '\b') {
+			output_stream_emit_line(stream);
+			continue;
+		}
+
+		g_string_append_c(stream->line, buf[i]);
+		if(stream->line->len >= PROCESS_LINE_MAX)
+			output_stream_emit_line(stream);
+	}
+}
+
+static void
+spawn_maybe_finish(struct _spawn_cb_pack* s)
+{
+	ProcessOutput* cb_data;
+
+	if(!s->exited || !s->out.eof || !s->err.eof)
+		return;
+
+	cb_data = g_new0(ProcessOutput, 1);
+	cb_data->callback = s->real_cb; 	cb_data->ret = s->status;
+	cb_data->user_data = s->real_userdata;
+	cb_data->stdout_output = g_string_free(s->out.output, FALSE);
+	cb_data->stderr_output = g_string_free(s->err.output, FALSE);
+	g_string_free(s->out.line, TRUE);
+	g_string_free(s->err.line, TRUE);
+	g_idle_add(cb_data->callback, cb_data);
+
+	g_free(s);
+}
+
+static gboolean
+output_stream_cb(GIOChannel* source, GIOCondition condition, gpointer data)
+{
+	OutputStream* stream = data;
+	gchar buf[4096];
+	gsize len;
+	GIOStatus status;
+
+	do {
+		len = 0;
+		status = g_io_channel_read_chars(source, buf, sizeof(buf), &len, NULL);
+		if(len > 0)
+			output_stream_append(stream, buf, len);
+	} while(status == G_IO_STATUS_NORMAL);
+
+	if(status == G_IO_STATUS_AGAIN)
+		return TRUE;
+
+	/* EOF (or an error, which we treat the same) */
+	output_stream_emit_line(stream);
+	g_io_channel_shutdown(source, FALSE, NULL);
+	g_io_channel_unref(source);
+	stream->channel = NULL;
+	stream->eof = TRUE;
+
+	spawn_maybe_finish(stream->pack);
+	return FALSE;
+}
+
+static void
+output_stream_init(struct _spawn_cb_pack* s, OutputStream* stream, gint fd, gboolean is_stderr)
+{
+	stream->pack = s;
+	stream->is_stderr = is_stderr;
+	stream->line = g_string_sized_new(128);
+	stream->output = g_string_sized_new(1024);
+
+	stream->channel = g_io_channel_unix_new(fd);
+	g_io_channel_set_encoding(stream->channel, NULL, NULL);
+	g_io_channel_set_buffered(stream->channel, FALSE);
+	g_io_channel_set_flags(stream->channel, G_IO_FLAG_NONBLOCK, NULL);
+	g_io_add_watch(stream->channel, G_IO_IN | G_IO_HUP | G_IO_ERR, output_stream_cb, stream);
+}
+
+/* Only the main loop starts processes, so these don't need a lock */
+static guint spawn_count = 0;
+static gdouble spawn_total_ms = 0.0;
+
+static void
+add_close_inherited_fds(posix_spawn_file_actions_t* actions)
+{
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+	posix_spawn_file_actions_addclosefrom_np(actions, 3);
+#else
+	GDir* dir = g_dir_open("/proc/self/fd", 0, NULL);
+	const gchar* file;
+	int fd, flags;
+
+	if(!dir)
+		return;
+
+	/* The GDir's own fd is close-on-exec, so it takes care of itself */
+	while( (file = g_dir_read_name(dir)) ) {
+		if( (fd = atoi(file)) < 3 )
+			continue;
+
+		flags = fcntl(fd, F_GETFD);
+		if(flags >= 0 && !(flags & FD_CLOEXEC))
+			posix_spawn_file_actions_addclose(actions, fd);
+	}
+	g_dir_close(dir);
+#endif
+}
+
+/* Starts argv[0] (a full path) with stdin on /dev/null and stdout and stderr
+ * on new pipes, and nothing else. g_spawn forks, which means copying the page
+ * tables of a process GTK has made fairly big, once per device when several
+ * mkfs's start together; posix_spawn gets to use vfork instead */
+static gboolean
+launch_process(gchar** argv, GPid* pid, gint* out_fd, gint* err_fd)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	int out_pipe[2] = {-1, -1}, err_pipe[2] = {-1, -1};
+	GTimeVal start, end;
+	gdouble elapsed_ms;
+	pid_t child;
+	int ret;
+
+	if(pipe(out_pipe) != 0 || pipe(err_pipe) != 0) {
+		g_warning("Cannot create pipes: %s", g_strerror(errno));
+		goto error;
+	}
+
+	/* Our ends of the pipes stay with us */
+	fcntl(out_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(err_pipe[0], F_SETFD, FD_CLOEXEC);
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&actions, out_pipe[1], 1);
+	posix_spawn_file_actions_adddup2(&actions, err_pipe[1], 2);
+	add_close_inherited_fds(&actions);
+
+	posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_USEVFORK
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK);
+#endif
+
+	g_get_current_time(&start);
+	ret = posix_spawn(&child, argv[0], &actions, &attr, argv, environ);
+	g_get_current_time(&end);
+
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	close(out_pipe[1]); 	out_pipe[1] = -1;
+	close(err_pipe[1]); 	err_pipe[1] = -1;
+
+	if(ret != 0) {
+		g_warning("Cannot run %s: %s", argv[0], g_strerror(ret));
+		goto error;
+	}
+
+	elapsed_ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_usec - start.tv_usec) / 1000.0;
+	spawn_count++; 		spawn_total_ms += elapsed_ms;
+	g_debug("Started %s (pid %d) in %.2f ms, %.2f ms on average over %u", 
+		argv[0], (int)child, elapsed_ms, spawn_total_ms / spawn_count, spawn_count);
+
+	*pid = child;
+	*out_fd = out_pipe[0];
+	*err_fd = err_pipe[0];
+	return TRUE;
+
+error:
+	if(out_pipe[0] >= 0) 	close(out_pipe[0]);
+	if(out_pipe[1] >= 0) 	close(out_pipe[1]);
+	if(err_pipe[0] >= 0) 	close(err_pipe[0]);
+	if(err_pipe[1] >= 0) 	close(err_pipe[1]);
+	return FALSE;
+}
+
 static void 
 spawn_cb(GPid pid, gint status, gpointer data)
 {
 	struct _spawn_cb_pack* s = data;
-	ProcessOutput* cb_data = g_new0(ProcessOutput, 1);
-	gsize dontcare;
-
-	/* Pull the data out of the pipes, then pack it in our return data
-	 * function */
-	GIOChannel* out = g_io_channel_unix_new(s->out_fd);
-	GIOChannel* err = g_io_channel_unix_new(s->error_fd);
-	g_io_channel_read_to_end(out, &cb_data->stdout_output, &dontcare, NULL);
-	g_io_channel_read_to_end(err, &cb_data->stderr_output, &dontcare, NULL);
-
-	/* Clean up and enqueue the idle function */
-	cb_data->callback = s->real_cb; 	cb_data->ret = status;
-	cb_data->user_data = s->real_userdata;
-	g_io_channel_shutdown(out, FALSE, NULL); 	g_io_channel_shutdown(err, FALSE, NULL);
-	g_spawn_close_pid(pid);
-	g_idle_add(cb_data->callback, cb_data);
 
-	/* Free data */
-	g_free(data);
+	/* The pipes might still have something in them; whichever of these
+	 * comes last hands the output over */
+	s->exited = TRUE;
+	s->status = status;
+	g_spawn_close_pid(pid);
+	spawn_maybe_finish(s);
 }
 
 gboolean 
-spawn_async_get_output(gchar** argv, GSourceFunc callback, gpointer user_data)
+spawn_async_get_output_full(gchar** argv, ProcessLineFunc line_cb, GSourceFunc callback, gpointer user_data, GPid* child_pid)
 {
 	GPid pid;
 	gint out_fd;
 	gint error_fd;
-	struct _spawn_cb_pack* packed_data = g_new0(struct _spawn_cb_pack, 1);
+	struct _spawn_cb_pack* packed_data;
 
-	if(!g_spawn_async_with_pipes(NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, NULL, user_data, &pid, 
-				     NULL, &out_fd, &error_fd, NULL)) {
-		g_warning("Spawn async failed!\n");
+	if(!launch_process(argv, &pid, &out_fd, &error_fd))
 		return FALSE;
-	}
 	g_debug("Out fd=%d, Err fd=%d", out_fd, error_fd);
 
+	packed_data = g_new0(struct _spawn_cb_pack, 1);
 	packed_data->real_cb = callback; 	packed_data->real_userdata = user_data;
-	packed_data->out_fd = out_fd; 	packed_data->error_fd = error_fd;
+	packed_data->line_cb = line_cb;
+	output_stream_init(packed_data, &packed_data->out, out_fd, FALSE);
+	output_stream_init(packed_data, &packed_data->err, error_fd, TRUE);
 
 	g_child_watch_add(pid, spawn_cb, packed_data);
+	if(child_pid)
+		*child_pid = pid;
 	return TRUE;
 }
 
+gboolean 
+spawn_async_get_output(gchar** argv, GSourceFunc callback, gpointer user_data)
+{
+	return spawn_async_get_output_full(argv, NULL, callback, user_data, NULL);
+}
+
 void 
 process_output_free(ProcessOutput* obj)
 {
@@ -120,58 +342,168 @@ process_output_free(ProcessOutput* obj)
  * High-level script functions
  */
 
+static void
+add_mkfs_script(GHashTable* hash, const gchar* fs, const gchar* script_path, const gchar* parser, const gchar* helper)
+{
+	MkfsScript* script = g_new0(MkfsScript, 1);
+	script->path = g_strdup(script_path);
+	script->progress_parser = g_strdup(parser);
+	script->helper = g_strdup(helper);
+
+	g_debug("Adding %s to %s", fs, script_path);
+	g_hash_table_insert(hash, g_strdup(fs), script);
+}
+
+/* Keep this in sync with the --capabilities case in scripts/mkfs */
+static const struct {
+	const gchar* fs;
+	const gchar* parser;
+} stock_parsers[] = {
+	{ "ext2", 	"mke2fs" },
+	{ "ext3", 	"mke2fs" },
+	{ "ext4", 	"mke2fs" },
+	{ "ntfs", 	"mkntfs" },
+	{ NULL, NULL },
+};
+
+/* The stock script just lists the mkfs.* helpers in $PATH, which we can do
+ * ourselves without forking a shell plus an ls and a sed per directory. While
+ * we're at it we remember where each one is, since running the script means
+ * sh, which, mkfs and only then the helper */
+static void
+add_stock_supported_fs(const char* script_path, GHashTable* hash)
+{
+	const gchar* path_env = getenv("PATH");
+	gchar **dirs, **iter;
+	const gchar* file;
+	GDir* dir;
+	int i;
+
+	dirs = g_strsplit((path_env ? path_env : ""), G_SEARCHPATH_SEPARATOR_S, 0);
+	for(iter = dirs; *iter != NULL; iter++) {
+		if( !**iter || !(dir = g_dir_open(*iter, 0, NULL)) )
+			continue;
+
+		while( (file = g_dir_read_name(dir)) ) {
+			const gchar *fs, *parser = NULL;
+			MkfsScript* existing;
+			gchar* helper = NULL;
+
+			if(!g_str_has_prefix(file, "mkfs."))
+				continue;
+
+			/* Same as the script's sed: everything after the last dot */
+			fs = strrchr(file, '.') + 1;
+			if(strlen(fs) <= 1)
+				continue;
+
+			/* mkfs takes the first one in $PATH, and so do we */
+			existing = g_hash_table_lookup(hash, fs);
+			if(existing && !strcmp(existing->path, script_path))
+				continue;
+
+			for(i=0; stock_parsers[i].fs != NULL; i++) {
+				if(!strcmp(stock_parsers[i].fs, fs))
+					parser = stock_parsers[i].parser;
+			}
+
+			/* "mkfs -t foo" runs mkfs.foo, not mkfs.bar.foo */
+			if(!strcmp(file + strlen("mkfs."), fs))
+				helper = g_build_filename(*iter, file, NULL);
+			if(helper && !g_file_test(helper, G_FILE_TEST_IS_EXECUTABLE)) {
+				g_free(helper);
+				helper = NULL;
+			}
+
+			add_mkfs_script(hash, fs, script_path, parser, helper);
+			g_free(helper);
+		}
+		g_dir_close(dir);
+	}
+	g_strfreev(dirs);
+}
+
 static gboolean
 add_supported_fs(const char* script_path, GHashTable* hash)
 {
 	gchar* cmd[] = {"", "--capabilities", NULL};
-	gchar *out, *err;
+	gchar *out = NULL, *err = NULL;
 	gint status;
-	cmd[0] = script_path;
+	cmd[0] = (gchar*)script_path;
 
 	if(!g_spawn_sync(NULL, cmd, NULL, 0, NULL, NULL, &out, &err, &status, NULL))
 		return FALSE;
 
+	g_free(err);
 	if(!out)
 		return FALSE;
 
 	/* Parse a list of supported filesystems in the format:
 	 *
-	 * ext2
+	 * ext2 mke2fs
 	 * reiserfs
 	 * etc... 
-	 */
+	 *
+	 * The second column is optional, and says which progress parser
+	 * understands the output we print for that filesystem */
 	gchar** split = g_strsplit(out, "\n", 0/*all tokens*/);
 	gchar** iter = split;
 	while(*iter != NULL) {
-		if(strlen(*iter) > 1) 	{
-			g_debug("Adding %s to %s", (*iter), script_path);
-			g_hash_table_insert(hash, g_strdup(iter[0]), g_strdup(script_path));
-		}
+		gchar** fields = g_strsplit_set(g_strstrip(*iter), " \t", 2);
+
+		if(fields[0] && strlen(fields[0]) > 1)
+			add_mkfs_script(hash, fields[0], script_path, (fields[1] ? g_strstrip(fields[1]) : NULL), NULL);
+
+		g_strfreev(fields);
 		iter++;
 	}
 	
+	g_strfreev(split);
+	g_free(out);
 	return TRUE;
 }
 
 static void g_free_cb(gpointer data) { if(data) g_free(data); }
 
+void
+mkfs_script_free(MkfsScript* script)
+{
+	g_free(script->path);
+	g_free(script->progress_parser);
+	g_free(script->helper);
+	g_free(script);
+}
+
 GHashTable* 
 build_supported_fs_list(void)
 {
-	GHashTable* hash = g_hash_table_new_full(g_str_hash, g_str_equal, g_free_cb, g_free_cb);
+	GHashTable* hash = g_hash_table_new_full(g_str_hash, g_str_equal, g_free_cb, (GDestroyNotify)mkfs_script_free);
+	GError* err = NULL;
+	gchar* stamp;
 	GDir* dir = g_dir_open(FORMAT_SCRIPT_DIR, 0, NULL);
 	if(!dir) {
 		g_error("Formatting scripts path '%s' doesn't exist!", FORMAT_SCRIPT_DIR);
 		return NULL;
 	}
 
+	/* Take the stamp before asking the scripts, so anything that changes
+	 * while we do just makes the next run ask again */
+	stamp = capability_cache_get_stamp(FORMAT_SCRIPT_DIR);
+	if(capability_cache_load(stamp, hash)) {
+		g_dir_close(dir);
+		g_free(stamp);
+		return hash;
+	}
+
 	gchar* path;
 	const gchar* file = g_dir_read_name(dir);
 	while(file != NULL) {
 		path = g_build_filename(FORMAT_SCRIPT_DIR, file, NULL);
 		g_debug("path = %s, file = %s, FORMAT_SCRIPT_DIR = %s", path, file, FORMAT_SCRIPT_DIR);
 
-		if(!add_supported_fs(path, hash))
+		if(!strcmp(file, "mkfs"))
+			add_stock_supported_fs(path, hash);
+		else if(!add_supported_fs(path, hash))
 			g_warning(_("Error in script: '%s'"), path);
 		g_free(path);
 
@@ -181,63 +513,156 @@ build_supported_fs_list(void)
 
 	g_debug("Filesystem list has %d entries", g_hash_table_size(hash));
 
+	if(!capability_cache_save(stamp, hash, &err)) {
+		g_warning("Couldn't save the capability cache: %s", err->message);
+		g_error_free(err);
+	}
+	g_free(stamp);
+
 	return hash;
 }
 
 
 /*
  * High-level format tasks
- *
- * There are a few conventions that these functions rely on to be a part of the
- * framework that keeps track of how many things there are left to do and show
- * correct info on the progress bar. First, they must all return immediately if 
- * an error is set (dialog->format_error). This makes the code clearer and 
- * makes it so we don't have to write ugly code to check the error all the time.
- * Next, they should enqueue the next operation to do via do_next_operation()
  */
 
+gboolean
+spawn_mkfs(const MkfsScript* script, const char* fs, const char* block_device, 
+	   ProcessLineFunc line_cb, GSourceFunc callback, gpointer user_data, GPid* pid)
+{
+	gchar* cmd[] = {script->path, "-t", (gchar*)fs, (gchar*)block_device, NULL};
+	gchar* helper_cmd[] = {script->helper, (gchar*)block_device, NULL};
+
+	/* Same thing the script would have done, minus three exec's */
+	if(script->helper) {
+		g_debug("mkfs command: %s %s", script->helper, block_device);
+		return spawn_async_get_output_full(helper_cmd, line_cb, callback, user_data, pid);
+	}
+
+	g_debug("mkfs command: %s -t %s %s", script->path, fs, block_device);
+	return spawn_async_get_output_full(cmd, line_cb, callback, user_data, pid);
+}
+
+
+/*
+ * The script formatter
+ */
+
+typedef struct {
+	FormatterRequest* req;
+	MkfsProgress* progress;
+	GPid pid;
+} ScriptRun;
+
+static void
+script_line_cb(const gchar* line, gboolean is_stderr, gpointer user_data)
+{
+	ScriptRun* run = user_data;
+	gdouble fraction;
+
+	g_debug("%s%s: %s", run->req->blockdev, (is_stderr ? " (stderr)" : ""), line);
+	if(run->progress && mkfs_progress_parse_line(run->progress, line, &fraction))
+		formatter_request_set_progress(run->req, fraction);
+}
+
 static gboolean
-mkfs_cb(gpointer data)
+script_done_cb(gpointer data)
 {
-	g_assert(data != NULL);
 	ProcessOutput* output = data;
-	FormatDialog* dialog = output->user_data;
-
-	g_debug("ret = %d, stdout = '%s', stderr = '%s'", output->ret, output->stdout_output, output->stderr_output);
-	if(output->ret != 0) {
-		/* FIXME: Make better error messages */
-		g_set_error(&dialog->format_error, 0, output->ret, _("Error creating filesystem"));
-		//g_debug("Output from script: '%s'", output->stderr_output);
-		handle_format_error(dialog);
-		return FALSE;
-	}
-	finish_operation(dialog);
+	ScriptRun* run = output->user_data;
+	FormatterRequest* req = run->req;
+
+	g_debug("%s: ret = %d, stdout = '%s', stderr = '%s'", req->blockdev,
+		output->ret, output->stdout_output, output->stderr_output);
+
+	/* FIXME: Make better error messages */
+	if(output->ret != 0)
+		g_set_error(&req->error, 0, output->ret, _("Error creating filesystem on %s"), req->blockdev);
 
+	if(run->progress)
+		mkfs_progress_free(run->progress);
+	g_free(run);
+	req->formatter_data = NULL;
+
+	process_output_free(output);
+	formatter_request_done(req);
 	return FALSE;
 }
 
-gboolean
-do_mkfs(FormatDialog* dialog, const char* block_device)
+static gboolean
+script_formatter_doformat(Formatter* this, FormatterRequest* req, GError** error)
 {
-	gchar *fs_name, *fs_flag;
-	const gchar* fs_script;
-
-	if(dialog->format_error)
-		return FALSE;
+	const MkfsScript* script = g_hash_table_lookup(this->priv, req->fs);
+	ScriptRun* run;
 
-	/* Figure out which script to run */
-	if( !(fs_name = get_fs_from_menu(dialog)) )
+	if(!script) {
+		g_set_error(error, 0, 0, _("Cannot run the formatting script for %s"), req->fs);
 		return FALSE;
+	}
 
-	fs_script = g_hash_table_lookup(dialog->fs_map, fs_name);
-	g_assert(fs_script != NULL); 	
-	fs_flag = g_strdup_printf("-t %s", fs_name); 	g_free(fs_name);
+	run = g_new0(ScriptRun, 1);
+	run->req = req;
+	run->progress = mkfs_progress_new(script->progress_parser);
 
-	gchar* cmd[] = {fs_script, fs_flag, block_device, NULL};
-	g_debug("mkfs command: %s %s %s", fs_script, fs_flag, block_device);
-	if(!spawn_async_get_output(cmd, mkfs_cb, dialog)) {
+	if(!spawn_mkfs(script, req->fs, req->blockdev, script_line_cb, script_done_cb, run, &run->pid)) {
+		if(run->progress)
+			mkfs_progress_free(run->progress);
+		g_free(run);
+		g_set_error(error, 0, 0, _("Cannot run the formatting script for %s"), req->fs);
 		return FALSE;
 	}
 
+	req->formatter_data = run;
 	return TRUE;
 }
+
+static void
+script_formatter_cancel(Formatter* this, FormatterRequest* req)
+{
+	ScriptRun* run = req->formatter_data;
+
+	/* The done callback still comes once it's gone */
+	if(run && kill(run->pid, SIGTERM) != 0 && errno != ESRCH)
+		g_warning("Couldn't stop mkfs (pid %d): %s", (int)run->pid, g_strerror(errno));
+}
+
+static void
+add_fs_name_cb(gpointer key, gpointer value, gpointer user_data)
+{
+	const char*** iter = user_data;
+
+	**iter = key;
+	(*iter)++;
+}
+
+static void
+script_formatter_unref(Formatter* this)
+{
+	g_free(this->available_fs_list);
+	g_hash_table_destroy(this->priv);
+}
+
+Formatter*
+script_formatter_new(void)
+{
+	const FormatterOps fops = { NULL, script_formatter_doformat, script_formatter_cancel, script_formatter_unref };
+	GHashTable* hash = build_supported_fs_list();
+	Formatter* ret;
+	const char** iter;
+
+	if(!hash)
+		return NULL;
+
+	ret = g_new0(Formatter, 1);
+	ret->name = "script";
+	ret->priv = hash;
+	ret->fops = fops;
+
+	/* The names belong to the hash table, which we keep */
+	ret->available_fs_list = g_new0(const char*, g_hash_table_size(hash) + 1);
+	iter = ret->available_fs_list;
+	g_hash_table_foreach(hash, add_fs_name_cb, &iter);
+
+	return ret;
+}
@@ -26,20 +26,46 @@
 #ifndef _FORMATTIFY_H
 #define _FORMATTIFY_H
 
-#include "format-dialog.h"
+#include <glib.h>
+
+#include "formatterbase.h"
 
 typedef struct _ProcessOutput
 {
 	GSourceFunc callback;
-	gchar* stdout_output;
+	gchar* stdout_output;		/* Only the last 64k of each */
 	gchar* stderr_output;
 	int ret;
 	gpointer user_data;
 } ProcessOutput;
 
+/* Called from the main loop for every line the child writes, as it writes
+ * it. The line isn't ours to keep */
+typedef void (*ProcessLineFunc) (const gchar* line, gboolean is_stderr, gpointer user_data);
+
+/* What build_supported_fs_list() maps each filesystem name to */
+typedef struct _MkfsScript
+{
+	gchar* path;
+	gchar* progress_parser;		/* See mkfs-progress.h; may be NULL */
+	gchar* helper;			/* The mkfs.<fs> the stock script would
+					   end up running; we run it ourselves
+					   if we know it. May be NULL */
+} MkfsScript;
+
+void mkfs_script_free(MkfsScript* script);
+
 gboolean spawn_async_get_output(gchar** argv, GSourceFunc callback, gpointer user_data);
+gboolean spawn_async_get_output_full(gchar** argv, ProcessLineFunc line_cb, GSourceFunc callback, gpointer user_data, GPid* pid);
 void process_output_free(ProcessOutput* obj);
 GHashTable* build_supported_fs_list(void);
-gboolean do_mkfs(FormatDialog* dialog, const char* block_device);
+
+/* Runs the script for fs on block_device; callback gets a ProcessOutput.
+ * pid may be NULL */
+gboolean spawn_mkfs(const MkfsScript* script, const char* fs, const char* block_device, 
+		    ProcessLineFunc line_cb, GSourceFunc callback, gpointer user_data, GPid* pid);
+
+/* Creates whatever build_supported_fs_list() finds, by running the scripts */
+Formatter* script_formatter_new(void);
 
 #endif
@@ -0,0 +1,475 @@
+/*
+ * fs-ext2.c - Create ext2, ext3 and ext4 filesystems with libext2fs
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gi18n.h>
+
+#ifdef HAVE_EXT2FS
+#include <et/com_err.h>
+#include <ext2fs/ext2_fs.h>
+#include <ext2fs/ext2fs.h>
+#include <uuid/uuid.h>
+#endif
+
+#include "fs-ext2.h"
+
+#ifdef HAVE_EXT2FS
+
+/* This is mke2fs boiled down to what we need, with mke2fs's defaults. The
+ * slow part of mke2fs is zeroing the inode tables and the journal; on ext4
+ * we leave both to the kernel, which zeroes the inode tables in the
+ * background after the first mount (that's what uninit_bg is for). ext2 and
+ * ext3 have to have their tables zeroed now, but libext2fs does that in
+ * large batches rather than a block at a time */
+
+#define MiB 			(G_GUINT64_CONSTANT(1) << 20)
+
+/* mke2fs's "small" filesystem type */
+#define EXTFS_SMALL_SIZE 	(512 * MiB)
+#define EXTFS_SMALL_BLOCKSIZE 	1024
+#define EXTFS_SMALL_INODE_RATIO	4096
+#define EXTFS_BLOCKSIZE 	4096
+#define EXTFS_INODE_RATIO 	16384
+#define EXTFS_INODE_SIZE 	256
+#define EXTFS_RESERVED_PERCENT 	5
+#define EXTFS_LOG_GROUPS_PER_FLEX 4
+#define EXTFS_LOST_FOUND_SIZE 	(16 * 1024)
+
+/* How the progress bar is split up */
+#define PROGRESS_TABLES 	0.05
+#define PROGRESS_JOURNAL 	0.85
+#define PROGRESS_CLOSE 		0.95
+
+typedef struct {
+	ExtfsProgressFunc cb;
+	gpointer user_data;
+} ExtfsProgress;
+
+static const struct {
+	const gchar* fs;
+	guint32 compat, incompat, ro_compat;
+} feature_sets[] = {
+	{ "ext2",
+	  EXT2_FEATURE_COMPAT_EXT_ATTR | EXT2_FEATURE_COMPAT_RESIZE_INODE | EXT2_FEATURE_COMPAT_DIR_INDEX,
+	  EXT2_FEATURE_INCOMPAT_FILETYPE,
+	  EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | EXT2_FEATURE_RO_COMPAT_LARGE_FILE },
+	{ "ext3",
+	  EXT2_FEATURE_COMPAT_EXT_ATTR | EXT2_FEATURE_COMPAT_RESIZE_INODE | EXT2_FEATURE_COMPAT_DIR_INDEX |
+		EXT3_FEATURE_COMPAT_HAS_JOURNAL,
+	  EXT2_FEATURE_INCOMPAT_FILETYPE,
+	  EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | EXT2_FEATURE_RO_COMPAT_LARGE_FILE },
+	{ "ext4",
+	  EXT2_FEATURE_COMPAT_EXT_ATTR | EXT2_FEATURE_COMPAT_RESIZE_INODE | EXT2_FEATURE_COMPAT_DIR_INDEX |
+		EXT3_FEATURE_COMPAT_HAS_JOURNAL,
+	  EXT2_FEATURE_INCOMPAT_FILETYPE | EXT3_FEATURE_INCOMPAT_EXTENTS | EXT4_FEATURE_INCOMPAT_FLEX_BG,
+	  EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | EXT2_FEATURE_RO_COMPAT_LARGE_FILE |
+		EXT4_FEATURE_RO_COMPAT_HUGE_FILE | EXT4_FEATURE_RO_COMPAT_GDT_CSUM |
+		EXT4_FEATURE_RO_COMPAT_DIR_NLINK | EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE },
+	{ NULL, 0, 0, 0 },
+};
+
+
+/*
+ * Utility Functions
+ */
+
+/* Returns FALSE if we're to stop */
+static gboolean
+report(ExtfsProgress* progress, gdouble fraction)
+{
+	return (progress->cb ? progress->cb(fraction, progress->user_data) : TRUE);
+}
+
+static int
+get_feature_set(const char* fs)
+{
+	int i;
+
+	for(i=0; fs && feature_sets[i].fs != NULL; i++) {
+		if(!strcmp(feature_sets[i].fs, fs))
+			return i;
+	}
+	return -1;
+}
+
+static gboolean
+set_error(GError** error, errcode_t err, const char* what, const char* device)
+{
+	g_set_error(error, 0, 0, _("Cannot create filesystem on %s: %s (%s)"), device, what, error_message(err));
+	return FALSE;
+}
+
+static void
+fill_params(struct ext2_super_block* param, int set, guint64 size)
+{
+	gboolean small = (size < EXTFS_SMALL_SIZE);
+	guint block_size = (small ? EXTFS_SMALL_BLOCKSIZE : EXTFS_BLOCKSIZE);
+	guint64 blocks = size / block_size;
+
+	memset(param, 0, sizeof(struct ext2_super_block));
+	param->s_rev_level = EXT2_DYNAMIC_REV;
+	param->s_log_block_size = g_bit_nth_msf(block_size, -1) - EXT2_MIN_BLOCK_LOG_SIZE;
+	param->s_inode_size = EXTFS_INODE_SIZE;
+	param->s_feature_compat = feature_sets[set].compat;
+	param->s_feature_incompat = feature_sets[set].incompat;
+	param->s_feature_ro_compat = feature_sets[set].ro_compat;
+
+	/* Past 2^32 blocks, only ext4 with 64-bit block numbers will do, and
+	 * the resize inode can't cope with those */
+	if(blocks > G_MAXUINT32 && (param->s_feature_incompat & EXT3_FEATURE_INCOMPAT_EXTENTS)) {
+		param->s_feature_incompat |= EXT4_FEATURE_INCOMPAT_64BIT;
+		param->s_feature_compat &= ~EXT2_FEATURE_COMPAT_RESIZE_INODE;
+	}
+
+	ext2fs_blocks_count_set(param, blocks);
+	ext2fs_r_blocks_count_set(param, blocks * EXTFS_RESERVED_PERCENT / 100);
+	param->s_inodes_count = (guint32)MIN(size / (small ? EXTFS_SMALL_INODE_RATIO : EXTFS_INODE_RATIO), G_MAXUINT32);
+
+	if(param->s_feature_incompat & EXT4_FEATURE_INCOMPAT_FLEX_BG)
+		param->s_log_groups_per_flex = EXTFS_LOG_GROUPS_PER_FLEX;
+	if(param->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE) {
+		param->s_min_extra_isize = sizeof(struct ext2_inode_large) - EXT2_GOOD_OLD_INODE_SIZE;
+		param->s_want_extra_isize = param->s_min_extra_isize;
+	}
+}
+
+static errcode_t
+write_inode_tables(ext2_filsys fs, gboolean lazy, ExtfsProgress* progress)
+{
+	errcode_t err;
+	blk64_t blk;
+	dgrp_t i;
+	int num;
+
+	for(i=0; i < fs->group_desc_count; i++) {
+		blk = ext2fs_inode_table_loc(fs, i);
+		num = fs->inode_blocks_per_group;
+
+		/* The kernel zeroes what's left in the background, as long
+		 * as we don't set INODE_ZEROED. The reserved inodes are in
+		 * the first group, and those we do have to clear */
+		if(lazy)
+			num = (i > 0 ? 0 : (int)((EXT2_FIRST_INODE(fs->super) * EXT2_INODE_SIZE(fs->super) + 
+						  fs->blocksize - 1) / fs->blocksize));
+		else
+			ext2fs_bg_flags_set(fs, i, EXT2_BG_INODE_ZEROED);
+		ext2fs_group_desc_csum_set(fs, i);
+
+		if(num > 0 && (err = ext2fs_zero_blocks2(fs, blk, num, &blk, &num)) )
+			return err;
+
+		if(!lazy && !report(progress, PROGRESS_TABLES + 
+				    (PROGRESS_JOURNAL - PROGRESS_TABLES) * (i + 1) / fs->group_desc_count))
+			return EXT2_ET_CANCEL_REQUESTED;
+	}
+
+	/* Lets ext2fs_zero_blocks2 free its buffer */
+	ext2fs_zero_blocks2(NULL, 0, 0, NULL, NULL);
+	return 0;
+}
+
+/* Takes the blocks bad_extents touches out of the free space before the
+ * group tables get placed, and lists them for the bad blocks inode */
+static gboolean
+mark_bad_blocks(ext2_filsys fs, const ExtentList* bad_extents, ext2_badblocks_list list,
+		const char* device, GError** error)
+{
+	blk64_t blk, last, count = ext2fs_blocks_count(fs->super);
+	errcode_t err;
+	guint i;
+
+	for(i=0; i < bad_extents->extents->len; i++) {
+		const Extent* extent = &g_array_index(bad_extents->extents, Extent, i);
+
+		last = MIN((extent->start + extent->len - 1) / fs->blocksize, count - 1);
+		for(blk = extent->start / fs->blocksize; blk <= last; blk++) {
+			if(blk > G_MAXUINT32) {
+				g_set_error(error, 0, 0, _("Cannot create filesystem on %s: block %llu is bad, and the bad blocks list stops at block %u"),
+					    device, (unsigned long long)blk, G_MAXUINT32);
+				return FALSE;
+			}
+
+			/* Two bad extents can share a block */
+			if(ext2fs_badblocks_list_test(list, (blk_t)blk))
+				continue;
+
+			/* The superblocks and group descriptors have nowhere
+			 * else to go */
+			if(ext2fs_test_block_bitmap2(fs->block_map, blk)) {
+				g_set_error(error, 0, 0, _("Cannot create filesystem on %s: block %llu is bad, and the superblock has to go there"),
+					    device, (unsigned long long)blk);
+				return FALSE;
+			}
+
+			if( (err = ext2fs_badblocks_list_add(list, (blk_t)blk)) )
+				return set_error(error, err, _("Cannot list the bad blocks"), device);
+			ext2fs_block_alloc_stats2(fs, blk, +1);
+		}
+	}
+
+	return TRUE;
+}
+
+static errcode_t
+create_directories(ext2_filsys fs, ext2_badblocks_list bad_blocks)
+{
+	ext2_ino_t ino;
+	errcode_t err;
+	guint size;
+	int i;
+
+	if( (err = ext2fs_mkdir(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, 0)) )
+		return err;
+	if( (err = ext2fs_mkdir(fs, EXT2_ROOT_INO, 0, "lost+found")) )
+		return err;
+	if( (err = ext2fs_lookup(fs, EXT2_ROOT_INO, "lost+found", strlen("lost+found"), 0, &ino)) )
+		return err;
+
+	/* e2fsck wants some room in lost+found without having to allocate */
+	for(i=1, size=fs->blocksize; i < EXT2_NDIR_BLOCKS && size < EXTFS_LOST_FOUND_SIZE; i++, size += fs->blocksize) {
+		if( (err = ext2fs_expand_dir(fs, ino)) )
+			return err;
+	}
+
+	/* Everything below the first normal inode belongs to the fs */
+	for(ino = EXT2_ROOT_INO + 1; ino < EXT2_FIRST_INODE(fs->super); ino++)
+		ext2fs_inode_alloc_stats2(fs, ino, +1, 0);
+	ext2fs_mark_ib_dirty(fs);
+
+	/* The bad blocks list, empty unless we were given some */
+	ext2fs_mark_inode_bitmap2(fs->inode_map, EXT2_BAD_INO);
+	ext2fs_inode_alloc_stats2(fs, EXT2_BAD_INO, +1, 0);
+	return ext2fs_update_bb_inode(fs, bad_blocks);
+}
+
+static errcode_t
+create_journal(ext2_filsys fs)
+{
+	int blocks = ext2fs_default_journal_size(ext2fs_blocks_count(fs->super));
+	int flags = 0;
+
+	/* Like mke2fs, a filesystem too small for a journal just goes
+	 * without one */
+	if(blocks < 0) {
+		g_debug("Too small for a journal, leaving it out");
+		fs->super->s_feature_compat &= ~EXT3_FEATURE_COMPAT_HAS_JOURNAL;
+		return 0;
+	}
+
+#ifdef EXT2_MKJOURNAL_LAZYINIT
+	/* A new journal is only read back after a crash, by which time
+	 * it'll have a valid transaction in it; no need to zero it first */
+	flags |= EXT2_MKJOURNAL_LAZYINIT;
+#endif
+
+	return ext2fs_add_journal_inode(fs, blocks, flags);
+}
+
+#endif
+
+
+/*
+ * Public functions
+ */
+
+gboolean
+extfs_can_format(const char* fs)
+{
+#ifdef HAVE_EXT2FS
+	return (get_feature_set(fs) >= 0);
+#else
+	return FALSE;
+#endif
+}
+
+gboolean
+extfs_format(const char* device, const char* fs, const char* label, const ExtentList* bad_extents,
+	     ExtfsProgressFunc progress_cb, gpointer user_data, GError** error)
+{
+#ifdef HAVE_EXT2FS
+	ExtfsProgress progress = { progress_cb, user_data };
+	struct ext2_super_block param;
+	ext2_filsys filesys = NULL;
+	ext2_badblocks_list bad_blocks = NULL;
+	blk64_t size;
+	gboolean lazy, ret = FALSE;
+	errcode_t err;
+	int set;
+
+	if( (set = get_feature_set(fs)) < 0 ) {
+		g_set_error(error, 0, 0, _("Cannot create a %s filesystem"), fs);
+		return FALSE;
+	}
+
+	/* ext2fs_get_device_size2 wants a block size to count in */
+	if( (err = ext2fs_get_device_size2(device, 1, &size)) )
+		return set_error(error, err, _("Cannot read the size"), device);
+
+	fill_params(&param, set, size);
+	if(!report(&progress, 0.0))
+		return set_error(error, EXT2_ET_CANCEL_REQUESTED, _("Cannot create the filesystem"), device);
+
+	err = ext2fs_initialize(device, EXT2_FLAG_EXCLUSIVE | EXT2_FLAG_64BITS, &param, unix_io_manager, &filesys);
+	if(err)
+		return set_error(error, err, _("Cannot set up the superblock"), device);
+
+	if(label)
+		strncpy((char*)filesys->super->s_volume_name, label, sizeof(filesys->super->s_volume_name));
+	uuid_generate(filesys->super->s_uuid);
+	uuid_generate((unsigned char*)filesys->super->s_hash_seed);
+	filesys->super->s_def_hash_version = EXT2_HASH_HALF_MD4;
+	filesys->super->s_max_mnt_count = -1;
+
+	/* Only ext4 can leave its inode tables for later */
+	lazy = ext2fs_has_group_desc_csum(filesys);
+
+	if(bad_extents && extent_list_get_total(bad_extents) > 0) {
+		if( (err = ext2fs_badblocks_list_create(&bad_blocks, 0)) ) {
+			set_error(error, err, _("Cannot list the bad blocks"), device);
+			goto out;
+		}
+		if(!mark_bad_blocks(filesys, bad_extents, bad_blocks, device, error))
+			goto out;
+	}
+
+	if( (err = ext2fs_allocate_tables(filesys)) ) {
+		set_error(error, err, _("Cannot allocate the group tables"), device);
+		goto out;
+	}
+	if(!report(&progress, PROGRESS_TABLES)) {
+		err = EXT2_ET_CANCEL_REQUESTED;
+		set_error(error, err, _("Cannot write the inode tables"), device);
+		goto out;
+	}
+
+	if( (err = write_inode_tables(filesys, lazy, &progress)) ) {
+		set_error(error, err, _("Cannot write the inode tables"), device);
+		goto out;
+	}
+
+	if( (err = create_directories(filesys, bad_blocks)) ) {
+		set_error(error, err, _("Cannot create the root directory"), device);
+		goto out;
+	}
+
+	if( (filesys->super->s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INODE) &&
+	    (err = ext2fs_create_resize_inode(filesys)) ) {
+		set_error(error, err, _("Cannot reserve room to grow"), device);
+		goto out;
+	}
+	if(!report(&progress, PROGRESS_JOURNAL)) {
+		err = EXT2_ET_CANCEL_REQUESTED;
+		set_error(error, err, _("Cannot create the journal"), device);
+		goto out;
+	}
+
+	if( (filesys->super->s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL) &&
+	    (err = create_journal(filesys)) ) {
+		set_error(error, err, _("Cannot create the journal"), device);
+		goto out;
+	}
+	if(!report(&progress, PROGRESS_CLOSE)) {
+		err = EXT2_ET_CANCEL_REQUESTED;
+		set_error(error, err, _("Cannot write the superblocks"), device);
+		goto out;
+	}
+
+	/* This writes out the superblocks, group descriptors and bitmaps,
+	 * and frees the filesystem if it works */
+	if( (err = ext2fs_close(filesys)) ) {
+		set_error(error, err, _("Cannot write the superblocks"), device);
+		goto out;
+	}
+	filesys = NULL;
+	report(&progress, 1.0);
+	ret = TRUE;
+
+out:
+	if(bad_blocks)
+		ext2fs_badblocks_list_free(bad_blocks);
+	if(filesys)
+		ext2fs_free(filesys);
+	return ret;
+#else
+	g_set_error(error, 0, 0, _("Cannot create a %s filesystem"), fs);
+	return FALSE;
+#endif
+}
+
+#ifdef HAVE_EXT2FS
+
+static gboolean
+extfs_formatter_progress(gdouble fraction, gpointer user_data)
+{
+	FormatterRequest* req = user_data;
+
+	formatter_request_set_progress(req, fraction);
+	return !formatter_request_is_cancelled(req);
+}
+
+static gboolean
+extfs_formatter_run(FormatterRequest* req, GError** error)
+{
+	return extfs_format(req->blockdev, req->fs, formatter_request_get_option(req, "label"),
+			    req->bad_extents, extfs_formatter_progress, req, error);
+}
+
+static gboolean
+extfs_formatter_doformat(Formatter* this, FormatterRequest* req, GError** error)
+{
+	return formatter_request_run_blocking(req, extfs_formatter_run, error);
+}
+
+static gboolean
+extfs_formatter_canformat(Formatter* this, const char* fs)
+{
+	return extfs_can_format(fs);
+}
+
+#endif
+
+Formatter*
+extfs_formatter_new(void)
+{
+#ifdef HAVE_EXT2FS
+	static const char* fs_list[] = { "ext2", "ext3", "ext4", NULL };
+	const FormatterOps fops = { extfs_formatter_canformat, extfs_formatter_doformat, NULL, NULL };
+	Formatter* ret = g_new0(Formatter, 1);
+
+	ret->name = "libext2fs";
+	ret->available_fs_list = fs_list;
+	ret->fops = fops;
+	ret->flags = FORMATTER_AVOIDS_BAD_EXTENTS;
+	return ret;
+#else
+	return NULL;
+#endif
+}
@@ -0,0 +1,53 @@
+/*
+ * fs-ext2.h - Create ext2, ext3 and ext4 filesystems with libext2fs
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef _FS_EXT2_H
+#define _FS_EXT2_H
+
+#include <glib.h>
+
+#include "extent-list.h"
+#include "formatterbase.h"
+
+/* Gets called from whatever thread extfs_format() is running on; returning
+ * FALSE stops it */
+typedef gboolean (*ExtfsProgressFunc) (gdouble fraction, gpointer user_data);
+
+/* Whether fs is something we can make without mke2fs; always FALSE when we
+ * weren't built with libext2fs */
+gboolean extfs_can_format(const char* fs);
+
+/* Writes an empty ext2, ext3 or ext4 filesystem over all of device; label
+ * may be NULL. Nothing goes on the byte ranges in bad_extents (NULL for
+ * none), which end up in the bad blocks inode. This blocks, and leaves the
+ * flushing to the caller */
+gboolean extfs_format(const char* device, const char* fs, const char* label, const ExtentList* bad_extents,
+		      ExtfsProgressFunc progress_cb, gpointer user_data, GError** error);
+
+/* Does the above for formatters_find(); NULL when we weren't built with
+ * libext2fs */
+Formatter* extfs_formatter_new(void);
+
+#endif
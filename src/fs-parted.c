@@ -22,6 +22,10 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
 #include <stdio.h>
 #include <string.h>
 
@@ -34,32 +38,29 @@
 #include "formatterbase.h"
 #include "fs-parted.h"
 
+/* libparted lost the ability to create filesystems in 3.0, so this is only
+ * here for the filesystems an older one can make and nobody else can */
+
+#ifdef HAVE_PED_FILE_SYSTEM_CREATE
+
 #define error_wrap(exp, err)  do { parted_clear_lasterr(); \
 				   (exp); \
-				   if(err && parted_get_lasterr()) \
-					*err = g_error_new(0, -1, parted_get_lasterr()); \
+				   if(parted_get_lasterr()) \
+					g_set_error(err, 0, 0, "%s", parted_get_lasterr()); \
 				 } while(0)
 
-/*
- * Structs
- */
-
-typedef struct {
-        time_t last_update;
-        time_t predicted_time_left;
-} TimerContext;
-                   
-static TimerContext timer_context;
+#define PARTED_MAX_FS 		128
 
 
 /*
  * Utility Functions
  */
 
+/* Only touched with the parted lock held */
 static gchar *ped_lasterr = NULL;
 
 static void
-parted_clear_lasterr(void) { if(ped_lasterr)		g_free(ped_lasterr); }
+parted_clear_lasterr(void) { g_free(ped_lasterr); 	ped_lasterr = NULL; }
 
 static const gchar*
 parted_get_lasterr(void) { return (const gchar*)ped_lasterr; }
@@ -87,35 +88,40 @@ parted_exception_handler(PedException* ex)
 	return PED_EXCEPTION_UNHANDLED;
 }
 
+static void
+timer_handler(PedTimer* timer, void* ctx)
+{
+	formatter_request_set_progress(ctx, timer->frac);
+}
+
 static gboolean 
-parted_formatter_doformat(Formatter* this, 
-			  const char* blockdev, 
-			  const char* fs, 
-			  int partition_number,
-			  GHashTable* options, 
-			  GError** error)
+parted_create_fs(FormatterRequest* req, GError** error)
 {
 	PedDevice* dev;
-        PedDisk* disk;
+        PedDisk* disk = NULL;
 	PedGeometry fs_geometry;
 	PedPartition *part = NULL;
 	const PedFileSystemType* fs_type = NULL;
+	PedFileSystem* pfs;
+	PedTimer* timer;
 	gboolean ret = FALSE;
 
-        error_wrap( dev = ped_device_get(blockdev), error );
+        error_wrap( dev = ped_device_get(req->blockdev), error );
         if (!dev) 	goto out;
 
-	error_wrap( disk = ped_disk_new(dev), error );
-        if (!disk) 	goto out;
+	error_wrap( fs_type = ped_file_system_type_get (req->fs), error );
+	if (!fs_type)	goto out;
 
-	error_wrap( fs_type = ped_file_system_type_get (fs), error );
-	g_assert(fs_type != NULL);
-	if (!fs_type)	goto out_destroy_disk;
+	if(req->partition_number != FORMATTER_DONT_SET_PARTITION) {
+		error_wrap( disk = ped_disk_new(dev), error );
+		if (!disk) 	goto out;
 
-	if(partition_number != FORMATTER_DONT_SET_PARTITION) {
-		/* XXX: Do we have to free this? It appears to be part of the
-		 * disk */
-		part = ped_disk_get_partition (disk, partition_number);
+		/* This is part of the disk, so it goes when the disk does */
+		if( !(part = ped_disk_get_partition (disk, req->partition_number)) ) {
+			g_set_error(error, 0, 0, _("Cannot find partition %d on %s"), 
+				    req->partition_number, req->blockdev);
+			goto out_destroy_disk;
+		}
 		memcpy(&fs_geometry, &part->geom, sizeof(PedGeometry));
 	}
 	else {
@@ -126,37 +132,60 @@ parted_formatter_doformat(Formatter* this,
 		fs_geometry.start = 0;	fs_geometry.end = dev->length - 1;
 	}
 
-	/* Actually do the format here */
-	/* We don't care about the timer because creating filesystems takes a
-	 * trivial amount of time */
-	PedFileSystem* pfs;
-	formatter_client_set_text(this, _("Creating file system"));
-	formatter_client_set_progress(this, 0.33);
-	error_wrap( pfs = ped_file_system_create (&fs_geometry, fs_type, NULL), error );
+	/* Actually do the format here. libparted can't be interrupted, so
+	 * a cancel only takes effect once it's done */
+	timer = ped_timer_new(timer_handler, req);
+	error_wrap( pfs = ped_file_system_create (&fs_geometry, fs_type, timer), error );
+	ped_timer_destroy(timer);
 	if (!pfs) 	goto out_destroy_disk;
 	ped_file_system_close (pfs);         
 
 	/* Fix the partition table */
 	ret = TRUE;
-	formatter_client_set_text(this, _("Setting partition table"));
-	formatter_client_set_progress(this, 0.66);
-	if(partition_number != FORMATTER_DONT_SET_PARTITION)
-		error_wrap( ret = (gboolean)ped_partition_set_system (part, fs_type), error );
-
-	formatter_client_set_progress(this, 1.0);
+	if(part) {
+		error_wrap( ret = (ped_partition_set_system (part, fs_type) && ped_disk_commit (disk)), error );
+	}
 
         out_destroy_disk:
-                ped_disk_destroy (disk);
+		if (disk)
+			ped_disk_destroy (disk);
         out:
                 return ret;
 }
 
+static gboolean
+parted_formatter_run(FormatterRequest* req, GError** error)
+{
+	PedExceptionHandler* old_handler;
+	gboolean ret;
+
+	/* Our handler is only for our calls; everyone else in here gets
+	 * whatever they had */
+	G_LOCK(parted);
+	old_handler = ped_exception_get_handler();
+	ped_exception_set_handler(parted_exception_handler);
+	ret = parted_create_fs(req, error);
+	ped_exception_set_handler(old_handler);
+	parted_clear_lasterr();
+	G_UNLOCK(parted);
+
+	return ret;
+}
+
+static gboolean
+parted_formatter_doformat(Formatter* this, FormatterRequest* req, GError** error)
+{
+	return formatter_request_run_blocking(req, parted_formatter_run, error);
+}
+
 static void 
 parted_formatter_unref(Formatter* this)
 {
 	g_free(this->available_fs_list);
 }
 
+#endif
+
 
 /*
  * Public Functions
@@ -165,19 +194,21 @@ parted_formatter_unref(Formatter* this)
 Formatter*
 parted_formatter_init(void)
 {
-	/* FIXME: There's got to be a less sloppy way to do this */
-	const char* fs_list[128];
+#ifdef HAVE_PED_FILE_SYSTEM_CREATE
+	const char* fs_list[PARTED_MAX_FS];
 	int fs_list_count = 0;
-	Formatter* ret = g_new0(Formatter, 1);
-	const FormatterOps fops = { NULL /*parted_formatter_canformat*/, parted_formatter_doformat, parted_formatter_unref};
+	const FormatterOps fops = { NULL, parted_formatter_doformat, NULL, parted_formatter_unref };
+	PedFileSystemType* iter;
+	Formatter* ret;
 
 	/* Note: This isn't documented in the libparted refs; to get the first 
 	 * filesystem in the list of supported filesystems, you pass NULL as 
 	 * the param to this function */
-	PedFileSystemType* iter = ped_file_system_type_get_next(NULL);
+	G_LOCK(parted);
+	iter = ped_file_system_type_get_next(NULL);
 
 	/* Figure out the list of supported filesystems */
-	while(iter != NULL) {
+	while(iter != NULL && fs_list_count < PARTED_MAX_FS) {
 		/* FIXME: It probably isn't kosher to go poking around in
 		 * this structure, but there's no better way to do it */
 		if(iter->ops->create) {
@@ -186,50 +217,20 @@ parted_formatter_init(void)
 		}
 		iter = ped_file_system_type_get_next(iter);
 	}
+	G_UNLOCK(parted);
 
 	if(fs_list_count == 0)
 		return NULL;
 
 	/* Initialize the formatter */
-	ped_exception_set_handler(parted_exception_handler);
+	ret = g_new0(Formatter, 1);
+	ret->name = "libparted";
 	ret->available_fs_list = (const char**)g_new0(char*, fs_list_count + 1);
 	memcpy(ret->available_fs_list, fs_list, sizeof(char*) * fs_list_count);
 	ret->fops = fops;
 
 	return ret;
-}
-
-static void
-timer_handler (PedTimer *timer, void *ctx)
-{
-#if 0
-        int draw_this_time;
-        TimerContext* tctx = (TimerContext*) ctx;
-
-        if (tctx->last_update != timer->now && timer->now > timer->start)
-        {
-	        tctx->predicted_time_left = timer->predicted_end - timer->now;
-	        tctx->last_update = timer->now;
-	        draw_this_time = 1;
-        }
-        else
-	        draw_this_time = 0;
-
-        if (draw_this_time)
-        {
-                printf("\r                                                            \r");
-	if (timer->state_name)
-                printf("%s... ", timer->state_name);
-	
-        printf("%0.f%%\t(time left %.2ld:%.2ld)",
-		100.0 * timer->frac,
-		tctx->predicted_time_left / 60,
-		tctx->predicted_time_left % 60);
-
-	fflush(stdout);
-    }
+#else
+	return NULL;
 #endif
-        fprintf(stdout, ".\n");
-        fflush(stdout);
 }
- 
@@ -0,0 +1,509 @@
+/*
+ * fs-vfat.c - Create FAT16 and FAT32 filesystems ourselves
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gi18n.h>
+
+#include "blockdev.h"
+#include "fs-vfat.h"
+
+/* An empty FAT filesystem is nothing but metadata at the front of the
+ * device: the reserved sectors (boot sector, and on FAT32 the FSInfo sector
+ * and backups of both), the FATs, and the root directory. We lay all of that
+ * out in memory a chunk at a time and write each chunk in one go, instead of
+ * the many small writes mkfs.vfat does. The numbers follow Microsoft's FAT
+ * specification (fatgen103) */
+
+#define MiB 			(G_GUINT64_CONSTANT(1) << 20)
+#define GiB 			(G_GUINT64_CONSTANT(1) << 30)
+
+#define VFAT_NUM_FATS 		2
+#define VFAT_MEDIA 		0xF8
+#define VFAT_FAT16_ROOT_ENTRIES 512
+#define VFAT_FAT16_RESERVED 	1
+#define VFAT_FAT32_RESERVED 	32
+#define VFAT_FSINFO_SECTOR 	1
+#define VFAT_BACKUP_SECTOR 	6
+#define VFAT_DIR_ENTRY_SIZE 	32
+#define VFAT_WRITE_CHUNK 	(1024 * 1024)
+
+/* What goes in the FAT for a cluster nobody should use */
+#define FAT16_BAD_CLUSTER 	0xFFF7
+#define FAT32_BAD_CLUSTER 	0x0FFFFFF7
+
+/* Anything with fewer clusters than these is a FAT12 or a FAT16, as far as
+ * everyone else is concerned */
+#define FAT16_MIN_CLUSTERS 	4085
+#define FAT32_MIN_CLUSTERS 	65525
+
+/* Windows formats anything this big or bigger as FAT32 */
+#define FAT32_MIN_SIZE 		(512 * MiB)
+
+typedef struct {
+	gboolean fat32;
+	guint sector_size;
+	guint64 total_sectors;
+	guint32 sectors_per_cluster;
+	guint32 reserved_sectors;
+	guint32 root_dir_sectors;
+	guint32 fat_sectors;
+	guint32 clusters;
+	guint32 hidden_sectors;
+} VfatGeometry;
+
+/* Cluster sizes by volume size, from the spec's tables */
+static const struct {
+	guint64 max_size;
+	guint32 cluster_size;
+} fat16_cluster_sizes[] = {
+	{ 16 * MiB, 		1024 },
+	{ 128 * MiB, 		2048 },
+	{ 256 * MiB, 		4096 },
+	{ 512 * MiB, 		8192 },
+	{ 0, 0 },
+}, fat32_cluster_sizes[] = {
+	{ 260 * MiB, 		512 },
+	{ 8 * GiB, 		4096 },
+	{ 16 * GiB, 		8192 },
+	{ 32 * GiB, 		16384 },
+	{ G_MAXUINT64, 		32768 },
+	{ 0, 0 },
+};
+
+
+/*
+ * Utility Functions
+ */
+
+static void
+put_le16(guchar* p, guint16 val)
+{
+	p[0] = val & 0xFF; 		p[1] = (val >> 8) & 0xFF;
+}
+
+static void
+put_le32(guchar* p, guint32 val)
+{
+	put_le16(p, val & 0xFFFF); 	put_le16(p + 2, (val >> 16) & 0xFFFF);
+}
+
+static guint32
+get_cluster_size(gboolean fat32, guint64 size)
+{
+	int i;
+
+	if(fat32) {
+		for(i=0; fat32_cluster_sizes[i].max_size && size > fat32_cluster_sizes[i].max_size; i++);
+		return fat32_cluster_sizes[i].cluster_size;
+	}
+
+	for(i=0; fat16_cluster_sizes[i+1].max_size && size > fat16_cluster_sizes[i].max_size; i++);
+	return fat16_cluster_sizes[i].cluster_size;
+}
+
+static gboolean
+compute_geometry(VfatGeometry* geo, guint64 size, guint sector_size, guint64 start, GError** error)
+{
+	guint32 entry_size, fat_needed;
+	guint64 data_sectors, meta_sectors, pad;
+
+	memset(geo, 0, sizeof(VfatGeometry));
+	geo->fat32 = (size >= FAT32_MIN_SIZE);
+	geo->sector_size = sector_size;
+	geo->total_sectors = size / sector_size;
+	geo->hidden_sectors = (guint32)(start * 512 / sector_size);
+	geo->sectors_per_cluster = MAX(1, get_cluster_size(geo->fat32, size) / sector_size);
+	entry_size = (geo->fat32 ? 4 : 2);
+
+	if(geo->total_sectors > G_MAXUINT32) {
+		g_set_error(error, 0, 0, _("Device is too large for a FAT filesystem"));
+		return FALSE;
+	}
+
+	/* A FAT16 can hold 65524 clusters at most; if the table's cluster
+	 * size gives us more, go up a size */
+	for(;;) {
+		geo->reserved_sectors = (geo->fat32 ? VFAT_FAT32_RESERVED : VFAT_FAT16_RESERVED);
+		geo->root_dir_sectors = (geo->fat32 ? 0 : 
+			(VFAT_FAT16_ROOT_ENTRIES * VFAT_DIR_ENTRY_SIZE + sector_size - 1) / sector_size);
+
+		/* The FAT has to cover the clusters that are left after the
+		 * FAT itself; start small and grow it until it does */
+		geo->fat_sectors = 1;
+		for(;;) {
+			meta_sectors = geo->reserved_sectors + geo->root_dir_sectors + 
+				       (guint64)VFAT_NUM_FATS * geo->fat_sectors;
+			if(meta_sectors >= geo->total_sectors) {
+				g_set_error(error, 0, 0, _("Device is too small for a FAT filesystem"));
+				return FALSE;
+			}
+
+			data_sectors = geo->total_sectors - meta_sectors;
+			geo->clusters = (guint32)(data_sectors / geo->sectors_per_cluster);
+			fat_needed = (guint32)((((guint64)geo->clusters + 2) * entry_size + sector_size - 1) / sector_size);
+			if(fat_needed <= geo->fat_sectors)
+				break;
+			geo->fat_sectors = fat_needed;
+		}
+
+		/* Start the data on a cluster boundary; flash gets slow if
+		 * every cluster straddles two of its pages */
+		pad = (geo->sectors_per_cluster - meta_sectors % geo->sectors_per_cluster) % geo->sectors_per_cluster;
+		geo->reserved_sectors += (guint32)pad;
+		geo->clusters = (guint32)((geo->total_sectors - meta_sectors - pad) / geo->sectors_per_cluster);
+
+		if(geo->fat32 || geo->clusters < FAT32_MIN_CLUSTERS || geo->sectors_per_cluster >= 128)
+			break;
+		geo->sectors_per_cluster *= 2;
+	}
+
+	if( (geo->fat32 && geo->clusters < FAT32_MIN_CLUSTERS) ||
+	    (!geo->fat32 && (geo->clusters < FAT16_MIN_CLUSTERS || geo->clusters >= FAT32_MIN_CLUSTERS)) ) {
+		g_set_error(error, 0, 0, _("Device is too small for a FAT filesystem"));
+		return FALSE;
+	}
+
+	g_debug("FAT%d: %u-byte sectors, %u per cluster, %u clusters, %u reserved, %u per FAT",
+		(geo->fat32 ? 32 : 16), geo->sector_size, geo->sectors_per_cluster, 
+		geo->clusters, geo->reserved_sectors, geo->fat_sectors);
+	return TRUE;
+}
+
+static void
+get_dos_time(guint16* dos_time, guint16* dos_date)
+{
+	time_t now = time(NULL);
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	*dos_time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+	*dos_date = (MAX(tm.tm_year - 80, 0) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+}
+
+static void
+fill_label(guchar* dest, const gchar* label)
+{
+	int i;
+
+	memset(dest, ' ', 11);
+	if(!label || !*label) {
+		memcpy(dest, "NO NAME", 7);
+		return;
+	}
+
+	for(i=0; i < 11 && label[i]; i++)
+		dest[i] = g_ascii_toupper(label[i]);
+}
+
+static void
+build_boot_sector(const VfatGeometry* geo, guint32 volume_id, const gchar* label, guchar* sector)
+{
+	gboolean small = (!geo->fat32 && geo->total_sectors < 65536);
+	guchar* ext = sector + (geo->fat32 ? 64 : 36);
+	guchar* code = sector + (geo->fat32 ? 90 : 62);
+
+	memset(sector, 0, geo->sector_size);
+
+	/* Jump over the BPB to the boot code */
+	sector[0] = 0xEB; 	sector[1] = (guchar)(code - sector - 2); 	sector[2] = 0x90;
+	memcpy(sector + 3, "MSWIN4.1", 8);
+
+	put_le16(sector + 11, geo->sector_size);
+	sector[13] = geo->sectors_per_cluster;
+	put_le16(sector + 14, geo->reserved_sectors);
+	sector[16] = VFAT_NUM_FATS;
+	put_le16(sector + 17, (geo->fat32 ? 0 : VFAT_FAT16_ROOT_ENTRIES));
+	put_le16(sector + 19, (small ? geo->total_sectors : 0));
+	sector[21] = VFAT_MEDIA;
+	put_le16(sector + 22, (geo->fat32 ? 0 : geo->fat_sectors));
+	put_le16(sector + 24, 63); 	/* Sectors per track and heads; */
+	put_le16(sector + 26, 255); 	/* nobody uses CHS any more */
+	put_le32(sector + 28, geo->hidden_sectors);
+	put_le32(sector + 32, (small ? 0 : (guint32)geo->total_sectors));
+
+	if(geo->fat32) {
+		put_le32(sector + 36, geo->fat_sectors);
+		put_le32(sector + 44, 2); 	/* The root directory's cluster */
+		put_le16(sector + 48, VFAT_FSINFO_SECTOR);
+		put_le16(sector + 50, VFAT_BACKUP_SECTOR);
+	}
+
+	ext[0] = 0x80; 		/* Drive number */
+	ext[2] = 0x29; 		/* Extended boot signature */
+	put_le32(ext + 3, volume_id);
+	fill_label(ext + 7, label);
+	memcpy(ext + 18, (geo->fat32 ? "FAT32   " : "FAT16   "), 8);
+
+	/* We're not bootable; int 18h tells the BIOS to try something else */
+	code[0] = 0xCD; 	code[1] = 0x18;
+	code[2] = 0xEB; 	code[3] = 0xFE;
+
+	sector[510] = 0x55; 	sector[511] = 0xAA;
+}
+
+static void
+build_fsinfo_sector(const VfatGeometry* geo, guint32 bad_clusters, guchar* sector)
+{
+	memset(sector, 0, geo->sector_size);
+	put_le32(sector, 0x41615252);
+	put_le32(sector + 484, 0x61417272);
+	put_le32(sector + 488, geo->clusters - 1 - bad_clusters); 	/* The root dir has one */
+	put_le32(sector + 492, 3); 			/* Next free cluster */
+	put_le32(sector + 508, 0xAA550000);
+}
+
+/* Copies whatever part of data falls in this chunk of the device */
+static void
+overlay(guchar* chunk, guint64 chunk_start, gsize chunk_len, guint64 where, const guchar* data, gsize len)
+{
+	guint64 start = MAX(chunk_start, where);
+	guint64 end = MIN(chunk_start + chunk_len, where + len);
+
+	if(start < end)
+		memcpy(chunk + (start - chunk_start), data + (start - where), end - start);
+}
+
+/* Turns byte ranges of the device into ranges of cluster numbers. Returns
+ * NULL and sets error if any of them are where the metadata goes, since
+ * that has nowhere else to go */
+static ExtentList*
+get_bad_clusters(const VfatGeometry* geo, const ExtentList* bad_extents, guint64 data_start, guint64 meta_end,
+		 const char* device, GError** error)
+{
+	guint64 cluster_size = (guint64)geo->sectors_per_cluster * geo->sector_size;
+	guint64 first, last, end;
+	ExtentList* ret;
+	guint i;
+
+	ret = extent_list_new();
+	for(i=0; i < bad_extents->extents->len; i++) {
+		const Extent* extent = &g_array_index(bad_extents->extents, Extent, i);
+
+		if(extent->start < meta_end) {
+			g_set_error(error, 0, 0, _("Cannot create filesystem on %s: there are bad sectors where the FAT has to go"), device);
+			extent_list_free(ret);
+			return NULL;
+		}
+
+		/* The sectors past the last cluster don't matter */
+		end = extent->start + extent->len;
+		first = 2 + (extent->start - data_start) / cluster_size;
+		last = MIN(2 + (end - 1 - data_start) / cluster_size, (guint64)geo->clusters + 1);
+		if(first <= last)
+			extent_list_add(ret, first, last - first + 1);
+	}
+
+	return ret;
+}
+
+/* Puts the bad cluster marker in whatever entries of the FAT at fat_start
+ * fall in this chunk */
+static void
+mark_bad_clusters(const VfatGeometry* geo, const ExtentList* bad_clusters, guint64 fat_start,
+		  guchar* chunk, guint64 chunk_start, gsize chunk_len)
+{
+	guint64 entry_size = (geo->fat32 ? 4 : 2);
+	guint64 cluster, first, end;
+	guchar entry[4];
+	guint i;
+
+	if(geo->fat32)
+		put_le32(entry, FAT32_BAD_CLUSTER);
+	else
+		put_le16(entry, FAT16_BAD_CLUSTER);
+
+	if(chunk_start + chunk_len <= fat_start)
+		return;
+
+	for(i=0; i < bad_clusters->extents->len; i++) {
+		const Extent* extent = &g_array_index(bad_clusters->extents, Extent, i);
+
+		first = MAX(extent->start, (chunk_start > fat_start ? (chunk_start - fat_start) / entry_size : 0));
+		end = MIN(extent->start + extent->len, (chunk_start + chunk_len - fat_start + entry_size - 1) / entry_size);
+		for(cluster = first; cluster < end; cluster++)
+			overlay(chunk, chunk_start, chunk_len, fat_start + cluster * entry_size, entry, entry_size);
+	}
+}
+
+static gboolean
+write_all(int fd, const guchar* buf, gsize len, guint64 offset)
+{
+	gssize ret;
+
+	while(len > 0) {
+		if( (ret = pwrite(fd, buf, len, offset)) < 0 ) {
+			if(errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		buf += ret; 	len -= ret; 	offset += ret;
+	}
+	return TRUE;
+}
+
+
+/*
+ * Public functions
+ */
+
+gboolean
+vfat_format(const char* device, const char* label, const ExtentList* bad_extents, GError** error)
+{
+	ExtentList* bad_clusters = NULL;
+	VfatGeometry geo;
+	guchar *boot = NULL, *fsinfo = NULL, *chunk = NULL;
+	guchar fat_head[12], label_entry[VFAT_DIR_ENTRY_SIZE];
+	guint64 size, start, meta_end, fat_start, root_start, data_start, offset;
+	guint sector_size;
+	guint16 dos_time, dos_date;
+	gboolean ret = FALSE;
+	gsize len;
+	int fd, i;
+
+	if( (fd = open(device, O_WRONLY)) < 0 ) {
+		g_set_error(error, 0, 0, _("Cannot open %s: %s"), device, g_strerror(errno));
+		return FALSE;
+	}
+
+	if(!blockdev_get_geometry(fd, &size, &sector_size, &start)) {
+		g_set_error(error, 0, 0, _("Cannot read the size of %s"), device);
+		goto out;
+	}
+	if(!compute_geometry(&geo, size, sector_size, start, error))
+		goto out;
+
+	fat_start = (guint64)geo.reserved_sectors * sector_size;
+	root_start = fat_start + (guint64)VFAT_NUM_FATS * geo.fat_sectors * sector_size;
+	data_start = root_start + (guint64)geo.root_dir_sectors * sector_size;
+	meta_end = root_start + (geo.fat32 ? (guint64)geo.sectors_per_cluster : geo.root_dir_sectors) * sector_size;
+
+	if(bad_extents && extent_list_get_total(bad_extents) > 0 &&
+	   !(bad_clusters = get_bad_clusters(&geo, bad_extents, data_start, meta_end, device, error)) )
+		goto out;
+
+	boot = g_malloc(sector_size);
+	build_boot_sector(&geo, g_random_int(), label, boot);
+	if(geo.fat32) {
+		fsinfo = g_malloc(sector_size);
+		build_fsinfo_sector(&geo, (bad_clusters ? (guint32)extent_list_get_total(bad_clusters) : 0), fsinfo);
+	}
+
+	/* The first two FAT entries hold the media type and "clean" flags;
+	 * on FAT32 the third is the end of the root directory's chain */
+	memset(fat_head, 0, sizeof(fat_head));
+	if(geo.fat32) {
+		put_le32(fat_head, 0x0FFFFF00 | VFAT_MEDIA);
+		put_le32(fat_head + 4, 0x0FFFFFFF);
+		put_le32(fat_head + 8, 0x0FFFFFFF);
+	} else {
+		put_le16(fat_head, 0xFF00 | VFAT_MEDIA);
+		put_le16(fat_head + 2, 0xFFFF);
+	}
+
+	/* The label also lives in the root directory, as its first entry */
+	memset(label_entry, 0, sizeof(label_entry));
+	fill_label(label_entry, label);
+	label_entry[11] = 0x08;
+	get_dos_time(&dos_time, &dos_date);
+	put_le16(label_entry + 22, dos_time);
+	put_le16(label_entry + 24, dos_date);
+
+	chunk = g_malloc(VFAT_WRITE_CHUNK);
+	for(offset = 0; offset < meta_end; offset += len) {
+		len = (gsize)MIN(meta_end - offset, VFAT_WRITE_CHUNK);
+		memset(chunk, 0, len);
+
+		overlay(chunk, offset, len, 0, boot, sector_size);
+		if(geo.fat32) {
+			overlay(chunk, offset, len, (guint64)VFAT_FSINFO_SECTOR * sector_size, fsinfo, sector_size);
+			overlay(chunk, offset, len, (guint64)VFAT_BACKUP_SECTOR * sector_size, boot, sector_size);
+			overlay(chunk, offset, len, (guint64)(VFAT_BACKUP_SECTOR + 1) * sector_size, fsinfo, sector_size);
+		}
+		for(i=0; i < VFAT_NUM_FATS; i++) {
+			overlay(chunk, offset, len, fat_start + (guint64)i * geo.fat_sectors * sector_size, 
+				fat_head, (geo.fat32 ? 12 : 4));
+			if(bad_clusters)
+				mark_bad_clusters(&geo, bad_clusters, fat_start + (guint64)i * geo.fat_sectors * sector_size,
+						  chunk, offset, len);
+		}
+		if(label && *label)
+			overlay(chunk, offset, len, root_start, label_entry, sizeof(label_entry));
+
+		if(!write_all(fd, chunk, len, offset)) {
+			g_set_error(error, 0, 0, _("Cannot write to %s: %s"), device, g_strerror(errno));
+			goto out;
+		}
+	}
+
+	ret = TRUE;
+
+out:
+	if(bad_clusters)
+		extent_list_free(bad_clusters);
+	g_free(chunk);
+	g_free(fsinfo);
+	g_free(boot);
+	close(fd);
+	return ret;
+}
+
+/* It's all over in a few MB of writes, so it doesn't bother checking
+ * whether it's been cancelled */
+static gboolean
+vfat_formatter_run(FormatterRequest* req, GError** error)
+{
+	return vfat_format(req->blockdev, formatter_request_get_option(req, "label"), req->bad_extents, error);
+}
+
+static gboolean
+vfat_formatter_doformat(Formatter* this, FormatterRequest* req, GError** error)
+{
+	return formatter_request_run_blocking(req, vfat_formatter_run, error);
+}
+
+Formatter*
+vfat_formatter_new(void)
+{
+	static const char* fs_list[] = { "vfat", NULL };
+	const FormatterOps fops = { NULL, vfat_formatter_doformat, NULL, NULL };
+	Formatter* ret = g_new0(Formatter, 1);
+
+	ret->name = "vfat";
+	ret->available_fs_list = fs_list;
+	ret->fops = fops;
+	ret->flags = FORMATTER_AVOIDS_BAD_EXTENTS;
+	return ret;
+}
@@ -0,0 +1,43 @@
+/*
+ * fs-vfat.h - Create FAT16 and FAT32 filesystems ourselves
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef _FS_VFAT_H
+#define _FS_VFAT_H
+
+#include <glib.h>
+
+#include "extent-list.h"
+#include "formatterbase.h"
+
+/* Writes an empty FAT16 or FAT32 filesystem, whichever suits the size, over
+ * all of device; label may be NULL. The clusters that touch bad_extents
+ * (NULL for none) are marked bad in the FATs. This blocks, and leaves the
+ * flushing to the caller */
+gboolean vfat_format(const char* device, const char* label, const ExtentList* bad_extents, GError** error);
+
+/* Does the above for formatters_find("vfat") */
+Formatter* vfat_formatter_new(void);
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ * icon-cache.c - Load and scale device icons off the main thread
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <gdk/gdk.h>
+#include <gtk/gtk.h>
+
+#include "icon-cache.h"
+
+/* HAL hands us full-size icons that we have to decode and scale down to fit
+ * in the combo box. We do that on a loader thread, and we keep the scaled
+ * down versions in ~/.cache/gnome-format/icons, named after the source path
+ * and its mtime, so next time it's just a tiny PNG to read. */
+
+#define PLACEHOLDER_ICON 	"gnome-dev-harddisk"
+
+struct _IconCache {
+	int width, height;
+	IconLoadedFunc callback;
+	gpointer user_data;
+
+	GHashTable* icons;		/* path => GdkPixbuf; main thread only */
+	GHashTable* pending;		/* paths the loader is working on */
+	GdkPixbuf* placeholder;
+
+	GThread* loader;
+	GAsyncQueue* requests;		/* paths, or the cache itself to quit */
+	gchar* cache_dir;
+};
+
+typedef struct {
+	IconCache* cache;
+	gchar* path;
+	GdkPixbuf* icon;
+} IconLoadResult;
+
+
+/*
+ * Loader thread
+ */
+
+static gchar*
+get_scaled_icon_path(IconCache* cache, const gchar* path, time_t mtime)
+{
+	gchar* name = g_strdup_printf("%08x-%ld-%dx%d.png", g_str_hash(path),
+				      (long)mtime, cache->width, cache->height);
+	gchar* ret = g_build_filename(cache->cache_dir, name, NULL);
+	g_free(name);
+	return ret;
+}
+
+static GdkPixbuf*
+load_scaled_icon(IconCache* cache, const gchar* path)
+{
+	GdkPixbuf* ret = NULL;
+	GError* err = NULL;
+	gchar* scaled_path;
+	struct stat st;
+
+	if(stat(path, &st) != 0)
+		return NULL;
+
+	/* Try the one we scaled last time first; the file name is a hash, so
+	 * make sure it really came from this path */
+	scaled_path = get_scaled_icon_path(cache, path, st.st_mtime);
+	if( (ret = gdk_pixbuf_new_from_file(scaled_path, NULL)) ) {
+		const gchar* source = gdk_pixbuf_get_option(ret, "tEXt::Source");
+		if(source && !strcmp(source, path))
+			goto out;
+
+		g_object_unref(ret);
+		ret = NULL;
+	}
+
+	if( !(ret = gdk_pixbuf_new_from_file_at_size(path, cache->width, cache->height, &err)) ) {
+		g_warning("Couldn't load icon '%s'! message = '%s'", path, err->message);
+		g_error_free(err);
+		goto out;
+	}
+
+	if(g_mkdir_with_parents(cache->cache_dir, 0700) != 0 ||
+	   !gdk_pixbuf_save(ret, scaled_path, "png", &err, "tEXt::Source", path, NULL)) {
+		g_debug("Couldn't save scaled icon to '%s'", scaled_path);
+		if(err)
+			g_error_free(err);
+	}
+
+out:
+	g_free(scaled_path);
+	return ret;
+}
+
+static gboolean
+icon_loaded_idle(gpointer data)
+{
+	IconLoadResult* result = data;
+	IconCache* cache = result->cache;
+
+	g_hash_table_remove(cache->pending, result->path);
+
+	/* If it didn't load, remember the placeholder so we don't try again.
+	 * The theme might not have one either, in which case that's NULL */
+	if(!result->icon)
+		result->icon = (cache->placeholder ? g_object_ref(cache->placeholder) : NULL);
+
+	g_hash_table_insert(cache->icons, result->path, result->icon);
+	if(cache->callback)
+		cache->callback(cache, result->path, result->icon, cache->user_data);
+
+	/* The table owns the path and the icon now */
+	g_free(result);
+	return FALSE;
+}
+
+static gpointer
+icon_loader_thread(gpointer data)
+{
+	IconCache* cache = data;
+	gpointer request;
+
+	while( (request = g_async_queue_pop(cache->requests)) != cache ) {
+		IconLoadResult* result = g_new0(IconLoadResult, 1);
+		result->cache = cache;
+		result->path = request;
+		result->icon = load_scaled_icon(cache, result->path);
+		g_idle_add(icon_loaded_idle, result);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Public functions
+ */
+
+static void unref_free_cb(gpointer data)  { if(data) g_object_unref( G_OBJECT(data) ); }
+
+IconCache*
+icon_cache_new(int width, int height, IconLoadedFunc callback, gpointer user_data)
+{
+	IconCache* cache = g_new0(IconCache, 1);
+
+	cache->width = width; 		cache->height = height;
+	cache->callback = callback; 	cache->user_data = user_data;
+	cache->icons = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, unref_free_cb);
+	cache->pending = g_hash_table_new(g_str_hash, g_str_equal);
+	cache->requests = g_async_queue_new();
+	cache->cache_dir = g_build_filename(g_get_user_cache_dir(), "gnome-format", "icons", NULL);
+
+	/* Theme icons are already cached by GTK, so this one's cheap */
+	cache->placeholder = gtk_icon_theme_load_icon(gtk_icon_theme_get_default(),
+						      PLACEHOLDER_ICON, width, 0, NULL);
+	return cache;
+}
+
+void
+icon_cache_free(IconCache* cache)
+{
+	g_assert(cache != NULL);
+
+	/* Any results still sitting in the main loop would point at us, but
+	 * we're only freed after gtk_main() has returned */
+	if(cache->loader) {
+		g_async_queue_push(cache->requests, cache);
+		g_thread_join(cache->loader);
+	}
+	g_async_queue_unref(cache->requests);
+
+	g_hash_table_destroy(cache->icons);
+	g_hash_table_destroy(cache->pending);
+	if(cache->placeholder)
+		g_object_unref(cache->placeholder);
+	g_free(cache->cache_dir);
+	g_free(cache);
+}
+
+GdkPixbuf*
+icon_cache_lookup(IconCache* cache, const gchar* path)
+{
+	gpointer ret;
+	GError* err = NULL;
+
+	if(!path)
+		return cache->placeholder;
+	if(g_hash_table_lookup_extended(cache->icons, path, NULL, &ret))
+		return (ret ? ret : cache->placeholder);
+	if(g_hash_table_lookup(cache->pending, path))
+		return cache->placeholder;
+
+	if(!cache->loader) {
+		if( !(cache->loader = g_thread_create(icon_loader_thread, cache, TRUE /*joinable*/, &err)) ) {
+			g_warning("Couldn't create icon loader thread: %s", err->message);
+			g_error_free(err);
+			return cache->placeholder;
+		}
+	}
+
+	/* The pending table and the loader share the path string; the loader
+	 * passes it back to us with the result */
+	gchar* request = g_strdup(path);
+	g_hash_table_insert(cache->pending, request, request);
+	g_async_queue_push(cache->requests, request);
+
+	return cache->placeholder;
+}
@@ -0,0 +1,44 @@
+/*
+ * icon-cache.h - Load and scale device icons off the main thread
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _ICON_CACHE_H
+#define _ICON_CACHE_H
+
+#include <glib.h>
+#include <gdk/gdk.h>
+
+typedef struct _IconCache IconCache;
+
+/* Called from the main loop once the real icon for path is ready */
+typedef void (*IconLoadedFunc) (IconCache* cache, const gchar* path, GdkPixbuf* icon, gpointer user_data);
+
+IconCache* icon_cache_new(int width, int height, IconLoadedFunc callback, gpointer user_data);
+void icon_cache_free(IconCache* cache);
+
+/* Never blocks: returns the icon if we have it, otherwise a placeholder and
+ * the real one shows up later through the callback. The caller doesn't own
+ * the returned pixbuf */
+GdkPixbuf* icon_cache_lookup(IconCache* cache, const gchar* path);
+
+#endif
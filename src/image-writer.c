@@ -0,0 +1,449 @@
+/*
+ * image-writer.c - Write one image to many devices at once
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+/* For O_DIRECT and SEEK_DATA */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <glib.h>
+#include <glib/gi18n.h>
+
+#include "blockdev.h"
+#include "bulkio.h"
+#include "image-writer.h"
+
+/* Running dd once per device reads the image once per device too, and
+ * sixteen of them at once mostly wait on each other's reads. Here one
+ * thread reads it, a chunk at a time, and hands each chunk to every
+ * target's queue; each target has a thread of its own that writes what's
+ * on its queue, in order, and lets go of it. A chunk goes back to be read
+ * into once the last target has let go.
+ *
+ * There are only so many chunks, which is the backpressure: the reader
+ * waits for a free one, so the fastest target can get as far ahead of the
+ * slowest as all of them put together, and no further. Nobody waits on
+ * anyone before that. */
+
+/* O_DIRECT buffers have to be aligned to the logical sector size; a page is
+ * at least that on anything we'll see */
+#define BUFFER_ALIGN 		4096
+#define DEFAULT_BLOCK_SIZE 	(1 << 20)
+
+/* Zeroing a hole can take as long as writing it, where the device can't
+ * do it for us; this keeps the progress moving meanwhile */
+#define HOLE_CHUNK_MAX 		(G_GUINT64_CONSTANT(64) << 20)
+
+/* How often we tell anyone how it's going, in seconds */
+#define PROGRESS_INTERVAL 	0.25
+
+typedef struct {
+	guchar* buf;
+	guint64 offset;
+	guint64 len;
+	gboolean hole;			/* Nothing to write; zero it instead */
+	volatile gint refs;		/* Targets that haven't written it yet */
+} Chunk;
+
+typedef struct {
+	GMutex* lock;			/* For the writers' progress */
+	GAsyncQueue* free;		/* Chunks nobody's using */
+	volatile gint live;		/* Writers that haven't failed */
+} Fanout;
+
+typedef struct {
+	Fanout* fanout;
+	const char* dev;
+	int fd;
+	guint64 size;
+	guint sector_size;
+	GAsyncQueue* queue;		/* Chunks to write, then end_marker */
+	GThread* thread;
+
+	/* Under fanout->lock */
+	guint64 written;
+	GError* error;
+} Writer;
+
+/* Tells a writer there's nothing more coming */
+static Chunk end_marker;
+
+
+/*
+ * Utility Functions
+ */
+
+static guint64
+round_up(guint64 value, guint64 to)
+{
+	return (value + to - 1) / to * to;
+}
+
+static int
+open_direct(const char* dev, int flags)
+{
+	int fd;
+
+	/* Not every filesystem an image file might live on does O_DIRECT */
+	if( (fd = open(dev, flags | O_DIRECT)) < 0 && errno == EINVAL )
+		fd = open(dev, flags);
+	return fd;
+}
+
+static void
+release_chunk(Fanout* fanout, Chunk* chunk)
+{
+	if(g_atomic_int_dec_and_test(&chunk->refs))
+		g_async_queue_push(fanout->free, chunk);
+}
+
+static gboolean
+write_chunk(Writer* writer, Chunk* chunk, GError** error)
+{
+	guchar* buf = chunk->buf;
+	guint64 offset = chunk->offset, len = chunk->len;
+	ssize_t ret;
+
+	/* The image needn't end on a sector boundary, but the device does */
+	if(chunk->hole) {
+		len = MIN(round_up(len, writer->sector_size), writer->size - offset);
+		return blockdev_zero_range(writer->fd, writer->dev, offset, len, error);
+	}
+
+	/* Only the last chunk can be ragged, and O_DIRECT won't take that */
+	if(len % writer->sector_size)
+		fcntl(writer->fd, F_SETFL, fcntl(writer->fd, F_GETFL) & ~O_DIRECT);
+
+	while(len > 0) {
+		if( (ret = pwrite(writer->fd, buf, len, offset)) < 0 && errno == EINTR )
+			continue;
+		if(ret <= 0) {
+			g_set_error(error, 0, 0, _("Cannot write to %s at byte %llu: %s"), writer->dev, 
+				    (unsigned long long)offset, g_strerror(ret < 0 ? errno : ENOSPC));
+			return FALSE;
+		}
+		buf += ret; 	len -= ret; 	offset += ret;
+	}
+
+	return TRUE;
+}
+
+static gpointer
+writer_thread(gpointer data)
+{
+	Writer* writer = data;
+	Fanout* fanout = writer->fanout;
+	GError* err = NULL;
+	gboolean failed = FALSE;
+	Chunk* chunk;
+
+	/* Once we've failed, we still have to let go of what we're given */
+	while( (chunk = g_async_queue_pop(writer->queue)) != &end_marker ) {
+		if(!failed && !write_chunk(writer, chunk, &err))
+			failed = TRUE;
+		else if(!failed) {
+			g_mutex_lock(fanout->lock);
+			writer->written += chunk->len;
+			g_mutex_unlock(fanout->lock);
+		}
+		release_chunk(fanout, chunk);
+
+		if(err) {
+			g_atomic_int_add(&fanout->live, -1);
+			g_mutex_lock(fanout->lock);
+			writer->error = err;
+			g_mutex_unlock(fanout->lock);
+			err = NULL;
+		}
+	}
+
+	/* O_DIRECT gets it to the drive, not necessarily onto the platters */
+	if(!failed && !blockdev_flush_fd(writer->fd, writer->dev, &err)) {
+		g_mutex_lock(fanout->lock);
+		writer->error = err;
+		g_mutex_unlock(fanout->lock);
+	}
+
+	return NULL;
+}
+
+/* Returns FALSE if it couldn't be set up; error says why */
+static gboolean
+writer_start(Writer* writer, guint64 image_size, GError** error)
+{
+	guint64 part_start;
+	struct stat st;
+
+	if( (writer->fd = open_direct(writer->dev, O_WRONLY)) < 0 ) {
+		g_set_error(error, 0, 0, _("Cannot open %s: %s"), writer->dev, g_strerror(errno));
+		return FALSE;
+	}
+
+	if(!blockdev_get_geometry(writer->fd, &writer->size, &writer->sector_size, &part_start)) {
+		g_set_error(error, 0, 0, _("Cannot read the size of %s"), writer->dev);
+		goto error;
+	}
+
+	/* A file only has to be told how big it is */
+	if(writer->size < image_size && fstat(writer->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		if(ftruncate(writer->fd, image_size) != 0) {
+			g_set_error(error, 0, 0, _("Cannot make %s big enough for the image: %s"), 
+				    writer->dev, g_strerror(errno));
+			goto error;
+		}
+		writer->size = image_size;
+	}
+	if(writer->size < image_size) {
+		g_set_error(error, 0, 0, _("%s is too small for the image (%llu bytes; it needs %llu)"), 
+			    writer->dev, (unsigned long long)writer->size, (unsigned long long)image_size);
+		goto error;
+	}
+
+	writer->queue = g_async_queue_new();
+	if( !(writer->thread = g_thread_create(writer_thread, writer, TRUE, error)) ) {
+		g_async_queue_unref(writer->queue);
+		goto error;
+	}
+	return TRUE;
+
+error:
+	close(writer->fd);
+	writer->fd = -1;
+	return FALSE;
+}
+
+/* Where the next piece of the image with data in it starts, and where it
+ * ends; files tell us where their holes are, and those needn't be read */
+static void
+next_data(int fd, guint64 offset, guint64 size, guint64* data, guint64* data_end)
+{
+	off_t ret;
+
+	if( (ret = lseek(fd, offset, SEEK_DATA)) < 0 ) {
+		/* Either it's hole from here on, or we can't tell */
+		*data = (errno == ENXIO ? size : offset);
+		*data_end = size;
+		return;
+	}
+	*data = MIN((guint64)ret - (guint64)ret % BUFFER_ALIGN, size);
+
+	ret = lseek(fd, *data, SEEK_HOLE);
+	*data_end = (ret < 0 ? size : MIN(round_up(ret, BUFFER_ALIGN), size));
+}
+
+static gboolean
+read_chunk(int fd, const char* image, Chunk* chunk, GError** error)
+{
+	guchar* buf = chunk->buf;
+	guint64 offset = chunk->offset;
+	gsize got = 0, len = round_up(chunk->len, BUFFER_ALIGN);
+	ssize_t ret;
+
+	/* O_DIRECT reads have to be whole pages; at the end of the file that
+	 * just comes up short */
+	while(got < chunk->len) {
+		if( (ret = pread(fd, buf + got, len - got, offset + got)) < 0 && errno == EINTR )
+			continue;
+		if(ret <= 0) {
+			g_set_error(error, 0, 0, _("Cannot read from %s at byte %llu: %s"), image, 
+				    (unsigned long long)(offset + got), g_strerror(ret < 0 ? errno : EIO));
+			return FALSE;
+		}
+		got += ret;
+	}
+
+	return TRUE;
+}
+
+/* Copies what the writers have done to targets and passes it on. Returns
+ * FALSE if we're supposed to stop */
+static gboolean
+report_progress(Fanout* fanout, Writer* writers, ImageTarget* targets, guint count, 
+		guint64 total, ImageProgressFunc progress_cb, gpointer user_data)
+{
+	guint i;
+
+	g_mutex_lock(fanout->lock);
+	for(i=0; i < count; i++) {
+		if(writers[i].fd < 0)
+			continue;
+		targets[i].written = writers[i].written;
+		targets[i].error = writers[i].error;
+	}
+	g_mutex_unlock(fanout->lock);
+
+	return (progress_cb ? progress_cb(targets, count, total, user_data) : TRUE);
+}
+
+/* Waits for a chunk to read into, keeping the progress coming meanwhile.
+ * Returns NULL if we're supposed to stop */
+static Chunk*
+get_free_chunk(Fanout* fanout, Writer* writers, ImageTarget* targets, guint count, 
+	       guint64 total, ImageProgressFunc progress_cb, gpointer user_data, GTimeVal* last_report)
+{
+	GTimeVal now, deadline;
+	Chunk* chunk;
+
+	for(;;) {
+		g_get_current_time(&now);
+		deadline = *last_report;
+		g_time_val_add(&deadline, (glong)(PROGRESS_INTERVAL * G_USEC_PER_SEC));
+		if(now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_usec >= deadline.tv_usec)) {
+			*last_report = now;
+			if(!report_progress(fanout, writers, targets, count, total, progress_cb, user_data))
+				return NULL;
+			continue;
+		}
+
+		if( (chunk = g_async_queue_timed_pop(fanout->free, &deadline)) )
+			return chunk;
+	}
+}
+
+
+/*
+ * Public functions
+ */
+
+gboolean
+image_write(const char* image, ImageTarget* targets, guint count,
+	    const BulkioParams* params, ImageProgressFunc progress_cb,
+	    gpointer user_data, GError** error)
+{
+	guint64 size, part_start, offset = 0, data = 0, data_end = 0;
+	guint sector_size, chunk_count, started = 0, i;
+	gsize block_size;
+	Writer* writers;
+	Chunk* chunks;
+	Chunk* chunk;
+	Fanout fanout;
+	GTimeVal last_report;
+	gboolean stopped = FALSE, ret = FALSE;
+	int fd;
+
+	if( (fd = open_direct(image, O_RDONLY)) < 0 ) {
+		g_set_error(error, 0, 0, _("Cannot open %s: %s"), image, g_strerror(errno));
+		return FALSE;
+	}
+	if(!blockdev_get_geometry(fd, &size, &sector_size, &part_start)) {
+		g_set_error(error, 0, 0, _("Cannot read the size of %s"), image);
+		close(fd);
+		return FALSE;
+	}
+
+	chunk_count = (params && params->queue_depth ? params->queue_depth : BULKIO_DEFAULT_QUEUE_DEPTH);
+	chunk_count = CLAMP(chunk_count, 1, BULKIO_MAX_QUEUE_DEPTH);
+	block_size = (params && params->block_size ? params->block_size : DEFAULT_BLOCK_SIZE);
+	block_size = MAX(block_size - block_size % BUFFER_ALIGN, BUFFER_ALIGN);
+
+	memset(&fanout, 0, sizeof(fanout));
+	fanout.lock = g_mutex_new();
+	fanout.free = g_async_queue_new();
+	chunks = g_new0(Chunk, chunk_count);
+	for(i=0; i < chunk_count; i++) {
+		if(posix_memalign((void**)&chunks[i].buf, BUFFER_ALIGN, block_size) != 0) {
+			g_set_error(error, 0, 0, _("Cannot read %s: %s"), image, g_strerror(ENOMEM));
+			goto out;
+		}
+		g_async_queue_push(fanout.free, &chunks[i]);
+	}
+
+	writers = g_new0(Writer, count);
+	for(i=0; i < count; i++) {
+		writers[i].fanout = &fanout;
+		writers[i].dev = targets[i].dev;
+		targets[i].written = 0;
+		targets[i].error = NULL;
+
+		if(!writer_start(&writers[i], size, &targets[i].error))
+			continue;
+		started++;
+	}
+	fanout.live = started;
+	g_debug("Writing %s to %u devices, %u chunks of %lu bytes", image, started, 
+		chunk_count, (unsigned long)block_size);
+
+	g_get_current_time(&last_report);
+	while(offset < size && g_atomic_int_get(&fanout.live) > 0) {
+		if( !(chunk = get_free_chunk(&fanout, writers, targets, count, size, 
+					     progress_cb, user_data, &last_report)) ) {
+			stopped = TRUE;
+			break;
+		}
+
+		if(offset >= data_end)
+			next_data(fd, offset, size, &data, &data_end);
+
+		chunk->offset = offset;
+		chunk->hole = (offset < data);
+		chunk->len = (chunk->hole ? MIN(data - offset, HOLE_CHUNK_MAX) : MIN(block_size, data_end - offset));
+		if(!chunk->hole && !read_chunk(fd, image, chunk, error)) {
+			g_async_queue_push(fanout.free, chunk);
+			break;
+		}
+		offset += chunk->len;
+
+		chunk->refs = started;
+		for(i=0; i < count; i++) {
+			if(writers[i].thread)
+				g_async_queue_push(writers[i].queue, chunk);
+		}
+	}
+
+	for(i=0; i < count; i++) {
+		if(!writers[i].thread)
+			continue;
+		g_async_queue_push(writers[i].queue, &end_marker);
+		g_thread_join(writers[i].thread);
+		g_async_queue_unref(writers[i].queue);
+		close(writers[i].fd);
+	}
+	report_progress(&fanout, writers, targets, count, size, progress_cb, user_data);
+
+	if(stopped)
+		g_set_error(error, 0, 0, _("Writing %s was cancelled"), image);
+	else if(offset >= size || g_atomic_int_get(&fanout.live) == 0)
+		ret = TRUE;
+	g_free(writers);
+
+out:
+	for(i=0; i < chunk_count; i++)
+		free(chunks[i].buf);
+	g_free(chunks);
+	g_async_queue_unref(fanout.free);
+	g_mutex_free(fanout.lock);
+	close(fd);
+	return ret;
+}
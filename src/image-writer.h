@@ -0,0 +1,58 @@
+/*
+ * image-writer.h - Write one image to many devices at once
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef _IMAGE_WRITER_H
+#define _IMAGE_WRITER_H
+
+#include <glib.h>
+
+#include "bulkio.h"
+
+typedef struct _ImageTarget {
+	const char* dev;
+	guint64 written;	/* How much of the image is on it so far,
+				   holes included */
+	GError* error;		/* Once it has failed; the others go on
+				   without it. Free it when you're done */
+} ImageTarget;
+
+/* Called a few times a second from the thread that called us; return
+ * FALSE to stop */
+typedef gboolean (*ImageProgressFunc) (const ImageTarget* targets, guint count,
+				       guint64 total, gpointer user_data);
+
+/* Reads image once and writes it to every one of targets at the same time,
+ * each at its own pace, through up to queue_depth buffers of block_size
+ * that all of them share. Holes in image aren't read; they're zeroed on
+ * the targets, which the device can usually do without being sent the
+ * zeroes. Targets can be devices or files; a file smaller than image is
+ * made bigger first. A target that fails gets its error and drops out.
+ * Returns FALSE only if image can't be read or progress_cb stopped us;
+ * params may be NULL. This blocks */
+gboolean image_write(const char* image, ImageTarget* targets, guint count,
+		     const BulkioParams* params, ImageProgressFunc progress_cb,
+		     gpointer user_data, GError** error);
+
+#endif
@@ -24,8 +24,12 @@
 
 #include "config.h"
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
+#include <dbus/dbus.h>
 #include <libhal.h>
 #include <libhal-storage.h>
 
@@ -34,46 +38,351 @@
 #include <glade/glade.h>
 #include <gtk/gtk.h>
 
+#include "device-info.h"
 #include "format-dialog.h"
+#include "format-job.h"
+#include "formatterbase.h"
+#include "image-writer.h"
+#include "mount-info.h"
 
 /* Command-line stuff */
+static gchar** devices = NULL;
+static gchar* filesystem = NULL;
+static gchar* image = NULL;
+static gint max_jobs = FORMAT_JOB_DEFAULT_PARALLEL;
+static gboolean check_capacity = FALSE;
+static gchar* discard = NULL;
+static gchar* overwrite = NULL;
+static gchar* scan = NULL;
+static gint queue_depth = 0;
+
 static GOptionEntry entries[] = 
 {
+	{ "device", 'd', 0, G_OPTION_ARG_FILENAME_ARRAY, &devices, 
+	  N_("Format DEVICE without showing the dialog; may be given more than once"), N_("DEVICE") },
+	{ "filesystem", 't', 0, G_OPTION_ARG_STRING, &filesystem, 
+	  N_("Filesystem to create on the devices given with --device"), N_("TYPE") },
+	{ "image", 0, 0, G_OPTION_ARG_FILENAME, &image, 
+	  N_("Write FILE to all the devices given with --device, instead of formatting them"), N_("FILE") },
+	{ "jobs", 'j', 0, G_OPTION_ARG_INT, &max_jobs, 
+	  N_("How many devices to format at the same time (default 4)"), N_("N") },
+	{ "check-capacity", 0, 0, G_OPTION_ARG_NONE, &check_capacity, 
+	  N_("Make sure each device really holds as much as it says before formatting it"), NULL },
+	{ "discard", 0, 0, G_OPTION_ARG_STRING, &discard, 
+	  N_("Throw away the old contents first: \"trim\", \"zeroout\" or \"secure\""), N_("MODE") },
+	{ "overwrite", 0, 0, G_OPTION_ARG_STRING, &overwrite, 
+	  N_("Write over every byte of the devices before formatting: \"zeroes\" or \"random\""), N_("PATTERN") },
+	{ "scan", 0, 0, G_OPTION_ARG_STRING, &scan, 
+	  N_("Check for bad sectors and keep the filesystem off them: \"read\" or \"write\""), N_("MODE") },
+	{ "queue-depth", 0, 0, G_OPTION_ARG_INT, &queue_depth, 
+	  N_("How many requests to keep in flight per device while overwriting or scanning, or buffers to share while writing an image (default 32)"), N_("N") },
 	{ NULL }
 };
 
 
+/*
+ * Batch mode
+ */
+
+static GMainLoop* batch_loop = NULL;
+static GHashTable* batch_last_percent = NULL;
+static int batch_failures = 0;
+
+static void
+on_batch_progress(FormatJob* job, gpointer user_data)
+{
+	int percent = (int)(job->progress * 100.0);
+	gchar *eta, *throughput;
+
+	/* mkfs updates us far more often than anyone wants to read; stick to
+	 * whole percents (stored off by one so that 0% isn't NULL) */
+	if(GPOINTER_TO_INT(g_hash_table_lookup(batch_last_percent, job)) == percent + 1)
+		return;
+	g_hash_table_insert(batch_last_percent, job, GINT_TO_POINTER(percent + 1));
+
+	eta = format_job_get_eta_text(job);
+	throughput = format_job_get_throughput_text(job);
+	if(eta && throughput)
+		g_print("%s: %s, %d%% (%s, %s)\n", job->device, format_job_get_state_text(job), percent, throughput, eta);
+	else if(eta || throughput)
+		g_print("%s: %s, %d%% (%s)\n", job->device, format_job_get_state_text(job), percent, (eta ? eta : throughput));
+	else
+		g_print("%s: %s, %d%%\n", job->device, format_job_get_state_text(job), percent);
+	g_free(eta);
+	g_free(throughput);
+}
+
+static void
+on_batch_done(FormatJob* job, gpointer user_data)
+{
+	if(job->error) {
+		g_printerr("%s: %s\n", job->device, job->error->message);
+		batch_failures++;
+	} else if(job->bad_extents && extent_list_get_total(job->bad_extents) > 0) {
+		g_print(_("%s: %llu KiB of bad sectors were kept out of the filesystem\n"), job->target,
+			(unsigned long long)((extent_list_get_total(job->bad_extents) + 1023) / 1024));
+	}
+
+	if(job->skipped > 0)
+		g_print(_("%s: %llu MiB were zero already, and weren't written again\n"), job->device,
+			(unsigned long long)(job->skipped / (1024 * 1024)));
+
+	/* Even when the job failed, this is worth knowing about the device */
+	if(job->slow_extents && extent_list_get_total(job->slow_extents) > 0)
+		g_print(_("%s: %llu KiB were unusually slow to read; the device may be wearing out\n"), job->target,
+			(unsigned long long)((extent_list_get_total(job->slow_extents) + 1023) / 1024));
+
+	if(format_job_queue_is_idle(job->queue))
+		g_main_loop_quit(batch_loop);
+}
+
+/* Nobody gets asked in batch mode, so don't touch anything in use. Images
+ * can go to plain files too */
+static gboolean
+batch_device_usable(MountTable* mounts, const char* device, gboolean allow_files, gboolean* is_partition)
+{
+	struct stat st;
+
+	if(allow_files && stat(device, &st) == 0 && S_ISREG(st.st_mode)) {
+		*is_partition = FALSE;
+		return TRUE;
+	}
+
+	if(stat(device, &st) != 0 || !S_ISBLK(st.st_mode)) {
+		if(allow_files)
+			g_printerr(_("%s: Not a block device or a file\n"), device);
+		else
+			g_printerr(_("%s: Not a block device\n"), device);
+		return FALSE;
+	}
+
+	*is_partition = is_partition_device_file(device);
+	if(*is_partition ? mount_table_lookup(mounts, st.st_rdev) : mount_table_lookup_disk(mounts, st.st_rdev)) {
+		g_printerr(_("%s: Device is in use, leaving it alone\n"), device);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+on_image_progress(const ImageTarget* targets, guint count, guint64 total, gpointer user_data)
+{
+	int* last_percent = user_data;
+	int percent;
+	guint i;
+
+	for(i=0; i < count; i++) {
+		percent = (int)(targets[i].written * 100 / MAX(total, 1));
+		if(targets[i].error || percent == last_percent[i])
+			continue;
+
+		last_percent[i] = percent;
+		g_print(_("%s: Writing image, %d%%\n"), targets[i].dev, percent);
+	}
+
+	return TRUE;
+}
+
+/* Every device gets the same bytes, so there's no point in reading them
+ * once per device: this goes through the image once, for all of them */
+static int
+run_image_batch(void)
+{
+	MountTable* mounts = mount_table_new();
+	ImageTarget* targets = g_new0(ImageTarget, g_strv_length(devices));
+	int* last_percent;
+	BulkioParams params;
+	GError* err = NULL;
+	gboolean is_partition;
+	guint count = 0, i;
+
+	for(i=0; devices[i] != NULL; i++) {
+		if(!batch_device_usable(mounts, devices[i], TRUE, &is_partition)) {
+			batch_failures++;
+			continue;
+		}
+		targets[count++].dev = devices[i];
+	}
+	mount_table_free(mounts);
+
+	memset(&params, 0, sizeof(params));
+	params.queue_depth = queue_depth;
+	last_percent = g_new0(int, MAX(count, 1));
+
+	if(count > 0 && !image_write(image, targets, count, &params, on_image_progress, last_percent, &err)) {
+		g_printerr("%s: %s\n", image, err->message);
+		g_error_free(err);
+		batch_failures++;
+	}
+
+	for(i=0; i < count; i++) {
+		if(!targets[i].error)
+			continue;
+		g_printerr("%s: %s\n", targets[i].dev, targets[i].error->message);
+		g_error_free(targets[i].error);
+		batch_failures++;
+	}
+
+	g_free(last_percent);
+	g_free(targets);
+	return (batch_failures > 0 ? 1 : 0);
+}
+
+static int
+run_batch(void)
+{
+	MountTable* mounts;
+	FormatJobQueue* queue;
+	FormatJobOptions options;
+	int i;
+
+	if(!filesystem) {
+		g_printerr(_("--device needs a filesystem to create; use --filesystem\n"));
+		return 1;
+	}
+
+	memset(&options, 0, sizeof(options));
+	options.check_capacity = check_capacity;
+	if(!discard)
+		options.discard = BLOCKDEV_DISCARD_NONE;
+	else if(!strcmp(discard, "trim"))
+		options.discard = BLOCKDEV_DISCARD_TRIM;
+	else if(!strcmp(discard, "zeroout"))
+		options.discard = BLOCKDEV_DISCARD_ZEROOUT;
+	else if(!strcmp(discard, "secure"))
+		options.discard = BLOCKDEV_DISCARD_SECURE;
+	else {
+		g_printerr(_("Unknown --discard mode '%s'\n"), discard);
+		return 1;
+	}
+
+	if(!overwrite)
+		options.overwrite = FORMATJOB_OVERWRITE_NONE;
+	else if(!strcmp(overwrite, "zeroes"))
+		options.overwrite = FORMATJOB_OVERWRITE_ZEROES;
+	else if(!strcmp(overwrite, "random"))
+		options.overwrite = FORMATJOB_OVERWRITE_RANDOM;
+	else {
+		g_printerr(_("Unknown --overwrite pattern '%s'\n"), overwrite);
+		return 1;
+	}
+
+	if(!scan)
+		options.scan = FORMATJOB_SCAN_NONE;
+	else if(!strcmp(scan, "read"))
+		options.scan = FORMATJOB_SCAN_READ;
+	else if(!strcmp(scan, "write"))
+		options.scan = FORMATJOB_SCAN_WRITE;
+	else {
+		g_printerr(_("Unknown --scan mode '%s'\n"), scan);
+		return 1;
+	}
+
+	options.queue_depth = queue_depth;
+
+	formatters_init();
+	if(!formatters_find(filesystem)) {
+		g_printerr(_("Don't know how to create a %s filesystem\n"), filesystem);
+		formatters_shutdown();
+		return 1;
+	}
+
+	mounts = mount_table_new();
+	batch_loop = g_main_loop_new(NULL, FALSE);
+	batch_last_percent = g_hash_table_new(g_direct_hash, g_direct_equal);
+	queue = format_job_queue_new(max_jobs, on_batch_progress, on_batch_done, NULL);
+
+	for(i=0; devices[i] != NULL; i++) {
+		gboolean is_partition;
+
+		if(!batch_device_usable(mounts, devices[i], FALSE, &is_partition)) {
+			batch_failures++;
+			continue;
+		}
+
+		format_job_queue_add(queue, devices[i], filesystem, !is_partition, &options);
+	}
+
+	/* Jobs that fail right away can leave us with nothing to wait for */
+	if(!format_job_queue_is_idle(queue))
+		g_main_loop_run(batch_loop);
+
+	format_job_queue_free(queue);
+	g_main_loop_unref(batch_loop);
+	g_hash_table_destroy(batch_last_percent);
+	mount_table_free(mounts);
+	formatters_shutdown();
+
+	return (batch_failures > 0 ? 1 : 0);
+}
+
+
 int
 main (int argc, char *argv[])
 {
 	
 	FormatDialog *dialog;
 	GError *error = NULL;
-        /*OptionContext* context = g_option_context_new ( _("- Formats a removable disk") );*/
+	GOptionContext* context = g_option_context_new ( _("- Formats a removable disk") );
         
         /* Initialize gettext support */
 	bindtextdomain (GETTEXT_PACKAGE, LOCALEDIR);
 	bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
 	textdomain (GETTEXT_PACKAGE);
 
-	/* Parse the command line 
+	/* Device probing and formatting happen on separate threads */
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+
+	/* The probe threads talk to HAL over the same system bus connection
+	 * as the dialog, and libdbus only locks it if it's told to before
+	 * anyone connects */
+	dbus_threads_init_default ();
+
+	/* Parse the command line; batch mode doesn't need a display, so GTK
+	 * only gets initialized after we know we're showing the dialog */
 	g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
-	g_option_context_add_group (context, gtk_get_option_group(TRUE));
-	g_option_context_parse (context, &argc, &argv, &error);
+	g_option_context_add_group (context, gtk_get_option_group(FALSE));
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+                g_print ("%s\n\n", error->message);
+		g_option_context_free (context);
+                return -1;
+	}
 	g_option_context_free (context);
-        */
 
-        if (!gtk_init_with_args (&argc, &argv, NULL, entries, NULL, &error)) {
-                g_print ("%s\n\n", error->message);
+	if (queue_depth < 0 || queue_depth > BULKIO_MAX_QUEUE_DEPTH) {
+		g_printerr (_("--queue-depth has to be between 1 and %d, or 0 for the default\n"), BULKIO_MAX_QUEUE_DEPTH);
+		return 1;
+	}
+
+	/* An image is written as it is, so none of what formatting takes
+	 * applies to it */
+	if (image && !devices) {
+		g_printerr (_("--image needs devices to write to; use --device\n"));
+		return 1;
+	}
+	if (image && (filesystem || discard || overwrite || scan || check_capacity)) {
+		g_printerr (_("--image can't be combined with --filesystem, --discard, --overwrite, --scan or --check-capacity\n"));
+		return 1;
+	}
+
+	if (devices && image)
+		return run_image_batch();
+	if (devices)
+		return run_batch();
+
+        if (!gtk_init_check (&argc, &argv)) {
+                g_print ("%s\n\n", _("Cannot open display"));
                 return -1;
         }
-        
-        /*gtk_init(&argc, &argv);*/
 
         gtk_window_set_default_icon_name ("gnome-dev-floppy");
+	formatters_init();
 	dialog = format_dialog_new();
 	gtk_main ();
 	format_dialog_free(dialog);
+	formatters_shutdown();
   
 	return 0;
 };
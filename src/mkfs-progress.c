@@ -0,0 +1,236 @@
+/*
+ * mkfs-progress.c - Figure out how far along mkfs is from what it prints
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "mkfs-progress.h"
+
+/* None of the mkfs tools tell us how far along they are in so many words, but
+ * most of them print a counter for the slow parts. Each tool's output is split
+ * into phases, and each phase gets a slice of the bar depending on how long
+ * it usually takes. The lines we get have already been split on \r and \b, so
+ * a counter that redraws itself shows up as a line of its own. */
+
+typedef gboolean (*ParseLineFunc) (MkfsProgress* progress, const gchar* line, gdouble* fraction);
+
+struct _MkfsProgress {
+	ParseLineFunc parse;
+
+	/* The slice of the bar the current phase maps to */
+	gdouble phase_start;
+	gdouble phase_end;
+	gdouble last;
+};
+
+struct _Phase {
+	const gchar* prefix;
+	gdouble start, end;
+};
+
+
+/*
+ * Utility Functions
+ */
+
+static gboolean
+get_counter(const gchar* line, guint64* done, guint64* total)
+{
+	const gchar* p = strrchr(line, ':');
+	unsigned long long d, t;
+
+	/* "Writing inode tables:  5/128", or just " 6/128" once it redraws */
+	if(sscanf((p ? p+1 : line), " %llu/%llu", &d, &t) != 2 || t == 0)
+		return FALSE;
+
+	*done = d; 	*total = t;
+	return TRUE;
+}
+
+static gboolean
+get_percentage(const gchar* line, gdouble* percent)
+{
+	const gchar *end = strrchr(line, '%'), *start;
+
+	if(!end)
+		return FALSE;
+	for(start = end; start > line && (g_ascii_isdigit(start[-1]) || start[-1] == '.'); start--);
+	if(start == end)
+		return FALSE;
+
+	*percent = g_ascii_strtod(start, NULL);
+	return TRUE;
+}
+
+static gboolean
+set_phase(MkfsProgress* progress, const struct _Phase* phases, const gchar* line)
+{
+	const struct _Phase* iter;
+
+	for(iter = phases; iter->prefix != NULL; iter++) {
+		if(!g_str_has_prefix(line, iter->prefix))
+			continue;
+
+		progress->phase_start = iter->start;
+		progress->phase_end = iter->end;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gdouble
+phase_fraction(MkfsProgress* progress, gdouble done)
+{
+	return progress->phase_start + (progress->phase_end - progress->phase_start) * CLAMP(done, 0.0, 1.0);
+}
+
+
+/*
+ * Parsers
+ */
+
+static const struct _Phase mke2fs_phases[] = {
+	{ "Discarding device blocks", 		0.00, 0.10 },
+	{ "Allocating group tables", 		0.10, 0.15 },
+	{ "Writing inode tables", 		0.15, 0.80 },
+	{ "Creating journal", 			0.80, 0.90 },
+	{ "Writing superblocks", 		0.90, 1.00 },
+	{ NULL, 0.0, 0.0 },
+};
+
+static gboolean
+parse_mke2fs(MkfsProgress* progress, const gchar* line, gdouble* fraction)
+{
+	gboolean new_phase = set_phase(progress, mke2fs_phases, line);
+	guint64 done, total;
+
+	if(get_counter(line, &done, &total)) {
+		*fraction = phase_fraction(progress, (gdouble)done / (gdouble)total);
+		return TRUE;
+	}
+
+	/* Each phase ends with "done" */
+	if(g_str_has_suffix(line, "done")) {
+		*fraction = progress->phase_end;
+		return TRUE;
+	}
+
+	*fraction = progress->phase_start;
+	return new_phase;
+}
+
+static const struct _Phase mkntfs_phases[] = {
+	{ "Initializing device with zeroes", 	0.00, 0.90 },
+	{ "Creating NTFS volume structures", 	0.90, 0.95 },
+	{ "mkntfs completed successfully", 	1.00, 1.00 },
+	{ NULL, 0.0, 0.0 },
+};
+
+static gboolean
+parse_mkntfs(MkfsProgress* progress, const gchar* line, gdouble* fraction)
+{
+	gboolean new_phase = set_phase(progress, mkntfs_phases, line);
+	gdouble percent;
+
+	/* Zeroing the device is the only slow part, and it counts in % */
+	if(get_percentage(line, &percent)) {
+		*fraction = phase_fraction(progress, percent / 100.0);
+		return TRUE;
+	}
+
+	*fraction = progress->phase_start;
+	return new_phase;
+}
+
+static const struct {
+	const gchar* name;
+	ParseLineFunc parse;
+} parsers[] = {
+	{ "mke2fs", 		parse_mke2fs },
+	{ "mkntfs", 		parse_mkntfs },
+	{ NULL, NULL },
+};
+
+
+/*
+ * Public functions
+ */
+
+MkfsProgress*
+mkfs_progress_new(const gchar* parser)
+{
+	MkfsProgress* ret;
+	int i;
+
+	if(!parser)
+		return NULL;
+
+	for(i=0; parsers[i].name != NULL; i++) {
+		if(strcmp(parsers[i].name, parser))
+			continue;
+
+		ret = g_new0(MkfsProgress, 1);
+		ret->parse = parsers[i].parse;
+		return ret;
+	}
+
+	g_debug("Unknown progress parser '%s'", parser);
+	return NULL;
+}
+
+void
+mkfs_progress_free(MkfsProgress* progress)
+{
+	g_free(progress);
+}
+
+gboolean
+mkfs_progress_parse_line(MkfsProgress* progress, const gchar* line, gdouble* fraction)
+{
+	gchar* stripped = g_strstrip(g_strdup(line));
+	gdouble ret = 0.0;
+
+	if(!progress->parse(progress, stripped, &ret)) {
+		g_free(stripped);
+		return FALSE;
+	}
+	g_free(stripped);
+
+	/* Never go backwards, it only confuses people */
+	ret = CLAMP(ret, 0.0, 1.0);
+	if(ret <= progress->last)
+		return FALSE;
+
+	progress->last = ret;
+	*fraction = ret;
+	return TRUE;
+}
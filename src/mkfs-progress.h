@@ -0,0 +1,43 @@
+/*
+ * mkfs-progress.h - Figure out how far along mkfs is from what it prints
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _MKFS_PROGRESS_H
+#define _MKFS_PROGRESS_H
+
+#include <glib.h>
+
+typedef struct _MkfsProgress MkfsProgress;
+
+/* parser is what the script put after the filesystem name in its
+ * --capabilities output ("mke2fs" or "mkntfs"). Returns NULL if we don't
+ * know that one. mkfs.vfat prints nothing we could go by; vfat progress comes
+ * from the native writer in fs-vfat.c instead */
+MkfsProgress* mkfs_progress_new(const gchar* parser);
+void mkfs_progress_free(MkfsProgress* progress);
+
+/* Feed it every line of output; returns TRUE and sets fraction (0.0 - 1.0)
+ * if the line told us something new */
+gboolean mkfs_progress_parse_line(MkfsProgress* progress, const gchar* line, gdouble* fraction);
+
+#endif
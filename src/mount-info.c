@@ -0,0 +1,370 @@
+/*
+ * mount-info.c - Track mounted filesystems and swap by device number
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <glib.h>
+
+#include "mount-info.h"
+
+#define MOUNTINFO_PATH 	"/proc/self/mountinfo"
+#define SWAPS_PATH 	"/proc/swaps"
+
+/* HAL gets this wrong for swap, crypto devices and anything that isn't in
+ * /etc/fstab, so we go straight to the kernel. /proc/self/mountinfo has the
+ * major:minor of every mount, and the kernel flags POLLPRI on it whenever the
+ * mount table changes; we only ever re-parse it when that happens. */
+
+struct _MountTable {
+	int mountinfo_fd;
+	gboolean dirty;
+
+	GSList* entries;		/* All MountEntry's, we own these */
+	GHashTable* by_dev;		/* dev key => GSList of MountEntry */
+	GHashTable* by_disk;		/* disk key => GSList of MountEntry */
+
+	GIOChannel* channel;
+	MountTableChangedFunc changed_cb;
+	gpointer changed_data;
+};
+
+/* The kernel's own encoding: 12 bits of major, 20 bits of minor */
+#define DEV_KEY(dev) 	GUINT_TO_POINTER( ((guint)major(dev) << 20) | ((guint)minor(dev) & 0xfffff) )
+
+
+/*
+ * Utility Functions
+ */
+
+static void
+mount_entry_free(MountEntry* entry)
+{
+	g_free(entry->source);
+	g_free(entry->mountpoint);
+	g_free(entry->fstype);
+	g_free(entry);
+}
+
+static void g_slist_free_cb(gpointer data) { g_slist_free(data); }
+
+static gchar*
+read_proc_file(int fd)
+{
+	/* /proc files don't have a size, so we have to read them in chunks */
+	GString* ret = g_string_sized_new(4096);
+	char buf[4096];
+	ssize_t len;
+
+	if(lseek(fd, 0, SEEK_SET) < 0)
+		goto error;
+
+	while( (len = read(fd, buf, sizeof(buf))) != 0 ) {
+		if(len < 0)
+			goto error;
+		g_string_append_len(ret, buf, len);
+	}
+
+	return g_string_free(ret, FALSE);
+
+error:
+	g_string_free(ret, TRUE);
+	return NULL;
+}
+
+static dev_t
+get_disk_for_dev(dev_t dev)
+{
+	gchar *sysfs_path, *real_path, *parent_dev_path, *contents = NULL;
+	unsigned int maj, min;
+	dev_t ret = dev;
+
+	/* Partitions have a "partition" attribute, and their parent directory
+	 * in sysfs is the whole disk */
+	sysfs_path = g_strdup_printf("/sys/dev/block/%u:%u", major(dev), minor(dev));
+	real_path = realpath(sysfs_path, NULL);
+	g_free(sysfs_path);
+	if(!real_path)
+		return ret;
+
+	gchar* partition_attr = g_build_filename(real_path, "partition", NULL);
+	gboolean is_partition = g_file_test(partition_attr, G_FILE_TEST_EXISTS);
+	g_free(partition_attr);
+
+	if(is_partition) {
+		parent_dev_path = g_build_filename(real_path, "..", "dev", NULL);
+		if(g_file_get_contents(parent_dev_path, &contents, NULL, NULL) &&
+		   sscanf(contents, "%u:%u", &maj, &min) == 2)
+			ret = makedev(maj, min);
+		g_free(parent_dev_path);
+		g_free(contents);
+	}
+
+	free(real_path);
+	return ret;
+}
+
+static void
+add_entry(MountTable* table, MountEntry* entry)
+{
+	GSList* list;
+
+	entry->disk = (major(entry->dev) != 0 ? get_disk_for_dev(entry->dev) : entry->dev);
+	table->entries = g_slist_prepend(table->entries, entry);
+
+	list = g_hash_table_lookup(table->by_dev, DEV_KEY(entry->dev));
+	g_hash_table_steal(table->by_dev, DEV_KEY(entry->dev));
+	g_hash_table_insert(table->by_dev, DEV_KEY(entry->dev), g_slist_prepend(list, entry));
+
+	list = g_hash_table_lookup(table->by_disk, DEV_KEY(entry->disk));
+	g_hash_table_steal(table->by_disk, DEV_KEY(entry->disk));
+	g_hash_table_insert(table->by_disk, DEV_KEY(entry->disk), g_slist_prepend(list, entry));
+}
+
+static void
+parse_mountinfo(MountTable* table, const gchar* contents)
+{
+	gchar** lines = g_strsplit(contents, "\n", 0 /*all tokens*/);
+	gchar** line;
+
+	/* Each line looks like:
+	 * 36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+	 *
+	 * The number of optional fields before the "-" varies */
+	for(line = lines; *line != NULL; line++) {
+		gchar** fields = g_strsplit(*line, " ", 0);
+		unsigned int maj, min;
+		int i, sep = -1;
+
+		for(i=0; fields[i] != NULL; i++) {
+			if(i > 5 && !strcmp(fields[i], "-")) {
+				sep = i;
+				break;
+			}
+		}
+
+		if(sep < 0 || !fields[sep+1] || !fields[sep+2] ||
+		   sscanf(fields[2], "%u:%u", &maj, &min) != 2) {
+			g_strfreev(fields);
+			continue;
+		}
+
+		MountEntry* entry = g_new0(MountEntry, 1);
+		entry->dev = makedev(maj, min);
+		entry->mountpoint = g_strcompress(fields[4]); 	/* Undo the \040 escapes */
+		entry->fstype = g_strdup(fields[sep+1]);
+		entry->source = g_strcompress(fields[sep+2]);
+
+		/* btrfs and friends report an anonymous device number; the
+		 * source tells us which block device is really behind it */
+		struct stat st;
+		if(maj == 0 && g_str_has_prefix(entry->source, "/dev/") &&
+		   stat(entry->source, &st) == 0 && S_ISBLK(st.st_mode))
+			entry->dev = st.st_rdev;
+
+		add_entry(table, entry);
+		g_strfreev(fields);
+	}
+
+	g_strfreev(lines);
+}
+
+static void
+parse_swaps(MountTable* table)
+{
+	gchar *contents = NULL;
+	gchar **lines, **line;
+
+	if(!g_file_get_contents(SWAPS_PATH, &contents, NULL, NULL))
+		return;
+
+	/* Skip the "Filename Type Size Used Priority" header */
+	lines = g_strsplit(contents, "\n", 0 /*all tokens*/);
+	for(line = lines; *line != NULL; line++) {
+		struct stat st;
+		gchar* path;
+
+		if(line == lines || !(*line)[0])
+			continue;
+
+		gchar** fields = g_strsplit_set(*line, " \t", 2);
+		path = g_strcompress(fields[0]);
+		g_strfreev(fields);
+
+		/* Swap files live on a filesystem that's mounted anyway */
+		if(stat(path, &st) != 0 || !S_ISBLK(st.st_mode)) {
+			g_free(path);
+			continue;
+		}
+
+		MountEntry* entry = g_new0(MountEntry, 1);
+		entry->dev = st.st_rdev;
+		entry->source = path;
+		entry->mountpoint = g_strdup("swap");
+		entry->fstype = g_strdup("swap");
+		entry->is_swap = TRUE;
+		add_entry(table, entry);
+	}
+
+	g_strfreev(lines);
+	g_free(contents);
+}
+
+static void
+mount_table_clear(MountTable* table)
+{
+	g_hash_table_remove_all(table->by_dev);
+	g_hash_table_remove_all(table->by_disk);
+	g_slist_foreach(table->entries, (GFunc)mount_entry_free, NULL);
+	g_slist_free(table->entries);
+	table->entries = NULL;
+}
+
+static void
+mount_table_reload(MountTable* table)
+{
+	gchar* contents;
+
+	mount_table_clear(table);
+	table->dirty = FALSE;
+
+	if( (contents = read_proc_file(table->mountinfo_fd)) ) {
+		parse_mountinfo(table, contents);
+		g_free(contents);
+	}
+	parse_swaps(table);
+
+	g_debug("Mount table has %d entries", g_slist_length(table->entries));
+}
+
+static void
+mount_table_update(MountTable* table)
+{
+	struct pollfd pfd = { table->mountinfo_fd, POLLPRI, 0 };
+
+	/* This is the whole point: no change from the kernel, no work */
+	if(table->mountinfo_fd >= 0 && poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR)))
+		table->dirty = TRUE;
+
+	if(table->dirty)
+		mount_table_reload(table);
+}
+
+static gboolean
+mountinfo_changed_cb(GIOChannel* source, GIOCondition condition, gpointer data)
+{
+	MountTable* table = data;
+
+	/* Polling the fd from the main loop has already eaten the event, so
+	 * we have to reload here rather than wait for the next lookup */
+	g_debug("Mount table changed");
+	mount_table_reload(table);
+
+	if(table->changed_cb)
+		table->changed_cb(table, table->changed_data);
+
+	return TRUE;
+}
+
+
+/*
+ * Public functions
+ */
+
+MountTable*
+mount_table_new(void)
+{
+	MountTable* table = g_new0(MountTable, 1);
+
+	table->by_dev = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_slist_free_cb);
+	table->by_disk = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_slist_free_cb);
+
+	if( (table->mountinfo_fd = open(MOUNTINFO_PATH, O_RDONLY)) < 0 )
+		g_warning("Couldn't open %s, mounted volumes won't be detected", MOUNTINFO_PATH);
+
+	mount_table_reload(table);
+	return table;
+}
+
+void
+mount_table_free(MountTable* table)
+{
+	g_assert(table != NULL);
+
+	if(table->channel) {
+		g_io_channel_shutdown(table->channel, FALSE, NULL);
+		g_io_channel_unref(table->channel);
+	} else if(table->mountinfo_fd >= 0) {
+		close(table->mountinfo_fd);
+	}
+
+	mount_table_clear(table);
+	g_hash_table_destroy(table->by_dev);
+	g_hash_table_destroy(table->by_disk);
+	g_free(table);
+}
+
+const GSList*
+mount_table_lookup(MountTable* table, dev_t dev)
+{
+	mount_table_update(table);
+	return g_hash_table_lookup(table->by_dev, DEV_KEY(dev));
+}
+
+const GSList*
+mount_table_lookup_disk(MountTable* table, dev_t disk)
+{
+	mount_table_update(table);
+	return g_hash_table_lookup(table->by_disk, DEV_KEY(disk));
+}
+
+void
+mount_table_invalidate(MountTable* table)
+{
+	table->dirty = TRUE;
+}
+
+guint
+mount_table_add_watch(MountTable* table, MountTableChangedFunc callback, gpointer user_data)
+{
+	g_assert(table->channel == NULL);
+	if(table->mountinfo_fd < 0)
+		return 0;
+
+	table->changed_cb = callback;
+	table->changed_data = user_data;
+	table->channel = g_io_channel_unix_new(table->mountinfo_fd);
+	return g_io_add_watch(table->channel, G_IO_PRI | G_IO_ERR, mountinfo_changed_cb, table);
+}
@@ -0,0 +1,60 @@
+/*
+ * mount-info.h - Track mounted filesystems and swap by device number
+ *
+ * Copyright 2007 Riccardo Setti <giskard@autistici.org>
+ * 		  Paul Betts <paul.betts@gmail.com>
+ *
+ *
+ * License:
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this package; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _MOUNT_INFO_H
+#define _MOUNT_INFO_H
+
+#include <sys/types.h>
+#include <glib.h>
+
+typedef struct _MountEntry {
+	dev_t dev;			/* Device the filesystem lives on */
+	dev_t disk;			/* Whole disk containing dev */
+	gchar* source;			/* e.g. "/dev/sdb1" */
+	gchar* mountpoint;		/* "swap" for swap areas */
+	gchar* fstype;
+	gboolean is_swap;
+} MountEntry;
+
+typedef struct _MountTable MountTable;
+
+/* Called from the main loop whenever the kernel tells us the mount table has
+ * changed; the table has already been reloaded by then */
+typedef void (*MountTableChangedFunc) (MountTable* table, gpointer user_data);
+
+MountTable* mount_table_new(void);
+void mount_table_free(MountTable* table);
+
+/* The lookups only re-read /proc when the kernel has flagged a change, so
+ * they're cheap enough to call from anywhere. Don't free the lists */
+const GSList* mount_table_lookup(MountTable* table, dev_t dev);
+const GSList* mount_table_lookup_disk(MountTable* table, dev_t disk);
+
+/* Force a reload on the next lookup; /proc/swaps can't tell us when it
+ * changes, so callers should use this when they know something happened */
+void mount_table_invalidate(MountTable* table);
+
+guint mount_table_add_watch(MountTable* table, MountTableChangedFunc callback, gpointer user_data);
+
+#endif